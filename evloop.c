@@ -2,17 +2,37 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/queue.h>
 
 #include "platform.h"
 #include "evloop.h"
+#include "uring.h"
 
 struct event_ctx
 {
     int fd;
     struct event_cb* cb;
 
+    /**
+     * Client deleted the fd.
+     * Context is kept around until we are sure no events we've already received refer to it.
+     */
+    bool is_deleted;
+
+    /*
+     * io_uring backend state
+     */
+
+    /** We have a poll or read request in flight for this fd */
+    bool is_armed;
+
+    /** Eventfd counter buffer for read requests */
+    uint64_t counter;
+
     LIST_ENTRY(event_ctx) link;
 };
 
@@ -20,8 +40,11 @@ struct event_loop
 {
     enum {
         EV_MAX = 32,
+        EV_URING_ENTRIES = 256,
     };
 
+    enum evloop_backend backend;
+
     int epollfd;
 
     /*
@@ -32,31 +55,132 @@ struct event_loop
      */
     LIST_HEAD(, event_ctx) ev_map;
 
+    /** Events we got from last epoll_wait call */
+    struct epoll_event ev_inflight[EV_MAX];
+
     /*
-     * Inflight events bookkeeping.
+     * io_uring backend.
      *
-     * We keep track of a number of events we got from last epoll_wait call
-     * to make sure we ignore an event for an fd that has been closed by the user
-     * from their callback handler.
+     * Every registered fd has a single poll request in flight (or a read request for eventfds),
+     * which we rearm after dispatching its completion. Rearm requests are submitted
+     * with the same io_uring_enter call we wait for next completions with.
+     * Fds whose request fails for good get EPOLLERR and are dropped from the loop.
      */
-    size_t ev_pos;
-    size_t ev_count;
-    struct epoll_event ev_inflight[EV_MAX];
+    struct uring ring;
+
+    /** Context we are currently dispatching an event for */
+    struct event_ctx* ev_current;
+
+    /**
+     * Deleted contexts we may still see events for.
+     * epoll backend releases them after dispatching next batch of events,
+     * io_uring backend once the last request completes.
+     */
+    LIST_HEAD(, event_ctx) ev_zombies;
+
+    /**
+     * Event dispatch lock.
+     *
+     * Loop thread holds it while dispatching events, but not while waiting for them.
+     * Other threads can take it to serialize with event handlers and can add or delete fds.
+     * Lock is recursive so that handlers can call evloop functions.
+     */
+    pthread_mutex_t lock;
+
+    /** Number of threads waiting for the lock, loop thread yields to them while busy polling */
+    uint32_t lock_waiters;
+
+    /** Active pollers */
+    LIST_HEAD(, evloop_poller) pollers;
+
+    /** Bumped every time a poller is deleted to detect changes while we iterate pollers */
+    uint64_t pollers_gen;
+
+    /** Eventfd to interrupt the wait when a poller is added from another thread */
+    int wakefd;
+    struct event_cb wake_cb;
 };
 
-struct event_loop* evloop_create(void)
+static struct event_ctx* find_ctx(struct event_loop* evloop, int fd)
 {
-    struct event_loop* evloop = vhost_alloc(sizeof(*evloop));
-    evloop->epollfd = epoll_create1(EPOLL_CLOEXEC);
-    if (evloop->epollfd == -1) {
-        return NULL;
+    struct event_ctx* pctx = NULL;
+    LIST_FOREACH(pctx, &evloop->ev_map, link) {
+        if (pctx->fd == fd) {
+            break;
+        }
     }
 
-    evloop->ev_pos = 0;
-    evloop->ev_count = 0;
+    return pctx;
+}
+
+static void release_ctx(struct event_ctx* ctx)
+{
+    LIST_REMOVE(ctx, link);
+    vhost_free(ctx);
+}
+
+/* Waking up is all we need, loop runs pollers after dispatching events */
+static void handle_wake_event(struct event_cb* cb, int fd, uint32_t events)
+{
+}
+
+struct event_loop* evloop_create(enum evloop_backend backend)
+{
+    struct event_loop* evloop = vhost_zalloc(sizeof(*evloop));
+    evloop->backend = backend;
+    evloop->epollfd = -1;
+    evloop->ring.fd = -1;
+
+    switch (backend) {
+    case EVLOOP_BACKEND_EPOLL:
+        evloop->epollfd = epoll_create1(EPOLL_CLOEXEC);
+        if (evloop->epollfd == -1) {
+            goto error_out;
+        }
+        break;
+    case EVLOOP_BACKEND_IO_URING:
+        if (uring_init(&evloop->ring, EV_URING_ENTRIES, 0)) {
+            goto error_out;
+        }
+        break;
+    default:
+        goto error_out;
+    }
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&evloop->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    evloop->ev_current = NULL;
     LIST_INIT(&evloop->ev_map);
+    LIST_INIT(&evloop->ev_zombies);
+    LIST_INIT(&evloop->pollers);
+
+    evloop->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    evloop->wake_cb = (struct event_cb){ EPOLLIN | EVLOOP_F_EVENTFD, evloop, handle_wake_event };
+    if (evloop->wakefd < 0 || evloop_add_fd(evloop, evloop->wakefd, &evloop->wake_cb) != 0) {
+        evloop_free(evloop);
+        return NULL;
+    }
 
     return evloop;
+
+error_out:
+    vhost_free(evloop);
+    return NULL;
+}
+
+static void free_ctx_list(struct event_loop* evloop)
+{
+    while (!LIST_EMPTY(&evloop->ev_map)) {
+        release_ctx(LIST_FIRST(&evloop->ev_map));
+    }
+
+    while (!LIST_EMPTY(&evloop->ev_zombies)) {
+        release_ctx(LIST_FIRST(&evloop->ev_zombies));
+    }
 }
 
 void evloop_free(struct event_loop* evloop)
@@ -65,37 +189,293 @@ void evloop_free(struct event_loop* evloop)
         return;
     }
 
-    close(evloop->epollfd);
+    if (evloop->backend == EVLOOP_BACKEND_IO_URING) {
+        /* Destroying the ring cancels all requests, so we can release contexts afterwards */
+        uring_free(&evloop->ring);
+    } else {
+        close(evloop->epollfd);
+    }
 
-    while (!LIST_EMPTY(&evloop->ev_map)) {
-        struct event_ctx* pctx = LIST_FIRST(&evloop->ev_map);
-        LIST_REMOVE(pctx, link);
-        vhost_free(pctx);
+    if (evloop->wakefd >= 0) {
+        close(evloop->wakefd);
     }
 
+    free_ctx_list(evloop);
+    pthread_mutex_destroy(&evloop->lock);
     vhost_free(evloop);
 }
 
+void evloop_lock(struct event_loop* evloop)
+{
+    VHOST_VERIFY(evloop);
+
+    if (pthread_mutex_trylock(&evloop->lock) == 0) {
+        return;
+    }
+
+    __atomic_add_fetch(&evloop->lock_waiters, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&evloop->lock);
+    __atomic_sub_fetch(&evloop->lock_waiters, 1, __ATOMIC_RELAXED);
+}
+
+void evloop_unlock(struct event_loop* evloop)
+{
+    VHOST_VERIFY(evloop);
+    pthread_mutex_unlock(&evloop->lock);
+}
+
+/* Tell if we should wait for events or just check for them, called with loop lock held */
+static bool is_polling(struct event_loop* evloop)
+{
+    return !LIST_EMPTY(&evloop->pollers);
+}
+
+void evloop_add_poller(struct event_loop* evloop, struct evloop_poller* poller)
+{
+    VHOST_VERIFY(evloop);
+    VHOST_VERIFY(poller);
+    VHOST_VERIFY(poller->handler);
+
+    evloop_lock(evloop);
+
+    if (!poller->is_active) {
+        /* Loop thread could be waiting for events outside of dispatch, it has to start polling */
+        if (!is_polling(evloop) && evloop->ev_current == NULL) {
+            eventfd_write(evloop->wakefd, 1);
+        }
+
+        poller->is_active = true;
+        LIST_INSERT_HEAD(&evloop->pollers, poller, link);
+    }
+
+    evloop_unlock(evloop);
+}
+
+void evloop_del_poller(struct event_loop* evloop, struct evloop_poller* poller)
+{
+    VHOST_VERIFY(evloop);
+    VHOST_VERIFY(poller);
+
+    evloop_lock(evloop);
+
+    if (poller->is_active) {
+        poller->is_active = false;
+        LIST_REMOVE(poller, link);
+        evloop->pollers_gen++;
+    }
+
+    evloop_unlock(evloop);
+}
+
+/* Called with loop lock held */
+static void run_pollers(struct event_loop* evloop)
+{
+    struct evloop_poller* poller = LIST_FIRST(&evloop->pollers);
+    while (poller) {
+        uint64_t gen = evloop->pollers_gen;
+        struct evloop_poller* next = LIST_NEXT(poller, link);
+
+        poller->handler(poller);
+
+        /* Someone deleted a poller and next one might be gone, the rest will be polled next time */
+        if (gen != evloop->pollers_gen) {
+            break;
+        }
+
+        poller = next;
+    }
+}
+
+/* Release the lock after dispatch, letting other threads in if we are going to spin */
+static void unlock_after_dispatch(struct event_loop* evloop, bool polling)
+{
+    evloop_unlock(evloop);
+
+    if (polling) {
+        while (__atomic_load_n(&evloop->lock_waiters, __ATOMIC_RELAXED) != 0) {
+            sched_yield();
+        }
+    }
+}
+
+/*
+ * io_uring backend
+ */
+
+static struct io_uring_sqe* get_sqe(struct event_loop* evloop)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(&evloop->ring);
+    if (!sqe) {
+        /* Submission queue is full, flush it and try again */
+        uring_submit(&evloop->ring);
+        sqe = uring_get_sqe(&evloop->ring);
+        VHOST_VERIFY(sqe);
+    }
+
+    return sqe;
+}
+
+static void uring_arm_ctx(struct event_loop* evloop, struct event_ctx* ctx)
+{
+    struct io_uring_sqe* sqe = get_sqe(evloop);
+
+    if (ctx->cb->events & EVLOOP_F_EVENTFD) {
+        /* Reading an eventfd waits for it to become readable and consumes the counter in one go */
+        sqe->opcode = IORING_OP_READ;
+        sqe->addr = (uintptr_t) &ctx->counter;
+        sqe->len = sizeof(ctx->counter);
+    } else {
+        /*
+         * Single-shot poll to keep level-triggered semantics of the epoll backend:
+         * rearmed poll completes right away if fd is still ready.
+         */
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = ctx->cb->events & (uint32_t)(EPOLLIN | EPOLLHUP);
+    }
+
+    sqe->fd = ctx->fd;
+    sqe->user_data = (uintptr_t) ctx;
+    ctx->is_armed = true;
+}
+
+static void uring_cancel_ctx(struct event_loop* evloop, struct event_ctx* ctx)
+{
+    struct io_uring_sqe* sqe = get_sqe(evloop);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uintptr_t) ctx;
+    sqe->user_data = 0; /* We don't care about cancel results */
+}
+
+static int uring_run(struct event_loop* evloop)
+{
+    int res;
+
+    /* Rearm requests are queued by the dispatch below, submit them together with the wait */
+    evloop_lock(evloop);
+    unsigned to_submit = uring_flush_sq(&evloop->ring);
+    unsigned wait_nr = is_polling(evloop) ? 0 : 1;
+    evloop_unlock(evloop);
+
+again:
+    res = uring_enter(&evloop->ring, to_submit, wait_nr);
+    if (res < 0) {
+        if (res == -EINTR) {
+            to_submit = 0;
+            goto again;
+        }
+
+        return -1;
+    }
+
+    evloop_lock(evloop);
+
+    struct io_uring_cqe* cqe;
+    while ((cqe = uring_peek_cqe(&evloop->ring)) != NULL) {
+        struct event_ctx* ctx = (struct event_ctx*)(uintptr_t) cqe->user_data;
+        int32_t cqe_res = cqe->res;
+        uring_cqe_seen(&evloop->ring);
+
+        if (!ctx) {
+            continue;
+        }
+
+        ctx->is_armed = false;
+        if (ctx->is_deleted) {
+            release_ctx(ctx);
+            continue;
+        }
+
+        /* Request was interrupted rather than failed, fd is fine */
+        if (cqe_res == -EINTR || cqe_res == -EAGAIN || cqe_res == -ECANCELED) {
+            uring_arm_ctx(evloop, ctx);
+            continue;
+        }
+
+        uint32_t events;
+        if (cqe_res < 0) {
+            events = EPOLLERR;
+        } else if (ctx->cb->events & EVLOOP_F_EVENTFD) {
+            events = EPOLLIN;
+        } else {
+            events = (uint32_t) cqe_res & (uint32_t)(EPOLLIN | EPOLLHUP | EPOLLERR);
+        }
+
+        evloop->ev_current = ctx;
+        ctx->cb->handler(ctx->cb, ctx->fd, events);
+        evloop->ev_current = NULL;
+
+        if (ctx->is_deleted) {
+            /* Client deleted the fd from its handler */
+            release_ctx(ctx);
+        } else if (cqe_res >= 0) {
+            uring_arm_ctx(evloop, ctx);
+        } else {
+            /* Nothing would ever wait on this fd again, don't keep a dead registration around */
+            VHOST_LOG_ERROR2(cqe_res, "fd %d failed, removing it from event loop", ctx->fd);
+            release_ctx(ctx);
+        }
+    }
+
+    run_pollers(evloop);
+    unlock_after_dispatch(evloop, is_polling(evloop));
+    return 0;
+}
+
+static void uring_add_ctx(struct event_loop* evloop, struct event_ctx* ctx)
+{
+    uring_arm_ctx(evloop, ctx);
+
+    /* Loop thread may be waiting in io_uring_enter already, so we can't delay the submission */
+    if (evloop->ev_current == NULL) {
+        uring_submit(&evloop->ring);
+    }
+}
+
+/* Returns true if context must be kept around until its request completes */
+static bool uring_del_ctx(struct event_loop* evloop, struct event_ctx* ctx)
+{
+    if (ctx->is_armed) {
+        uring_cancel_ctx(evloop, ctx);
+        if (evloop->ev_current == NULL) {
+            uring_submit(&evloop->ring);
+        }
+
+        return true;
+    }
+
+    /* Context we are dispatching right now is released once handler returns */
+    return ctx == evloop->ev_current;
+}
+
 int evloop_add_fd(struct event_loop* evloop, int fd, struct event_cb* cb)
 {
     VHOST_VERIFY(evloop);
     VHOST_VERIFY(cb);
 
-    struct event_ctx* ctx = vhost_alloc(sizeof(*ctx));
+    struct event_ctx* ctx = vhost_zalloc(sizeof(*ctx));
     ctx->fd = fd;
     ctx->cb = cb;
 
-    struct epoll_event ev;
-    ev.events = cb->events & (uint32_t)(EPOLLIN | EPOLLHUP);
-    ev.data.ptr = ctx;
+    evloop_lock(evloop);
 
-    int error = epoll_ctl(evloop->epollfd, EPOLL_CTL_ADD, fd, &ev);
-    if (error) {
-        vhost_free(ctx);
-        return -1;
+    if (evloop->backend == EVLOOP_BACKEND_IO_URING) {
+        uring_add_ctx(evloop, ctx);
+    } else {
+        struct epoll_event ev;
+        ev.events = cb->events & (uint32_t)(EPOLLIN | EPOLLHUP);
+        ev.data.ptr = ctx;
+
+        int error = epoll_ctl(evloop->epollfd, EPOLL_CTL_ADD, fd, &ev);
+        if (error) {
+            evloop_unlock(evloop);
+            vhost_free(ctx);
+            return -1;
+        }
     }
 
     LIST_INSERT_HEAD(&evloop->ev_map, ctx, link);
+
+    evloop_unlock(evloop);
     return 0;
 }
 
@@ -103,47 +483,53 @@ int evloop_del_fd(struct event_loop* evloop, int fd)
 {
     VHOST_VERIFY(evloop);
 
-    int error = epoll_ctl(evloop->epollfd, EPOLL_CTL_DEL, fd, NULL);
-    if (error) {
-        return -1;
-    }
+    int error = 0;
+    evloop_lock(evloop);
 
-    /*
-     * Client may have deleted this fd when handling a EPOLLHUP event (for another fd).
-     * Mark it as ignored in current event list.
-     */
-    for (size_t i = evloop->ev_pos + 1; i < evloop->ev_count; ++i) {
-        struct event_ctx* ctx = evloop->ev_inflight[i].data.ptr;
-        if (ctx->fd == fd) {
-            evloop->ev_inflight[i].events = 0;
-        }
+    struct event_ctx* pctx = find_ctx(evloop, fd);
+    if (!pctx) {
+        error = -ENOENT;
+        goto out;
     }
 
-    /* Lookup and remove actual entry */
-    struct event_ctx* pctx = NULL;
-    LIST_FOREACH(pctx, &evloop->ev_map, link) {
-        if (pctx->fd == fd) {
-            break;
+    if (evloop->backend == EVLOOP_BACKEND_IO_URING) {
+        if (!uring_del_ctx(evloop, pctx)) {
+            release_ctx(pctx);
+            goto out;
+        }
+    } else {
+        error = epoll_ctl(evloop->epollfd, EPOLL_CTL_DEL, fd, NULL);
+        if (error) {
+            error = -1;
+            goto out;
         }
     }
 
-    if (!pctx) {
-        return -ENOENT;
-    }
-
+    /*
+     * Client may have deleted this fd when handling an event for another fd,
+     * or from another thread while loop thread was waiting for events.
+     * We may still have events referring to this context, so mark it as ignored
+     * and keep it around until it is safe to release.
+     */
     LIST_REMOVE(pctx, link);
-    vhost_free(pctx);
+    pctx->is_deleted = true;
+    LIST_INSERT_HEAD(&evloop->ev_zombies, pctx, link);
 
-    return 0;
+out:
+    evloop_unlock(evloop);
+    return error;
 }
 
-int evloop_run(struct event_loop* evloop)
+static int epoll_run(struct event_loop* evloop)
 {
-    VHOST_VERIFY(evloop);
     int nfd;
 
+    evloop_lock(evloop);
+    int timeout = is_polling(evloop) ? 0 : -1;
+    evloop_unlock(evloop);
+
 again:
-    nfd = epoll_wait(evloop->epollfd, evloop->ev_inflight, EV_MAX, -1);
+    nfd = epoll_wait(evloop->epollfd, evloop->ev_inflight, EV_MAX, timeout);
     if (nfd < 0) {
         if (errno == EINTR) {
             goto again;
@@ -152,16 +538,52 @@ again:
         return -1;
     }
 
-    evloop->ev_count = nfd;
-    for (evloop->ev_pos = 0; evloop->ev_pos < evloop->ev_count; ++evloop->ev_pos) {
+    evloop_lock(evloop);
+
+    for (int i = 0; i < nfd; ++i) {
+        struct event_ctx* pctx = evloop->ev_inflight[i].data.ptr;
+        uint32_t events = evloop->ev_inflight[i].events;
+
         /* Event may have been deleted - skip it */
-        if (evloop->ev_inflight[evloop->ev_pos].events == 0) {
+        if (pctx->is_deleted) {
             continue;
         }
 
-        struct event_ctx* pctx = evloop->ev_inflight[evloop->ev_pos].data.ptr;
-        pctx->cb->handler(pctx->cb, pctx->fd, evloop->ev_inflight[evloop->ev_pos].events);
+        /* Consume eventfd counter on behalf of the client */
+        if ((pctx->cb->events & EVLOOP_F_EVENTFD) && (events & EPOLLIN)) {
+            eventfd_t unused;
+            if (eventfd_read(pctx->fd, &unused)) {
+                events = (errno == EAGAIN ? events & ~(uint32_t)EPOLLIN : events | EPOLLERR);
+                if (events == 0) {
+                    continue;
+                }
+            }
+        }
+
+        evloop->ev_current = pctx;
+        pctx->cb->handler(pctx->cb, pctx->fd, events);
+        evloop->ev_current = NULL;
+    }
+
+    /*
+     * Any epoll_wait that could have returned events for deleted contexts has finished by now
+     */
+    while (!LIST_EMPTY(&evloop->ev_zombies)) {
+        release_ctx(LIST_FIRST(&evloop->ev_zombies));
     }
 
+    run_pollers(evloop);
+    unlock_after_dispatch(evloop, is_polling(evloop));
     return 0;
 }
+
+int evloop_run(struct event_loop* evloop)
+{
+    VHOST_VERIFY(evloop);
+
+    if (evloop->backend == EVLOOP_BACKEND_IO_URING) {
+        return uring_run(evloop);
+    } else {
+        return epoll_run(evloop);
+    }
+}
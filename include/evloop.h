@@ -1,13 +1,36 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <sys/queue.h>
 #include <sys/epoll.h> /* Pull in epoll event types for client */
 
 /**
- * General-purpose epoll-based event loop context
+ * General-purpose event loop context
  */
 struct event_loop;
 
+/**
+ * Event loop implementation to use
+ */
+enum evloop_backend
+{
+    /** epoll_wait based loop */
+    EVLOOP_BACKEND_EPOLL = 0,
+
+    /**
+     * io_uring based loop.
+     * Eventfds are read and rearmed within the same io_uring_enter call we wait for events with.
+     */
+    EVLOOP_BACKEND_IO_URING,
+};
+
+/**
+ * Registered fd is an eventfd and event loop will consume its counter before calling the handler.
+ * Handler should not read the eventfd by itself.
+ */
+#define EVLOOP_F_EVENTFD (1u << 24)
+
 /**
  * Client-registered event callback.
  * Multiple fds can be used with a common callback handler.
@@ -16,7 +39,7 @@ struct event_cb
 {
     /**
      * epoll event mask we are interested in,
-     * currently only EPOLLIN and EPOLLHUP are supported
+     * currently only EPOLLIN and EPOLLHUP are supported, optionally combined with EVLOOP_F_EVENTFD
      */
     uint32_t events;
 
@@ -27,10 +50,46 @@ struct event_cb
     void (*handler) (struct event_cb* cb, int fd, uint32_t events);
 };
 
-struct event_loop* evloop_create(void);
+/**
+ * Client-registered poller.
+ * While event loop has pollers it does not block waiting for events
+ * and calls every poller handler each time it has checked for events.
+ */
+struct evloop_poller
+{
+    /** private caller data */
+    void* ptr;
+
+    /** poll handler, can delete the poller */
+    void (*handler) (struct evloop_poller* poller);
+
+    /** Fields below are owned by the event loop */
+    bool is_active;
+    LIST_ENTRY(evloop_poller) link;
+};
+
+struct event_loop* evloop_create(enum evloop_backend backend);
 void evloop_free(struct event_loop* evloop);
 
 int evloop_add_fd(struct event_loop* evloop, int fd, struct event_cb* cb);
 int evloop_del_fd(struct event_loop* evloop, int fd);
 
+/**
+ * Pollers can be added from other threads, event loop stops waiting for events to run them.
+ */
+void evloop_add_poller(struct event_loop* evloop, struct evloop_poller* poller);
+void evloop_del_poller(struct event_loop* evloop, struct evloop_poller* poller);
+
+/**
+ * Wait for events and dispatch them, then run pollers.
+ * Does not block if there are active pollers.
+ * Only one thread can run a given event loop.
+ */
 int evloop_run(struct event_loop* evloop);
+
+/**
+ * Serialize with event handlers of a loop running on another thread.
+ * Lock is recursive and is held by the loop thread while it dispatches events.
+ */
+void evloop_lock(struct event_loop* evloop);
+void evloop_unlock(struct event_loop* evloop);
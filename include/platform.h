@@ -50,7 +50,7 @@ static inline void* vhost_alloc(size_t size)
 static inline void* vhost_zalloc(size_t size)
 {
     void* res = vhost_alloc(size);
-    memset(res, 0, sizeof(*res));
+    memset(res, 0, size);
     return res;
 }
 
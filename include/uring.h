@@ -0,0 +1,101 @@
+/**
+ * Minimal io_uring wrapper over raw syscalls
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <linux/io_uring.h> /* Pull in sqe/cqe definitions for client */
+
+/**
+ * Mapped io_uring instance
+ */
+struct uring
+{
+    int fd;
+
+    /** Setup parameters as returned by the kernel */
+    struct io_uring_params params;
+
+    /** Submission queue ring */
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+
+    /** Local sq tail, sqes up to it are filled but not yet visible to the kernel */
+    unsigned sqe_tail;
+
+    /** Completion queue ring */
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+
+    /** Mapped regions */
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+/**
+ * Create io_uring instance with at least the given number of sq entries
+ */
+int uring_init(struct uring* ring, unsigned entries, unsigned flags);
+
+/**
+ * Destroy io_uring instance
+ */
+void uring_free(struct uring* ring);
+
+/**
+ * Get next zeroed sqe to fill.
+ * Returns NULL if submission queue is full and should be submitted first.
+ */
+struct io_uring_sqe* uring_get_sqe(struct uring* ring);
+
+/**
+ * Make all filled sqes visible to the kernel.
+ * Returns number of sqes to pass to uring_enter.
+ */
+unsigned uring_flush_sq(struct uring* ring);
+
+/**
+ * Submit to_submit sqes made visible by uring_flush_sq and wait for at least wait_nr completions.
+ * Returns number of submitted sqes or negative error code.
+ */
+int uring_enter(struct uring* ring, unsigned to_submit, unsigned wait_nr);
+
+/**
+ * Submit all filled sqes and wait for at least wait_nr completions.
+ * Returns number of submitted sqes or negative error code.
+ */
+int uring_submit_and_wait(struct uring* ring, unsigned wait_nr);
+
+/**
+ * Submit all filled sqes without waiting
+ */
+static inline int uring_submit(struct uring* ring)
+{
+    return uring_submit_and_wait(ring, 0);
+}
+
+/**
+ * Peek at the next available completion, returns NULL if there are none.
+ * Completion stays in the ring until uring_cqe_seen.
+ */
+struct io_uring_cqe* uring_peek_cqe(struct uring* ring);
+
+/**
+ * Release completion obtained from uring_peek_cqe back to the kernel
+ */
+void uring_cqe_seen(struct uring* ring);
+
+/**
+ * Register or unregister resources with the ring, see io_uring_register(2)
+ */
+int uring_register(struct uring* ring, unsigned opcode, const void* arg, unsigned nr_args);
@@ -8,6 +8,7 @@
 /**
  * Feature bits
  */
+#define VHOST_F_LOG_ALL                 26
 #define VHOST_USER_F_PROTOCOL_FEATURES  30
 
 /**
@@ -75,6 +76,18 @@
 #define VHOST_USER_SET_STATUS               39
 #define VHOST_USER_GET_STATUS               40
 
+/**
+ * Slave message ids, sent by us over the channel master gives us with VHOST_USER_SET_SLAVE_REQ_FD
+ */
+#define VHOST_USER_SLAVE_IOTLB_MSG                  1
+#define VHOST_USER_SLAVE_CONFIG_CHANGE_MSG          2
+#define VHOST_USER_SLAVE_VRING_HOST_NOTIFIER_MSG    3
+#define VHOST_USER_SLAVE_VRING_CALL                 4
+#define VHOST_USER_SLAVE_VRING_ERR                  5
+
+/** Vring area message carries no fd */
+#define VHOST_USER_VRING_NOFD_MASK  (1ull << 8)
+
 /**
  * Message flags
  */
@@ -156,6 +169,36 @@ struct vhost_user_message
             struct vhost_user_mem_region regions[8];
         } mem_regions;
 
+        /** Dirty page log description */
+        struct {
+            /** size of the log bitmap */
+            uint64_t mmap_size;
+
+            /** offset of the log bitmap from the start of the supplied file descriptor */
+            uint64_t mmap_offset;
+        } log;
+
+        /** Inflight I/O tracking shared memory description */
+        struct {
+            /** size of the region */
+            uint64_t mmap_size;
+
+            /** offset of the region from the start of the supplied file descriptor */
+            uint64_t mmap_offset;
+
+            /** number of queues the region covers */
+            uint16_t num_queues;
+
+            /** size of each queue in descriptors */
+            uint16_t queue_size;
+        } inflight;
+
+        /** Single memory region description for memory slot messages */
+        struct {
+            uint64_t padding;
+            struct vhost_user_mem_region region;
+        } mem_slot;
+
         /** Virtio device config space */
         struct {
             /** offset of virtio device's configuration space */
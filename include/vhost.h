@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <sys/queue.h>
+#include <sys/types.h>
 
 #include "evloop.h"
 #include "vhost-protocol.h"
@@ -15,6 +16,66 @@
 struct vhost_user_message;
 struct virtio_dev;
 
+/**
+ * Maximum number of guest memory slots master can configure
+ * with VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS
+ */
+#define VHOST_MAX_MEM_SLOTS VIRTIO_MEMORY_MAX_REGIONS
+
+/**
+ * Guest memory mapping policy flags
+ */
+
+/** Prefault guest memory when it is mapped, so that first I/O to a page does not take a fault */
+#define VHOST_MEM_F_POPULATE    (1u << 0)
+
+/** Lock guest memory in RAM, also prefaults it */
+#define VHOST_MEM_F_MLOCK       (1u << 1)
+
+/** Do not bind guest memory to any NUMA node */
+#define VHOST_MEM_NODE_ANY      (-1)
+
+/** Maximum NUMA node id guest memory can be bound to */
+#define VHOST_MAX_NUMA_NODE     1023
+
+/**
+ * How guest memory regions are mapped, see vhost_set_mem_policy.
+ *
+ * Hugetlbfs-backed regions are always mapped with their huge page size alignment
+ * and shmem-backed regions are always advised to use transparent huge pages,
+ * policy only controls what costs extra memory or privileges.
+ */
+struct vhost_mem_policy
+{
+    /** VHOST_MEM_F_* flags */
+    uint32_t flags;
+
+    /**
+     * Preferred NUMA node for guest memory, VHOST_MEM_NODE_ANY to leave placement to the kernel.
+     *
+     * Only pages not yet faulted in are affected: pages master already touched are mapped
+     * by master as well and stay where they are. For shmem and hugetlbfs backed memory
+     * the preference becomes the file's shared policy, so it also overrides master's own
+     * memory backend placement for pages faulted in later, including by master.
+     */
+    int numa_node;
+};
+
+/**
+ * Guest memory region as received from master and mapped into our address space
+ */
+struct vhost_mem_slot
+{
+    struct vhost_user_mem_region region;
+
+    /** Mapped region */
+    void* hva;
+
+    /** Backing file identity, lets us keep the mapping when master resends an unchanged region */
+    dev_t st_dev;
+    ino_t st_ino;
+};
+
 /**
  * Vring is a vhost name for a virtio virtqueue over shared guest memory
  * and its associated vhost context.
@@ -30,9 +91,22 @@ struct vring
     /** Event fd we use to signal used buffers */
     int callfd;
 
+    /**
+     * Master asked for in-band calls, callfd is our own eventfd and the global event loop
+     * relays its signals to master with VHOST_USER_SLAVE_VRING_CALL
+     */
+    bool has_inband_call;
+    struct event_cb inband_call_cb;
+
+    /** In-band call was signalled before master gave us the slave channel, relayed once it does */
+    bool has_pending_inband_call;
+
     /** Event fd we use to signal errors */
     int errfd;
 
+    /** Event fd device uses to wake up the vring handler from other threads, e.g. on async completions */
+    int wakefd;
+
     /** Size of the virtqueue (number of descriptors) */
     uint32_t size;
 
@@ -55,6 +129,53 @@ struct vring
 
     /** Event handler for kickfd */
     struct event_cb kick_cb;
+
+    /** Event handler for wakefd */
+    struct event_cb wake_cb;
+
+    /** Event loop servicing vring kicks, global vhost event loop by default */
+    struct event_loop* evloop;
+
+    /**
+     * Busy polling state.
+     *
+     * After handling a kick vring disables guest notifications and polls the virtqueue
+     * for up to poll_window_ns without new buffers before going back to waiting for kicks.
+     * Window adapts between VRING_POLL_MIN_WINDOW_NS and poll_max_ns depending on whether
+     * buffers keep arriving while we poll.
+     */
+
+    /** Maximum polling window, 0 if polling is disabled */
+    uint64_t poll_max_ns;
+
+    /** Current polling window */
+    uint64_t poll_window_ns;
+
+    /** We stop polling if no buffers arrive until this time */
+    uint64_t poll_deadline_ns;
+
+    /** Number of times we found new buffers during current polling session */
+    uint32_t poll_hits;
+
+    /** Vring poller is registered in its event loop */
+    struct evloop_poller poller;
+
+    /**
+     * Host notifier state.
+     *
+     * Master maps a page of ours into the guest as the vring notification area,
+     * so guest kicks become plain memory writes instead of ioeventfd round trips.
+     * We busy poll the doorbell word in that page alongside the kickfd.
+     */
+
+    /** Offer master a host notifier for this vring */
+    bool use_host_notifier;
+
+    /** Doorbell word guest writes to, NULL if master was not given a host notifier */
+    uint16_t* doorbell;
+
+    /** Doorbell poller is registered in the event loop together with kickfd */
+    struct evloop_poller doorbell_poller;
 };
 
 /**
@@ -112,12 +233,43 @@ struct vhost_dev
     /** Array of vrings for this device, num_queues total */
     struct vring* vrings;
 
-    /** Mapped memory regions for this device */
-    struct virtio_memory_map memory_map;
+    /**
+     * Mapped memory regions for this device.
+     * Published maps are immutable, updates swap in a new copy (see publish_memory_map).
+     */
+    struct virtio_memory_map* memory_map;
+
+    /** How we map new memory slots */
+    struct vhost_mem_policy mem_policy;
 
-    /** Memory regions as received from guest */
-    uint32_t num_regions;
-    struct vhost_user_mem_region regions[VHOST_USER_MAX_FDS];
+    /** Memory slots as received from master, in no particular order */
+    uint32_t num_mem_slots;
+    struct vhost_mem_slot mem_slots[VHOST_MAX_MEM_SLOTS];
+
+    /** Master asked us to log our guest memory writes with VHOST_F_LOG_ALL */
+    bool log_all;
+
+    /** Dirty page log received with VHOST_USER_SET_LOG_BASE, bitmap is NULL if we don't have one */
+    struct virtio_dirty_log log;
+    uint64_t log_mmap_size;
+
+    /**
+     * Inflight I/O tracking region shared with master, base is NULL if we don't have one.
+     * Region holds a virtq_inflight of inflight_queue_size descriptors for each of inflight_num_queues queues.
+     * We keep its fd to pass it to master in reply to VHOST_USER_GET_INFLIGHT_FD.
+     */
+    void* inflight_base;
+    uint64_t inflight_mmap_size;
+    int inflight_fd;
+    uint16_t inflight_num_queues;
+    uint16_t inflight_queue_size;
+
+    /** Channel for our requests to master received with VHOST_USER_SET_SLAVE_REQ_FD, -1 if we don't have one */
+    int slave_fd;
+
+    /** Host notifier pages for all vrings, one page per vring, NULL until first vring needs one */
+    void* notify_area;
+    int notify_fd;
 
     /** Virtio device we are servicing */
     struct virtio_dev* vdev;
@@ -125,6 +277,13 @@ struct vhost_dev
     /** Client handler for device vring events */
     vring_event_handler_cb vring_cb;
 
+    /**
+     * Eventfd to request device reset from the global event loop,
+     * used by vrings running on their own event loops.
+     */
+    int resetfd;
+    struct event_cb reset_cb;
+
     LIST_ENTRY(vhost_dev) link;
 };
 
@@ -142,11 +301,48 @@ int vhost_register_device_server(struct vhost_dev* dev,
                                  struct virtio_dev* vdev,
                                  vring_event_handler_cb vring_cb);
 
+/**
+ * Assign vring to be serviced by the given event loop, e.g. one run by a vhost_worker.
+ * Must be called before the vring kickfd is received from the master.
+ */
+int vhost_set_vring_evloop(struct vhost_dev* dev, uint8_t vring_idx, struct event_loop* evloop);
+
+/**
+ * Enable adaptive busy polling for the vring.
+ *
+ * @budget_us   Maximum time in microseconds to poll the vring without seeing new buffers
+ *              before going back to waiting for guest kicks, 0 to disable polling.
+ */
+int vhost_set_vring_polling(struct vhost_dev* dev, uint8_t vring_idx, uint32_t budget_us);
+
+/**
+ * Offer master a host notifier for the vring with VHOST_USER_PROTOCOL_F_HOST_NOTIFIER.
+ *
+ * Guest kicks then become writes to a page we share with master and the vring event loop
+ * busy polls that page while the vring is enabled, so the vring must first be given
+ * a dedicated event loop with vhost_set_vring_evloop, -EINVAL otherwise.
+ * Must be called before the vring kickfd is received from the master.
+ */
+int vhost_set_vring_host_notifier(struct vhost_dev* dev, uint8_t vring_idx, bool enable);
+
+/**
+ * Set guest memory mapping policy for the device.
+ * Applies to regions mapped after the call, so it is best set before master connects.
+ * Policy is applied best effort: regions are still mapped if e.g. mlock or NUMA binding fails.
+ */
+int vhost_set_mem_policy(struct vhost_dev* dev, const struct vhost_mem_policy* policy);
+
 /**
  * Reset vhost device state and drop master connection if any
  */
 void vhost_reset_dev(struct vhost_dev* dev);
 
+/**
+ * Select event loop implementation for vhost.
+ * Must be called before any devices are registered.
+ */
+int vhost_set_evloop_backend(enum evloop_backend backend);
+
 /**
  * Run main vhost event loop
  */
@@ -26,6 +26,8 @@ enum blk_io_type
     BLK_IO_WRITE = VIRTIO_BLK_T_OUT,
     BLK_IO_FLUSH = VIRTIO_BLK_T_FLUSH,
     BLK_IO_GET_ID = VIRTIO_BLK_T_GET_ID,
+    BLK_IO_DISCARD = VIRTIO_BLK_T_DISCARD,
+    BLK_IO_WRITE_ZEROES = VIRTIO_BLK_T_WRITE_ZEROES,
 };
 
 /**
@@ -37,6 +39,18 @@ enum blk_io_status
     BLK_IOERROR = VIRTIO_BLK_S_IOERR,
 };
 
+/**
+ * Sector range of a discard or write zeroes request
+ */
+struct blk_io_range
+{
+    uint64_t sector;
+    uint32_t num_sectors;
+
+    /** Write zeroes may deallocate the range, only set if device allows it */
+    bool unmap;
+};
+
 /**
  * In-flight block request
  */
@@ -49,12 +63,16 @@ struct blk_io_request
      * Fields below are only valid if request is not BLK_IO_FLUSH
      */
 
-    /** Request start sector */
+    /** Request start sector, first range sector for discard and write zeroes */
     uint64_t sector;
 
     /** Total sectors in request */
     uint32_t total_sectors;
 
+    /** Discard and write zeroes: ranges copied from the request, nvecs is 0 for them */
+    uint32_t nranges;
+    struct blk_io_range* ranges;
+
     /** Size of the scatter-gather list below */
     uint32_t nvecs;
 
@@ -62,6 +80,49 @@ struct blk_io_request
     struct virtio_iovec vecs[/* nvecs */];
 };
 
+struct virtio_blk;
+
+/**
+ * Asynchronous block backend.
+ *
+ * Backend receives requests on the thread servicing the queue and completes them later
+ * from any thread with virtio_blk_post_completion. Posted completions are handed back to
+ * the driver by the next virtio_blk_process_queue call on the queue's thread.
+ */
+struct virtio_blk_backend_ops
+{
+    /**
+     * Start executing a request.
+     * Returns 0 if request will be completed with virtio_blk_post_completion,
+     * negative error code to have it failed right away.
+     */
+    int (*submit) (struct virtio_blk* vblk, struct virtqueue* vq, struct blk_io_request* bio);
+
+    /**
+     * Optional, called on the queue's thread each time the queue is processed, after new
+     * requests were submitted. Backend can flush its submissions and reap completions here.
+     *
+     * Also called in a loop while in-flight requests are drained before the queue is stopped
+     * or guest memory is unmapped. That happens on the control thread, which holds the queue's loop locked, so calls
+     * for a queue never overlap but can come from different threads. Per-queue backend state
+     * must not be tied to the queue's thread.
+     */
+    void (*poll) (struct virtio_blk* vblk, struct virtqueue* vq);
+
+    /**
+     * Optional, called when guest memory layout changes, see virtio_dev set_memory_map.
+     * Backend can register request buffer memory with the kernel here.
+     */
+    void (*set_memory_map) (struct virtio_blk* vblk, const struct virtio_memory_map* map);
+
+    /**
+     * Optional, switches storage between writeback and writethrough caching when driver changes
+     * the writeback config field. Device offers VIRTIO_BLK_F_CONFIG_WCE only if backend has this callback.
+     * Not called concurrently with queue processing. Returns 0 if storage now runs in the requested mode.
+     */
+    int (*set_writeback) (struct virtio_blk* vblk, bool writeback);
+};
+
 /**
  * Virtio-blk emulated device model
  */
@@ -81,11 +142,59 @@ struct virtio_blk
     /** Backend optimal block size, must be a multiple of 512 */
     uint32_t block_size;
 
+    /**
+     * Maximum data segments in a single request, 0 selects the default of 128, at most VIRTQ_MAX_SIZE.
+     * Request contexts are preallocated for this many segments per queue slot, or queue size if smaller.
+     */
+    uint32_t seg_max;
+
+    /** Maximum size of a single data segment in bytes, 0 for no limit */
+    uint32_t size_max;
+
+    /**
+     * Optional topology hints for driver to line up requests with the backend, in block_size units:
+     * log2 of blocks per physical block, offset of the first aligned block,
+     * suggested minimum and optimal io sizes.
+     */
+    uint8_t physical_block_exp;
+    uint8_t alignment_offset;
+    uint16_t min_io_size;
+    uint32_t opt_io_size;
+
     /** Device is read-only */
     bool readonly;
 
-    /** Underlying storage supports caching, device needs to expose writeback flush to driver */
+    /**
+     * Underlying storage supports caching, device needs to expose writeback flush to driver.
+     * Backend then gets BLK_IO_FLUSH requests and has to make all completed writes durable before completing them.
+     * With backend set_writeback this is the initial cache mode, updated when driver switches it.
+     */
     bool writeback;
+
+    /**
+     * Backend can discard sector ranges: maximum sectors in a single range, 0 if discard is not supported.
+     * A single request carries at most max_discard_segs ranges (0 means 1), driver is asked
+     * to align them to discard_sector_alignment sectors.
+     */
+    uint32_t max_discard_sectors;
+    uint32_t max_discard_segs;
+    uint32_t discard_sector_alignment;
+
+    /** Same for write zeroes, 0 max_write_zeroes_sectors if not supported */
+    uint32_t max_write_zeroes_sectors;
+    uint32_t max_write_zeroes_segs;
+
+    /** Write zeroes may deallocate ranges when driver asks for it */
+    bool write_zeroes_may_unmap;
+
+    /**
+     * Number of request virtqueues, 0 is treated as 1.
+     * Each virtqueue has its own request contexts and can be serviced from a separate thread.
+     */
+    uint16_t num_queues;
+
+    /** Optional asynchronous backend serving requests for virtio_blk_process_queue */
+    const struct virtio_blk_backend_ops* backend;
 };
 
 /**
@@ -100,7 +209,38 @@ int virtio_blk_init(struct virtio_blk* vblk);
  */
 int virtio_blk_dequeue_request(struct virtio_blk* vblk, struct virtqueue* vq, struct blk_io_request** bio);
 
+/**
+ * Dequeue up to max requests from the device's virtqueue at once.
+ * Returns number of requests put into bios or -ENOENT if virtqueue had nothing available.
+ * Malformed requests are dropped, so 0 means caller should try again.
+ */
+int virtio_blk_dequeue_requests(struct virtio_blk* vblk, struct virtqueue* vq, struct blk_io_request** bios, size_t max);
+
 /**
  * Complete block request with status
  */
 void virtio_blk_complete_request(struct virtio_blk* vblk, struct blk_io_request* bio, enum blk_io_status res);
+
+/**
+ * Complete a batch of block requests with their statuses.
+ * Each affected virtqueue publishes its used elements and notifies the driver once for the whole batch.
+ */
+void virtio_blk_complete_requests(struct virtio_blk* vblk,
+                                  struct blk_io_request** bios,
+                                  const enum blk_io_status* res,
+                                  size_t nbios);
+
+/**
+ * Service device's virtqueue with the asynchronous backend.
+ * Returns completions posted since the last call to the driver, then dequeues
+ * available requests and submits them to the backend.
+ * Called on the thread servicing the queue, on every kick and queue wakeup.
+ */
+int virtio_blk_process_queue(struct virtio_blk* vblk, struct virtqueue* vq);
+
+/**
+ * Post completion of a request submitted to the asynchronous backend.
+ * Safe to call from any thread, wakes up the queue to return request to the driver.
+ * Completions posted from backend submit or poll are returned right after the call without a wakeup.
+ */
+void virtio_blk_post_completion(struct virtio_blk* vblk, struct blk_io_request* bio, enum blk_io_status res);
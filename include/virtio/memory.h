@@ -15,12 +15,24 @@
 struct virtio_memory_map
 {
     enum {
-        VIRTIO_MEMORY_MAX_REGIONS = 16,
+        VIRTIO_MEMORY_MAX_REGIONS = 512,
     };
 
     /** Number of memory regions in the table */
     uint32_t num_regions;
 
+    /**
+     * Globally unique tag of the current map contents, changes every time a region is added.
+     * Empty map has generation 0, generations of non-empty maps never wrap around to UINT64_MAX.
+     */
+    uint64_t generation;
+
+    /**
+     * Start gpa of every region, in the same order as regions.
+     * Kept apart from region payload so that lookups only scan a compact array.
+     */
+    uint64_t gpa_start[VIRTIO_MEMORY_MAX_REGIONS];
+
     /** Variable-sized array of mapped guest regions, not intersecting, sorted by gpa */
     struct virtio_memory_region {
         /** guest-physical base address */
@@ -40,15 +52,84 @@ struct virtio_memory_map
 /**
  * Initializer for empty memory map
  */
-#define VIRTIO_INIT_MEMORY_MAP ((struct virtio_memory_map) {.num_regions = 0, .regions = {0}})
+#define VIRTIO_INIT_MEMORY_MAP ((struct virtio_memory_map) {.num_regions = 0, .generation = 0, .gpa_start = {0}, .regions = {0}})
+
+/**
+ * Remembers the last region a lookup landed in.
+ * Cache is valid only for the map generation it was filled for.
+ */
+struct virtio_memory_cache
+{
+    uint64_t generation;
+    uint32_t region_id;
+};
+
+/**
+ * Initializer for empty lookup cache, its generation matches no map, including an empty one
+ */
+#define VIRTIO_INIT_MEMORY_CACHE ((struct virtio_memory_cache) {.generation = UINT64_MAX, .region_id = 0})
 
 /**
  * Insert a new region into the map
  */
 int virtio_add_guest_region(struct virtio_memory_map* mem, uint64_t gpa, uint64_t len, void* hva, bool ro);
 
+/**
+ * Remove region with exactly this gpa and length from the map.
+ * Removed region is copied to mr if it is not NULL.
+ */
+int virtio_remove_guest_region(struct virtio_memory_map* mem, uint64_t gpa, uint64_t len, struct virtio_memory_region* mr);
+
 /**
  * Find mapped host address that covers specified guest gpa range.
  * Returns MAP_FAILED if regions is invalid.
  */
 void* virtio_find_gpa_range(const struct virtio_memory_map* mem, uint64_t gpa, uint32_t len, bool ro);
+
+/**
+ * Same as virtio_find_gpa_range, but checks the region of the previous lookup through cache first
+ * and updates cache on a miss.
+ * Cache must not be shared between threads.
+ */
+void* virtio_find_gpa_range_cached(const struct virtio_memory_map* mem,
+                                   struct virtio_memory_cache* cache,
+                                   uint64_t gpa,
+                                   uint32_t len,
+                                   bool ro);
+
+/**
+ * Translate mapped host address back to guest physical address.
+ * Returns (uint64_t)MAP_FAILED if hva is not within any region,
+ * otherwise stores the number of bytes from hva to the end of its region in region_len.
+ */
+uint64_t virtio_find_hva_gpa(const struct virtio_memory_map* mem, const void* hva, uint64_t* region_len);
+
+/**
+ * Size of the guest page tracked by a single dirty log bit
+ */
+#define VIRTIO_LOG_PAGE_SHIFT 12
+
+/**
+ * Guest memory dirty page log shared with the master during live migration.
+ * Bit N of the log covers guest physical page N.
+ */
+struct virtio_dirty_log
+{
+    /**
+     * Log bitmap accessed in 64-bit words.
+     * On a little-endian host this has the same bit layout as the byte array master scans.
+     */
+    uint64_t* bitmap;
+
+    /** Number of guest pages covered by the bitmap */
+    uint64_t npages;
+};
+
+/**
+ * Mark guest pages covering the range dirty, pages beyond the end of the log are ignored.
+ *
+ * Memory writes being logged must be complete by the time we are called.
+ * Bitmap words are only updated with an atomic or when they miss some of the range bits,
+ * so repeated writes to the same pages do not keep bouncing bitmap cache lines.
+ */
+void virtio_log_dirty_range(struct virtio_dirty_log* log, uint64_t gpa, uint64_t len);
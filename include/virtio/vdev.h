@@ -10,6 +10,9 @@
 
 #define VIRTIO_DEV_CONFIG_SPACE_SIZE 256
 
+struct virtqueue;
+struct virtio_memory_map;
+
 /**
  * This is a generic virtio device, it contains data common for all virtio device types.
  */
@@ -31,6 +34,50 @@ struct virtio_dev
      *              Buffer size guaranteed to be >= config_size.
      */
     void (*get_config) (struct virtio_dev* vdev, void* buffer);
+
+    /**
+     * Optional device-specific handler for driver writes to config space.
+     * Not called concurrently with queue handlers.
+     *
+     * @data        Bytes to write at config space offset, range is within config_size.
+     */
+    int (*set_config) (struct virtio_dev* vdev, const void* data, uint32_t offset, uint32_t size);
+
+    /**
+     * Optional device-specific handler called after one of device's virtqueues was started.
+     * Device can attach its per-queue context to vq->priv here.
+     *
+     * @wakefd      Eventfd the device can signal from any thread to have the queue handler
+     *              called again on the thread servicing the queue, -1 if there is none.
+     */
+    int (*start_queue) (struct virtio_dev* vdev, struct virtqueue* vq, int wakefd);
+
+    /**
+     * Optional device-specific handler called before one of device's virtqueues is stopped.
+     * Device should release anything it has attached to the queue in start_queue.
+     */
+    void (*stop_queue) (struct virtio_dev* vdev, struct virtqueue* vq);
+
+    /**
+     * Optional device-specific handler to wait for requests the device still has in flight on
+     * a running queue, e.g. submitted to an asynchronous backend, and return them to the driver.
+     * Called with the queue's thread locked out before guest memory those requests could reference goes away.
+     */
+    void (*drain_queue) (struct virtio_dev* vdev, struct virtqueue* vq);
+
+    /**
+     * Optional device-specific handler to return requests the device has already completed
+     * without taking new ones from the queue. Called on the queue's thread while the queue is disabled.
+     */
+    void (*reap_queue) (struct virtio_dev* vdev, struct virtqueue* vq);
+
+    /**
+     * Optional device-specific handler called when guest memory layout changes.
+     * Called with the new map every time it changes, before regions that are no longer in it are unmapped.
+     * Queues are not serviced while this runs, so devices that don't need it should leave it unset:
+     * without it memory updates switch queues to the new map without stopping them.
+     */
+    void (*set_memory_map) (struct virtio_dev* vdev, const struct virtio_memory_map* map);
 };
 
 static inline int virtio_dev_get_config(struct virtio_dev* vdev, void* buffer, uint32_t bufsize)
@@ -47,6 +94,19 @@ static inline int virtio_dev_get_config(struct virtio_dev* vdev, void* buffer, u
     return 0;
 }
 
+static inline int virtio_dev_set_config(struct virtio_dev* vdev, const void* data, uint32_t offset, uint32_t size)
+{
+    if (!vdev || !data) {
+        return -EINVAL;
+    }
+
+    if (offset > vdev->config_size || size > vdev->config_size - offset) {
+        return -EINVAL;
+    }
+
+    return vdev->set_config ? vdev->set_config(vdev, data, offset, size) : -ENOTSUP;
+}
+
 static inline int virtio_dev_set_features(struct virtio_dev* vdev, uint64_t features)
 {
     if (!vdev) {
@@ -56,3 +116,56 @@ static inline int virtio_dev_set_features(struct virtio_dev* vdev, uint64_t feat
     vdev->features = features;
     return 0;
 }
+
+static inline int virtio_dev_start_queue(struct virtio_dev* vdev, struct virtqueue* vq, int wakefd)
+{
+    if (!vdev || !vq) {
+        return -EINVAL;
+    }
+
+    return vdev->start_queue ? vdev->start_queue(vdev, vq, wakefd) : 0;
+}
+
+static inline void virtio_dev_set_memory_map(struct virtio_dev* vdev, const struct virtio_memory_map* map)
+{
+    if (!vdev || !map) {
+        return;
+    }
+
+    if (vdev->set_memory_map) {
+        vdev->set_memory_map(vdev, map);
+    }
+}
+
+static inline void virtio_dev_drain_queue(struct virtio_dev* vdev, struct virtqueue* vq)
+{
+    if (!vdev || !vq) {
+        return;
+    }
+
+    if (vdev->drain_queue) {
+        vdev->drain_queue(vdev, vq);
+    }
+}
+
+static inline void virtio_dev_reap_queue(struct virtio_dev* vdev, struct virtqueue* vq)
+{
+    if (!vdev || !vq) {
+        return;
+    }
+
+    if (vdev->reap_queue) {
+        vdev->reap_queue(vdev, vq);
+    }
+}
+
+static inline void virtio_dev_stop_queue(struct virtio_dev* vdev, struct virtqueue* vq)
+{
+    if (!vdev || !vq) {
+        return;
+    }
+
+    if (vdev->stop_queue) {
+        vdev->stop_queue(vdev, vq);
+    }
+}
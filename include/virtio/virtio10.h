@@ -25,6 +25,8 @@ typedef uint64_t le64;
 /* Support for avail_event and used_event fields */
 #define VIRTIO_F_EVENT_IDX 29
 #define VIRTIO_F_VERSION_1 32
+/* Support for packed virtqueue layout */
+#define VIRTIO_F_RING_PACKED 34
 
 struct virtq_desc {
     /* Address (guest-physical). */
@@ -96,6 +98,49 @@ static inline size_t virtq_size(uint16_t qsz)
            VIRTQ_ALIGN_UP(sizeof(uint16_t) * 3 + sizeof(struct virtq_used_elem) * qsz);
 }
 
+/*
+ * Packed virtqueue layout
+ */
+
+/* Descriptor is available (driver wrap counter value) */
+#define VIRTQ_DESC_F_AVAIL      (1 << 7)
+/* Descriptor is used (device wrap counter value) */
+#define VIRTQ_DESC_F_USED       (1 << 15)
+
+struct pvirtq_desc {
+    /* Buffer Address. */
+    le64 addr;
+    /* Buffer Length. */
+    le32 len;
+    /* Buffer ID. */
+    le16 id;
+    /* The flags depending on descriptor type. */
+    le16 flags;
+};
+
+/* Enable events */
+#define RING_EVENT_FLAGS_ENABLE     0x0
+/* Disable events */
+#define RING_EVENT_FLAGS_DISABLE    0x1
+/* Enable events for a specific descriptor (as specified by Descriptor Ring Change Event Offset/Wrap Counter).
+ * Only valid if VIRTIO_F_EVENT_IDX has been negotiated. */
+#define RING_EVENT_FLAGS_DESC       0x2
+
+struct pvirtq_event_suppress {
+    /* Descriptor Ring Change Event Offset (bits 0-14) and Wrap Counter (bit 15) */
+    le16 off_wrap;
+    /* Descriptor Ring Change Event Flags */
+    le16 flags;
+};
+
+#define VIRTQ_PACKED_DESC_ALIGNMENT     16
+#define VIRTQ_PACKED_EVENT_ALIGNMENT    4
+
+static inline size_t pvirtq_size(uint16_t qsize)
+{
+    return sizeof(struct pvirtq_desc) * qsize + sizeof(struct pvirtq_event_suppress) * 2;
+}
+
 /*
  * virtio-blk specifics
  */
@@ -117,9 +162,12 @@ static inline size_t virtq_size(uint16_t qsz)
 #define VIRTIO_BLK_F_FLUSH      9
 #define VIRTIO_BLK_F_TOPOLOGY   10
 #define VIRTIO_BLK_F_CONFIG_WCE 11
+#define VIRTIO_BLK_F_MQ         12
+#define VIRTIO_BLK_F_DISCARD    13
+#define VIRTIO_BLK_F_WRITE_ZEROES 14
 
 /**
- * Device configuration layout
+ * Device configuration layout, packed to the exact size the driver reads
  */
 struct virtio_blk_config {
     le64 capacity;
@@ -142,7 +190,16 @@ struct virtio_blk_config {
         le32 opt_io_size;
     } topology;
     u8 writeback;
-};
+    u8 unused0;
+    le16 num_queues;
+    le32 max_discard_sectors;
+    le32 max_discard_seg;
+    le32 discard_sector_alignment;
+    le32 max_write_zeroes_sectors;
+    le32 max_write_zeroes_seg;
+    u8 write_zeroes_may_unmap;
+    u8 unused1[3];
+} __attribute__((packed));
 
 /**
  * Request types
@@ -151,6 +208,8 @@ struct virtio_blk_config {
 #define VIRTIO_BLK_T_OUT    1
 #define VIRTIO_BLK_T_FLUSH  4
 #define VIRTIO_BLK_T_GET_ID 8
+#define VIRTIO_BLK_T_DISCARD 11
+#define VIRTIO_BLK_T_WRITE_ZEROES 13
 
 struct virtio_blk_req {
     le32 type;
@@ -158,6 +217,17 @@ struct virtio_blk_req {
     le64 sector;
 };
 
+/**
+ * Data segment of discard and write zeroes requests
+ */
+struct virtio_blk_discard_write_zeroes {
+    le64 sector;
+    le32 num_sectors;
+    le32 flags;
+};
+
+#define VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP (1u << 0)
+
 /**
  * Request status codes
  */
@@ -4,6 +4,7 @@
 #include <stdbool.h>
 
 #include "virtio/virtio10.h"
+#include "virtio/memory.h"
 
 /**
  * Buffer described by a virtq descriptor and mapped to host address space.
@@ -21,6 +22,9 @@ struct virtqueue_buffer
 
     /** Read only flag */
     bool ro;
+
+    /** Guest physical address the buffer was mapped from, to log device writes to it */
+    uint64_t gpa;
 };
 
 /**
@@ -39,7 +43,10 @@ struct virtqueue_buffer_iter
     uint16_t cur;
 
     /** Current desciptor table to resolve next pointers */
-    struct virtq_desc* ptbl;
+    union {
+        struct virtq_desc* ptbl;
+        struct pvirtq_desc* pptbl; /* Packed layout */
+    };
 
     /** Number of descriptors in current table */
     uint16_t tbl_size;
@@ -49,6 +56,9 @@ struct virtqueue_buffer_iter
 
     /** Total number of descriptors we've seen, to detect loops */
     uint32_t nseen;
+
+    /** Number of descriptor ring entries occupied by the chain (packed layout only) */
+    uint16_t chain_len;
 };
 
 /**
@@ -73,6 +83,59 @@ bool virtqueue_has_next_buffer(struct virtqueue_buffer_iter* iter);
  */
 void virtqueue_release_buffers(struct virtqueue_buffer_iter* iter, uint32_t nwritten);
 
+/**
+ * Inflight descriptor state, one per descriptor table entry (split layout only).
+ * Layout is shared with the master and must survive our restarts, see virtqueue_set_inflight.
+ */
+struct virtq_inflight_desc
+{
+    /** Chain with this head id was dequeued but not yet returned to the used ring */
+    uint8_t inflight;
+
+    uint8_t padding[5];
+
+    /** Next head id in the last published used batch */
+    uint16_t next;
+
+    /** Order in which chains were dequeued, we resubmit them in the same order */
+    uint64_t counter;
+};
+
+/**
+ * Per-queue inflight tracking region kept by the master in shared memory.
+ * Lets a restarted device find requests it has dequeued before it went away and resubmit them.
+ */
+struct virtq_inflight
+{
+    uint64_t features;
+
+    /** 0 for a region we have never used, master hands out zeroed memory */
+    uint16_t version;
+
+    /** Number of desc entries, same as the queue size */
+    uint16_t desc_num;
+
+    /** Head id of the last published used batch, batch entries are linked with their next field */
+    uint16_t last_batch_head;
+
+    /** Used idx value after we've finished tracking the last published batch */
+    uint16_t used_idx;
+
+    struct virtq_inflight_desc desc[];
+};
+
+#define VIRTQ_INFLIGHT_VERSION      1
+#define VIRTQ_INFLIGHT_ALIGNMENT    64
+
+/**
+ * Size of a per-queue inflight region for a given queue size
+ */
+static inline uint64_t virtq_inflight_size(uint16_t qsize)
+{
+    uint64_t size = sizeof(struct virtq_inflight) + sizeof(struct virtq_inflight_desc) * qsize;
+    return (size + VIRTQ_INFLIGHT_ALIGNMENT - 1) & ~(uint64_t)(VIRTQ_INFLIGHT_ALIGNMENT - 1);
+}
+
 /**
  * Virtqueue tracking struct
  */
@@ -81,17 +144,49 @@ struct virtqueue
     /** Mapped guest memory available for this virtqueue */
     struct virtio_memory_map* mem;
 
+    /** Region of the last buffer we mapped, consecutive buffers usually land in the same one */
+    struct virtio_memory_cache mem_cache;
+
+    /** Dirty log to record our guest memory writes in, NULL unless the guest is being migrated */
+    struct virtio_dirty_log* log;
+
+    /**
+     * Guest physical addresses of the rings we write to, for dirty logging.
+     * Split layout writes only to the used ring, packed layout writes used elements to the descriptor ring
+     * and has used_gpa point to the device event suppression area.
+     */
+    uint64_t desc_gpa;
+    uint64_t used_gpa;
+
+    /** VIRTIO_F_RING_PACKED was negotiated */
+    bool is_packed;
+
     /**
      * These point directly to virtq memory
      */
-    struct virtq_desc* desc;
-    struct virtq_avail* avail; 
-    struct virtq_used* used; 
+    union {
+        /* Split layout */
+        struct {
+            struct virtq_desc* desc;
+            struct virtq_avail* avail;
+            struct virtq_used* used;
+        };
+
+        /* Packed layout */
+        struct {
+            struct pvirtq_desc* pdesc;
+            struct pvirtq_event_suppress* driver_event;
+            struct pvirtq_event_suppress* device_event;
+        };
+    };
 
     /** Size of the queue in descriptor count */
     uint16_t qsize;
 
-    /** Shadow copy of an avail->idx value we've last seen */
+    /**
+     * Split layout: shadow copy of an avail->idx value we've last seen.
+     * Packed layout: descriptor ring position where we expect next available chain.
+     */
     uint16_t last_seen_avail;
 
     /** queue is broken by the guest and cannot be safely handled further */
@@ -105,10 +200,58 @@ struct virtqueue
 
     /** Value of used idx we last saw when signalling driver event */
     uint16_t signalled_used_idx;
+
+    /** Number of used elements staged but not yet published to the driver */
+    uint16_t nstaged_used;
+
+    /** Split layout: used idx value to publish for staged elements */
+    uint16_t staged_used_idx;
+
+    /**
+     * Packed layout state
+     */
+
+    /** Descriptor ring position where we will write next used element */
+    uint16_t next_used;
+
+    /** Wrap counters for avail and used ring positions */
+    bool avail_wrap_counter;
+    bool used_wrap_counter;
+
+    /** Ring position and flags of the first staged used element, flags are written on publish */
+    uint16_t staged_head;
+    uint16_t staged_head_flags;
+
+    /** Number of descriptor ring entries occupied by each in-flight buffer id, qsize entries */
+    uint16_t* chain_lens;
+
+    /** Inflight tracking region, NULL if we don't track inflight chains */
+    struct virtq_inflight* inflight;
+
+    /** Counter value for the next dequeued chain */
+    uint64_t inflight_counter;
+
+    /** Head id of the first staged used element, staged elements are linked through the inflight region */
+    uint16_t inflight_batch_head;
+
+    /** Chain heads left inflight by the previous device instance, which we dequeue before any new ones */
+    uint16_t* resubmit_list;
+    uint16_t resubmit_num;
+    uint16_t resubmit_pos;
+
+    /** Opaque per-queue context owned by the virtio device type */
+    void* priv;
+
+    /** Device asked driver not to send available buffer notifications */
+    bool notify_disabled;
 };
 
 /**
  * Start virtqueue with given arguments
+ *
+ * Queue layout is selected from negotiated features.
+ * For packed layout avail_addr and used_addr describe driver and device event suppression areas,
+ * and avail_base carries avail wrap counter in bit 15.
  */
 int virtqueue_start(struct virtqueue* vq,
                     uint16_t qsize,
@@ -117,9 +260,58 @@ int virtqueue_start(struct virtqueue* vq,
                     uint64_t used_addr,
                     uint16_t avail_base,
                     int callfd,
-                    bool has_event_idx,
+                    uint64_t features,
                     struct virtio_memory_map* mem);
 
+/**
+ * Switch a started virtqueue to a new memory map.
+ * Queue must not be processed concurrently, and the old map must stay valid until the call.
+ * Rings are not translated again, so their memory must stay mapped where it was.
+ */
+void virtqueue_set_memory_map(struct virtqueue* vq, struct virtio_memory_map* mem);
+
+/**
+ * Start or stop logging our guest memory writes, NULL log stops logging.
+ * Queue must not be processed concurrently.
+ */
+void virtqueue_set_dirty_log(struct virtqueue* vq, struct virtio_dirty_log* log);
+
+/**
+ * Log device writes to a buffer returned by virtqueue_next_buffer, if dirty logging is enabled.
+ * Range is given by guest physical address, see virtqueue_buffer gpa.
+ * Devices must call this for everything they write to guest memory before returning the chain to the used ring.
+ * Queue takes care of logging its own ring updates.
+ */
+void virtqueue_log_write(struct virtqueue* vq, uint64_t gpa, size_t len);
+
+/**
+ * Start tracking inflight chains in the given region, NULL region stops tracking.
+ *
+ * Must be called right after virtqueue_start, before any chains are dequeued.
+ * If region has been used by a previous instance of the queue, chains it has left inflight
+ * are dequeued again before any new ones, in their original order. Their number is returned
+ * and queue avail base is moved past them, avail base given to virtqueue_start is ignored.
+ * Only split layout is supported, -ENOTSUP is returned for packed queues.
+ */
+int virtqueue_set_inflight(struct virtqueue* vq, struct virtq_inflight* inflight);
+
+/**
+ * Check if a previous instance of a queue with qsize entries has left chains inflight in the region.
+ * Chains of a used batch published but not yet cleared also count, they are dropped on restart.
+ * Region laid out for a different queue size has none.
+ */
+bool virtq_inflight_has_chains(const struct virtq_inflight* inflight, uint16_t qsize);
+
+/**
+ * Stop virtqueue and release resources allocated by virtqueue_start
+ */
+void virtqueue_stop(struct virtqueue* vq);
+
+/**
+ * Get avail base to restart the queue from, in the same format virtqueue_start accepts it
+ */
+uint16_t virtqueue_get_avail_base(const struct virtqueue* vq);
+
 /**
  * Dequeue next buffer chain from the queue.
  *
@@ -128,6 +320,15 @@ int virtqueue_start(struct virtqueue* vq,
  */
 bool virtqueue_dequeue_avail(struct virtqueue* vq, struct virtqueue_buffer_iter* out_iter);
 
+/**
+ * Dequeue up to max buffer chains from the queue.
+ *
+ * Avail idx is read and avail event is published once for the whole batch.
+ * Returns number of chains dequeued into out_iters, which can be 0 if there are none available.
+ * Also can mark the virtqueue broken if we encountered a bad chain.
+ */
+size_t virtqueue_dequeue_avail_batch(struct virtqueue* vq, struct virtqueue_buffer_iter* out_iters, size_t max);
+
 /**
  * Enqueue descriptor chain head into used ring
  *
@@ -138,6 +339,41 @@ bool virtqueue_dequeue_avail(struct virtqueue* vq, struct virtqueue_buffer_iter*
  */
 void virtqueue_enqueue_used(struct virtqueue* vq, uint16_t desc_id, uint32_t nwritten);
 
+/**
+ * Stage descriptor chain head in used ring without exposing it to the driver.
+ * Driver will not see staged elements until virtqueue_publish_used is called.
+ *
+ * @desc_id     Id of a head decriptor that starts a buffer chain.
+ * @nwritten    Optional total number of bytes written by the device when handling the chain.
+ */
+void virtqueue_stage_used(struct virtqueue* vq, uint16_t desc_id, uint32_t nwritten);
+
+/**
+ * Expose all staged used elements to the driver at once and notify it if needed.
+ * Does nothing if there is nothing staged.
+ */
+void virtqueue_publish_used(struct virtqueue* vq);
+
+/**
+ * Tell if driver has made new buffer chains available without dequeuing them.
+ * Cheap enough to be called in a polling loop.
+ */
+bool virtqueue_has_avail(struct virtqueue* vq);
+
+/**
+ * Ask driver to stop sending available buffer notifications.
+ * Used when device polls the queue. This is only a hint, driver can still send notifications.
+ */
+void virtqueue_disable_notifications(struct virtqueue* vq);
+
+/**
+ * Ask driver to send available buffer notifications again.
+ *
+ * Returns true if there are available buffers already, which driver could have made available
+ * without a notification before it saw our update. Caller should handle them or keep polling.
+ */
+bool virtqueue_enable_notifications(struct virtqueue* vq);
+
 /**
  * Tell if virtqueue is broken by invalid guest data.
  * Broken virtqueue cannot be used until completely reinitialized.
@@ -0,0 +1,32 @@
+/**
+ * Vring worker threads
+ */
+
+#pragma once
+
+#include "evloop.h"
+
+/**
+ * Worker thread running its own event loop.
+ * Vrings assigned to the worker loop are serviced on this thread.
+ */
+struct vhost_worker;
+
+/**
+ * Create and start a worker thread
+ *
+ * @cpu         CPU to pin the worker thread to, or -1 to leave it unpinned
+ * @backend     Event loop implementation for the worker loop
+ */
+struct vhost_worker* vhost_worker_create(int cpu, enum evloop_backend backend);
+
+/**
+ * Stop worker thread and free its resources.
+ * Caller is responsible for removing its fds from the worker loop first.
+ */
+void vhost_worker_destroy(struct vhost_worker* worker);
+
+/**
+ * Get event loop run by the worker thread
+ */
+struct event_loop* vhost_worker_evloop(struct vhost_worker* worker);
@@ -4,6 +4,7 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <errno.h>
 
 #include <CUnit/Basic.h>
 #include <CUnit/CUnit.h>
@@ -97,6 +98,159 @@ static void cross_region_query_for_non_continous_space_test(void)
     CU_ASSERT_EQUAL(MAP_FAILED, virtio_find_gpa_range(&mem, gpa1, len * 3, true));
 }
 
+static void lookup_many_regions_test(void)
+{
+    struct virtio_memory_map mem = VIRTIO_INIT_MEMORY_MAP;
+
+    /*
+     * Fill the map with regions separated by gaps, inserting them out of order,
+     * and look up every region boundary and every gap
+     */
+
+    const uint64_t len = 0x1000;
+    const uint64_t stride = len * 2;
+    for (uint32_t i = 0; i < VIRTIO_MEMORY_MAX_REGIONS; ++i) {
+        uint64_t gpa = stride * ((i * 7) % VIRTIO_MEMORY_MAX_REGIONS) + stride;
+        CU_ASSERT_EQUAL(0, virtio_add_guest_region(&mem, gpa, len, (void*) (gpa << 1), false));
+    }
+
+    CU_ASSERT_EQUAL(MAP_FAILED, virtio_find_gpa_range(&mem, 0, 1, true));
+
+    for (uint32_t i = 0; i < VIRTIO_MEMORY_MAX_REGIONS; ++i) {
+        uint64_t gpa = stride * i + stride;
+        CU_ASSERT_EQUAL(mem.gpa_start[i], gpa);
+        CU_ASSERT_EQUAL((void*) (gpa << 1), virtio_find_gpa_range(&mem, gpa, len, false));
+        CU_ASSERT_EQUAL((void*) ((gpa << 1) + len - 1), virtio_find_gpa_range(&mem, gpa + len - 1, 1, false));
+        CU_ASSERT_EQUAL(MAP_FAILED, virtio_find_gpa_range(&mem, gpa + len, 1, true));
+        CU_ASSERT_EQUAL(MAP_FAILED, virtio_find_gpa_range(&mem, gpa - 1, 1, true));
+    }
+}
+
+static void cached_lookup_test(void)
+{
+    struct virtio_memory_map mem = VIRTIO_INIT_MEMORY_MAP;
+    struct virtio_memory_cache cache = VIRTIO_INIT_MEMORY_CACHE;
+
+    const uint64_t len = 0x1000;
+    const uint64_t gpa1 = 0x1000;
+    const uint64_t gpa2 = gpa1 + len;
+
+    /* Fresh cache does not match even an empty map */
+    CU_ASSERT_NOT_EQUAL(cache.generation, mem.generation);
+    CU_ASSERT_EQUAL(MAP_FAILED, virtio_find_gpa_range_cached(&mem, &cache, 0, 0x10, true));
+
+    CU_ASSERT_EQUAL(0, virtio_add_guest_region(&mem, gpa1, len, (void*) 0x10000, false));
+    CU_ASSERT_EQUAL(0, virtio_add_guest_region(&mem, gpa2, len, (void*) 0x20000, true));
+
+    /* Miss fills the cache, following lookups in the same region hit it */
+    CU_ASSERT_EQUAL((void*) 0x10000, virtio_find_gpa_range_cached(&mem, &cache, gpa1, 0x10, false));
+    CU_ASSERT_EQUAL(cache.generation, mem.generation);
+    CU_ASSERT_EQUAL(cache.region_id, 0);
+    CU_ASSERT_EQUAL((void*) 0x10100, virtio_find_gpa_range_cached(&mem, &cache, gpa1 + 0x100, 0x100, false));
+    CU_ASSERT_EQUAL(cache.region_id, 0);
+
+    /* Lookups outside cached region go through the map and follow the same rules */
+    CU_ASSERT_EQUAL(MAP_FAILED, virtio_find_gpa_range_cached(&mem, &cache, gpa2, 0x10, false));
+    CU_ASSERT_EQUAL((void*) 0x20000, virtio_find_gpa_range_cached(&mem, &cache, gpa2, 0x10, true));
+    CU_ASSERT_EQUAL(cache.region_id, 1);
+    CU_ASSERT_EQUAL(MAP_FAILED, virtio_find_gpa_range_cached(&mem, &cache, gpa2 + len - 1, 2, true));
+    CU_ASSERT_EQUAL(MAP_FAILED, virtio_find_gpa_range_cached(&mem, &cache, gpa2, 0, true));
+
+    /* Changing the map invalidates the cache */
+    uint64_t generation = mem.generation;
+    CU_ASSERT_EQUAL(0, virtio_add_guest_region(&mem, 0, len, (void*) 0x30000, false));
+    CU_ASSERT_NOT_EQUAL(generation, mem.generation);
+    CU_ASSERT_EQUAL((void*) 0x20000, virtio_find_gpa_range_cached(&mem, &cache, gpa2, 0x10, true));
+    CU_ASSERT_EQUAL(cache.region_id, 2);
+
+    /* Rebuilding the map from scratch never reuses a generation */
+    mem = VIRTIO_INIT_MEMORY_MAP;
+    CU_ASSERT_EQUAL(MAP_FAILED, virtio_find_gpa_range_cached(&mem, &cache, gpa2, 0x10, true));
+    CU_ASSERT_EQUAL(0, virtio_add_guest_region(&mem, gpa2, len, (void*) 0x40000, true));
+    CU_ASSERT_NOT_EQUAL(cache.generation, mem.generation);
+    CU_ASSERT_EQUAL((void*) 0x40000, virtio_find_gpa_range_cached(&mem, &cache, gpa2, 0x10, true));
+}
+
+static void remove_region_test(void)
+{
+    struct virtio_memory_map mem = VIRTIO_INIT_MEMORY_MAP;
+
+    const uint64_t len = 0x1000;
+    for (uint64_t i = 0; i < 3; ++i) {
+        CU_ASSERT_EQUAL(0, virtio_add_guest_region(&mem, len * (i + 1), len, (void*) (0x10000 * (i + 1)), false));
+    }
+
+    /* Only an exact match is removed */
+    CU_ASSERT_EQUAL(-ENOENT, virtio_remove_guest_region(&mem, len * 2, len * 2, NULL));
+    CU_ASSERT_EQUAL(-ENOENT, virtio_remove_guest_region(&mem, len * 2 + 1, len, NULL));
+    CU_ASSERT_EQUAL(-ENOENT, virtio_remove_guest_region(&mem, len * 5, len, NULL));
+
+    uint64_t generation = mem.generation;
+    struct virtio_memory_region mr;
+    CU_ASSERT_EQUAL(0, virtio_remove_guest_region(&mem, len * 2, len, &mr));
+    CU_ASSERT_NOT_EQUAL(generation, mem.generation);
+    CU_ASSERT_EQUAL(mr.hva, (void*) 0x20000);
+    CU_ASSERT_EQUAL(mem.num_regions, 2);
+    CU_ASSERT_EQUAL(mem.gpa_start[0], len);
+    CU_ASSERT_EQUAL(mem.gpa_start[1], len * 3);
+
+    /* Removed range is no longer mapped while its neighbours are */
+    CU_ASSERT_EQUAL(MAP_FAILED, virtio_find_gpa_range(&mem, len * 2, 1, true));
+    CU_ASSERT_EQUAL((void*) 0x10000, virtio_find_gpa_range(&mem, len, len, false));
+    CU_ASSERT_EQUAL((void*) 0x30000, virtio_find_gpa_range(&mem, len * 3, len, false));
+    CU_ASSERT_EQUAL(MAP_FAILED, virtio_find_gpa_range(&mem, len, len * 3, false));
+
+    /* Slot can be reused */
+    CU_ASSERT_EQUAL(0, virtio_add_guest_region(&mem, len * 2, len, (void*) 0x40000, false));
+    CU_ASSERT_EQUAL((void*) 0x40000, virtio_find_gpa_range(&mem, len * 2, len, false));
+}
+
+static void find_hva_test(void)
+{
+    struct virtio_memory_map mem = VIRTIO_INIT_MEMORY_MAP;
+
+    /* Host mappings are in reverse order to guest addresses */
+    CU_ASSERT_EQUAL(0, virtio_add_guest_region(&mem, 0x1000, 0x1000, (void*) 0x20000, false));
+    CU_ASSERT_EQUAL(0, virtio_add_guest_region(&mem, 0x2000, 0x2000, (void*) 0x10000, false));
+
+    uint64_t region_len = 0;
+    CU_ASSERT_EQUAL(0x1100, virtio_find_hva_gpa(&mem, (void*) 0x20100, &region_len));
+    CU_ASSERT_EQUAL(0xf00, region_len);
+    CU_ASSERT_EQUAL(0x3fff, virtio_find_hva_gpa(&mem, (void*) 0x11fff, &region_len));
+    CU_ASSERT_EQUAL(1, region_len);
+
+    CU_ASSERT_EQUAL((uint64_t) MAP_FAILED, virtio_find_hva_gpa(&mem, (void*) 0x12000, &region_len));
+    CU_ASSERT_EQUAL((uint64_t) MAP_FAILED, virtio_find_hva_gpa(&mem, (void*) 0xffff, &region_len));
+}
+
+static void dirty_log_test(void)
+{
+    uint64_t bitmap[3] = {0};
+    struct virtio_dirty_log log = { bitmap, 64 * 2 + 8 };
+    const uint64_t page = 1ull << VIRTIO_LOG_PAGE_SHIFT;
+
+    /* Partial pages at both ends are logged */
+    virtio_log_dirty_range(&log, page * 3 + 1, page);
+    CU_ASSERT_EQUAL(bitmap[0], 0x18ull);
+
+    /* Range crossing word boundaries */
+    virtio_log_dirty_range(&log, page * 62, page * 68);
+    CU_ASSERT_EQUAL(bitmap[0], 0xc000000000000018ull);
+    CU_ASSERT_EQUAL(bitmap[1], ~0ull);
+    CU_ASSERT_EQUAL(bitmap[2], 0x3ull);
+
+    /* Pages beyond the end of the log are ignored */
+    virtio_log_dirty_range(&log, page * 135, page * 100);
+    CU_ASSERT_EQUAL(bitmap[2], 0x83ull);
+    virtio_log_dirty_range(&log, page * 200, page);
+    virtio_log_dirty_range(&log, UINT64_MAX - page, page * 2);
+    CU_ASSERT_EQUAL(bitmap[2], 0x83ull);
+
+    /* Empty range logs nothing */
+    virtio_log_dirty_range(&log, page * 5, 0);
+    CU_ASSERT_EQUAL(bitmap[0], 0xc000000000000018ull);
+}
+
 int main(int argc, char** argv)
 {
     if (CUE_SUCCESS != CU_initialize_registry()) {
@@ -113,6 +267,11 @@ int main(int argc, char** argv)
     CU_add_test(suite, "insert_and_query_regions_test", insert_and_query_regions_test);
     CU_add_test(suite, "overflow_max_regions_test", overflow_max_regions_test);
     CU_add_test(suite, "cross_region_query_for_non_continous_space_test", cross_region_query_for_non_continous_space_test);
+    CU_add_test(suite, "lookup_many_regions_test", lookup_many_regions_test);
+    CU_add_test(suite, "cached_lookup_test", cached_lookup_test);
+    CU_add_test(suite, "remove_region_test", remove_region_test);
+    CU_add_test(suite, "find_hva_test", find_hva_test);
+    CU_add_test(suite, "dirty_log_test", dirty_log_test);
 
     /* run tests */
     CU_basic_set_mode(CU_BRM_VERBOSE);
@@ -2,8 +2,12 @@
  * virtio-blk unit tests
  */
 
+#include <errno.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
 #include <CUnit/Basic.h>
 #include <CUnit/CUnit.h>
@@ -16,6 +20,7 @@
  * Specific tests might use something more restictive. */
 static struct virtio_memory_map g_default_memory_map = {
     .num_regions = 1,
+    .gpa_start = { 0 },
     .regions = {
         { 0, UINTPTR_MAX, NULL, false },
     },
@@ -45,10 +50,14 @@ struct vblk_test_dev
 /** Helper to initialize a test virtio-blk device and its queues */
 static void vblk_init(struct vblk_test_dev* dev, uint64_t sectors, uint32_t bsize, bool ro, bool wb, uint32_t num_queues)
 {
-    dev->vblk.total_sectors = sectors;
-    dev->vblk.block_size = bsize;
-    dev->vblk.readonly = ro;
-    dev->vblk.writeback = wb;
+    /* Optional fields are left zeroed, tests enable what they need after init */
+    dev->vblk = (struct virtio_blk) {
+        .total_sectors = sectors,
+        .block_size = bsize,
+        .readonly = ro,
+        .writeback = wb,
+        .num_queues = num_queues,
+    };
     CU_ASSERT_EQUAL(0, virtio_blk_init(&dev->vblk));
 
     CU_ASSERT_FATAL(num_queues < VBLK_TEST_DEV_MAX_QUEUES);
@@ -56,6 +65,7 @@ static void vblk_init(struct vblk_test_dev* dev, uint64_t sectors, uint32_t bsiz
 
     for (uint32_t i = 0; i < num_queues; ++i) {
         dev->queues[i].data = vq_alloc(VBLK_TEST_DEV_QUEUE_SIZE, &g_default_memory_map, &dev->queues[i].vq);
+        CU_ASSERT_EQUAL(0, virtio_dev_start_queue(&dev->vblk.vdev, &dev->queues[i].vq, -1));
     }
 }
 
@@ -67,6 +77,8 @@ static void vblk_init_default(struct vblk_test_dev* dev)
 static void vblk_free(struct vblk_test_dev* dev)
 {
     for (uint32_t i = 0; i < dev->num_queues; ++i) {
+        virtio_dev_stop_queue(&dev->vblk.vdev, &dev->queues[i].vq);
+        virtqueue_stop(&dev->queues[i].vq);
         free(dev->queues[i].data);
     }
 }
@@ -119,7 +131,7 @@ static struct blk_io_request* vblk_dequeue_and_verify(struct vblk_test_dev* dev,
                                                       const struct vblk_req_data* req)
 {
     struct blk_io_request* bio = NULL;
-    CU_ASSERT_TRUE(0 == virtio_blk_dequeue_request(&dev->vblk, &dev->queues[0].vq, &bio));
+    CU_ASSERT_TRUE(0 == virtio_blk_dequeue_request(&dev->vblk, &dev->queues[qidx].vq, &bio));
 
     CU_ASSERT_EQUAL(req->hdr.type, bio->type);
     CU_ASSERT_EQUAL(req->hdr.sector, bio->sector);
@@ -142,11 +154,13 @@ static struct blk_io_request* vblk_dequeue_and_verify(struct vblk_test_dev* dev,
  */
 static void init_test(void)
 {
-    struct virtio_blk good;
-    good.total_sectors = 1024;
-    good.block_size = 4096;
-    good.readonly = false;
-    good.writeback = false;
+    struct virtio_blk good = {
+        .total_sectors = 1024,
+        .block_size = 4096,
+        .readonly = false,
+        .writeback = false,
+        .num_queues = 1,
+    };
 
     struct virtio_blk bad;
 
@@ -164,6 +178,141 @@ static void init_test(void)
     bad = good;
     bad.total_sectors = 0;
     CU_ASSERT(0 != virtio_blk_init(&bad));
+
+    /* Segment limit beyond any chain we could ever see */
+    bad = good;
+    bad.seg_max = VIRTQ_MAX_SIZE + 1;
+    CU_ASSERT(0 != virtio_blk_init(&bad));
+
+    /* Unset queue count means a single queue */
+    struct virtio_blk single = good;
+    single.num_queues = 0;
+    CU_ASSERT(0 == virtio_blk_init(&single));
+    CU_ASSERT_EQUAL(single.num_queues, 1);
+}
+
+/**
+ * Multi-queue device exposes its queue count and serves every queue independently
+ */
+static void multi_queue_test(void)
+{
+    struct vblk_test_dev dev;
+    vblk_init(&dev, VBLK_TEST_DEV_SECTORS, VBLK_TEST_DEV_BSIZE, false, false, 4);
+
+    CU_ASSERT(dev.vblk.vdev.supported_features & (1ull << VIRTIO_BLK_F_MQ));
+
+    struct virtio_blk_config cfg;
+    CU_ASSERT_EQUAL(0, virtio_dev_get_config(&dev.vblk.vdev, &cfg, sizeof(cfg)));
+    CU_ASSERT_EQUAL(cfg.num_queues, 4);
+
+    /* Same chain head on every queue, each request gets its own context */
+    struct vblk_req_data reqs[4];
+    struct blk_io_request* bios[4];
+    for (uint32_t i = 0; i < 4; ++i) {
+        reqs[i] = (struct vblk_req_data) {
+            .hdr = { VIRTIO_BLK_T_IN, 0, i },
+            .buffers = {
+                { (void*) 0x1000, 0x1000, false },
+            },
+            .num_buffers = 1,
+            .status = -1,
+        };
+
+        vblk_enqueue_req(&dev, i, &reqs[i], 0);
+        bios[i] = vblk_dequeue_and_verify(&dev, i, &reqs[i]);
+    }
+
+    for (uint32_t i = 0; i < 4; ++i) {
+        for (uint32_t j = 0; j < i; ++j) {
+            CU_ASSERT_NOT_EQUAL(bios[i], bios[j]);
+        }
+    }
+
+    /* Completions land on the queue the request came from */
+    for (uint32_t i = 0; i < 4; ++i) {
+        virtio_blk_complete_request(&dev.vblk, bios[i], BLK_SUCCESS);
+        CU_ASSERT_EQUAL(reqs[i].status, BLK_SUCCESS);
+        CU_ASSERT_EQUAL(dev.queues[i].vq.used->idx, 1);
+    }
+
+    vblk_free(&dev);
+}
+
+/**
+ * Device limits and topology reach the driver through config space and are enforced on requests
+ */
+static void config_limits_test(void)
+{
+    struct vblk_test_dev dev;
+    vblk_init(&dev, VBLK_TEST_DEV_SECTORS, VBLK_TEST_DEV_BSIZE, true, false, 1);
+
+    uint64_t features = dev.vblk.vdev.supported_features;
+    CU_ASSERT(features & (1ull << VIRTIO_BLK_F_RO));
+    CU_ASSERT(features & (1ull << VIRTIO_BLK_F_SEG_MAX));
+    CU_ASSERT_FALSE(features & (1ull << VIRTIO_BLK_F_SIZE_MAX));
+    CU_ASSERT_FALSE(features & (1ull << VIRTIO_BLK_F_TOPOLOGY));
+
+    struct virtio_blk_config cfg = { 0 };
+    CU_ASSERT_EQUAL(0, virtio_dev_get_config(&dev.vblk.vdev, &cfg, sizeof(cfg)));
+    CU_ASSERT_EQUAL(cfg.seg_max, 128);
+    CU_ASSERT_EQUAL(cfg.size_max, 0);
+
+    /* Queue contexts are sized by seg_max, so restart the queue with new limits */
+    virtio_dev_stop_queue(&dev.vblk.vdev, &dev.queues[0].vq);
+    dev.vblk.seg_max = 4;
+    dev.vblk.size_max = 0x1000;
+    dev.vblk.physical_block_exp = 3;
+    dev.vblk.min_io_size = 1;
+    dev.vblk.opt_io_size = 16;
+    CU_ASSERT_EQUAL(0, virtio_blk_init(&dev.vblk));
+    CU_ASSERT_EQUAL(0, virtio_dev_start_queue(&dev.vblk.vdev, &dev.queues[0].vq, -1));
+
+    features = dev.vblk.vdev.supported_features;
+    CU_ASSERT(features & (1ull << VIRTIO_BLK_F_SIZE_MAX));
+    CU_ASSERT(features & (1ull << VIRTIO_BLK_F_TOPOLOGY));
+
+    CU_ASSERT_EQUAL(0, virtio_dev_get_config(&dev.vblk.vdev, &cfg, sizeof(cfg)));
+    CU_ASSERT_EQUAL(cfg.seg_max, 4);
+    CU_ASSERT_EQUAL(cfg.size_max, 0x1000);
+    CU_ASSERT_EQUAL(cfg.topology.physical_block_exp, 3);
+    CU_ASSERT_EQUAL(cfg.topology.min_io_size, 1);
+    CU_ASSERT_EQUAL(cfg.topology.opt_io_size, 16);
+
+    /* Segment over size_max */
+    struct vblk_req_data req = {
+        .hdr = { VIRTIO_BLK_T_IN, 0 },
+        .buffers = {
+            { (void*) 0x1000, 0x2000, false },
+        },
+        .num_buffers = 1,
+        .status = -1,
+    };
+
+    struct blk_io_request* bio = NULL;
+    vblk_enqueue_req(&dev, 0, &req, 0);
+    CU_ASSERT(0 != virtio_blk_dequeue_request(&dev.vblk, &dev.queues[0].vq, &bio));
+
+    /* Too many segments */
+    req.num_buffers = 5;
+    for (uint8_t i = 0; i < req.num_buffers; ++i) {
+        req.buffers[i] = (struct virtqueue_buffer) { (void*) 0x1000, 0x1000, false };
+    }
+
+    vblk_enqueue_req(&dev, 0, &req, 0);
+    CU_ASSERT(0 != virtio_blk_dequeue_request(&dev.vblk, &dev.queues[0].vq, &bio));
+
+    /* Both limits met */
+    req.num_buffers = 4;
+    vblk_enqueue_req(&dev, 0, &req, 0);
+    bio = vblk_dequeue_and_verify(&dev, 0, &req);
+    virtio_blk_complete_request(&dev.vblk, bio, BLK_SUCCESS);
+    CU_ASSERT_EQUAL(req.status, BLK_SUCCESS);
+
+    /* Segment has to fit at least one sector */
+    dev.vblk.size_max = VIRTIO_BLK_SECTOR_SIZE - 1;
+    CU_ASSERT(0 != virtio_blk_init(&dev.vblk));
+
+    vblk_free(&dev);
 }
 
 /**
@@ -200,6 +349,256 @@ static void rw_request_test(void)
     vblk_free(&dev);
 }
 
+/**
+ * Flush on a writeback device: header followed by status only, anything else is malformed
+ */
+static void flush_request_test(void)
+{
+    struct vblk_test_dev dev;
+    vblk_init(&dev, VBLK_TEST_DEV_SECTORS, VBLK_TEST_DEV_BSIZE, false, true, 1);
+    CU_ASSERT(dev.vblk.vdev.supported_features & (1ull << VIRTIO_BLK_F_FLUSH));
+
+    struct vblk_req_data req = {
+        .hdr = { VIRTIO_BLK_T_FLUSH, 0 },
+        .num_buffers = 0,
+        .status = -1,
+    };
+
+    vblk_enqueue_req(&dev, 0, &req, 0);
+    struct blk_io_request* bio = vblk_dequeue_and_verify(&dev, 0, &req);
+    CU_ASSERT_EQUAL(BLK_IO_FLUSH, bio->type);
+
+    virtio_blk_complete_request(&dev.vblk, bio, BLK_SUCCESS);
+    CU_ASSERT_EQUAL(req.status, BLK_SUCCESS);
+
+    /* Flush carrying a data buffer */
+    struct vblk_req_data bad_req = {
+        .hdr = { VIRTIO_BLK_T_FLUSH, 0 },
+        .buffers = {
+            { (void*) 0x1000, 0x1000, false },
+        },
+        .num_buffers = 1,
+        .status = -1,
+    };
+
+    vblk_enqueue_req(&dev, 0, &bad_req, 2);
+    CU_ASSERT(0 != virtio_blk_dequeue_request(&dev.vblk, &dev.queues[0].vq, &bio));
+
+    vblk_free(&dev);
+}
+
+/**
+ * Discard and write zeroes carry a list of ranges, validated against device limits
+ */
+static void discard_write_zeroes_test(void)
+{
+    struct vblk_test_dev dev;
+    vblk_init_default(&dev);
+    CU_ASSERT_FALSE(dev.vblk.vdev.supported_features & (1ull << VIRTIO_BLK_F_DISCARD));
+    CU_ASSERT_EQUAL(dev.vblk.vdev.config_size, offsetof(struct virtio_blk_config, max_discard_sectors));
+
+    /* Not offered, so not accepted */
+    struct virtio_blk_discard_write_zeroes segs[3] = {
+        { 8, 16, 0 },
+        { 128, 8, VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP },
+        { VBLK_TEST_DEV_SECTORS - 8, 16, 0 },
+    };
+
+    struct vblk_req_data req = {
+        .hdr = { VIRTIO_BLK_T_WRITE_ZEROES, 0 },
+        .buffers = {
+            { segs, sizeof(segs[0]) * 2, true },
+        },
+        .num_buffers = 1,
+        .status = -1,
+    };
+
+    struct blk_io_request* bio = NULL;
+    vblk_enqueue_req(&dev, 0, &req, 0);
+    CU_ASSERT(0 != virtio_blk_dequeue_request(&dev.vblk, &dev.queues[0].vq, &bio));
+    vblk_free(&dev);
+
+    vblk_init_default(&dev);
+    dev.vblk.max_discard_sectors = 32;
+    dev.vblk.max_write_zeroes_sectors = 32;
+    dev.vblk.max_write_zeroes_segs = 2;
+    dev.vblk.write_zeroes_may_unmap = true;
+    CU_ASSERT_EQUAL(0, virtio_blk_init(&dev.vblk));
+    CU_ASSERT(dev.vblk.vdev.supported_features & (1ull << VIRTIO_BLK_F_DISCARD));
+    CU_ASSERT(dev.vblk.vdev.supported_features & (1ull << VIRTIO_BLK_F_WRITE_ZEROES));
+    CU_ASSERT_EQUAL(dev.vblk.vdev.config_size, sizeof(struct virtio_blk_config));
+
+    struct virtio_blk_config cfg = { 0 };
+    CU_ASSERT_EQUAL(0, virtio_dev_get_config(&dev.vblk.vdev, &cfg, sizeof(cfg)));
+    CU_ASSERT_EQUAL(cfg.max_discard_sectors, 32);
+    CU_ASSERT_EQUAL(cfg.max_discard_seg, 1);
+    CU_ASSERT_EQUAL(cfg.max_write_zeroes_seg, 2);
+    CU_ASSERT_EQUAL(cfg.write_zeroes_may_unmap, 1);
+
+    /* Two write zeroes ranges, second one asks to unmap */
+    req.status = -1;
+    vblk_enqueue_req(&dev, 0, &req, 0);
+    CU_ASSERT_FATAL(0 == virtio_blk_dequeue_request(&dev.vblk, &dev.queues[0].vq, &bio));
+    CU_ASSERT_EQUAL(bio->type, BLK_IO_WRITE_ZEROES);
+    CU_ASSERT_EQUAL(bio->nvecs, 0);
+    CU_ASSERT_EQUAL(bio->nranges, 2);
+    CU_ASSERT_EQUAL(bio->total_sectors, 24);
+    CU_ASSERT_EQUAL(bio->ranges[0].sector, 8);
+    CU_ASSERT_EQUAL(bio->ranges[0].num_sectors, 16);
+    CU_ASSERT_FALSE(bio->ranges[0].unmap);
+    CU_ASSERT_EQUAL(bio->ranges[1].sector, 128);
+    CU_ASSERT_TRUE(bio->ranges[1].unmap);
+
+    virtio_blk_complete_request(&dev.vblk, bio, BLK_SUCCESS);
+    CU_ASSERT_EQUAL(req.status, BLK_SUCCESS);
+
+    /* Discard takes a single range without flags */
+    req.hdr.type = VIRTIO_BLK_T_DISCARD;
+    vblk_enqueue_req(&dev, 0, &req, 4);
+    CU_ASSERT(0 != virtio_blk_dequeue_request(&dev.vblk, &dev.queues[0].vq, &bio));
+
+    req.buffers[0] = (struct virtqueue_buffer) { &segs[1], sizeof(segs[1]), true };
+    vblk_enqueue_req(&dev, 0, &req, 8);
+    CU_ASSERT(0 != virtio_blk_dequeue_request(&dev.vblk, &dev.queues[0].vq, &bio));
+
+    req.buffers[0] = (struct virtqueue_buffer) { &segs[0], sizeof(segs[0]), true };
+    vblk_enqueue_req(&dev, 0, &req, 12);
+    CU_ASSERT_FATAL(0 == virtio_blk_dequeue_request(&dev.vblk, &dev.queues[0].vq, &bio));
+    CU_ASSERT_EQUAL(bio->type, BLK_IO_DISCARD);
+    CU_ASSERT_EQUAL(bio->nranges, 1);
+    virtio_blk_complete_request(&dev.vblk, bio, BLK_SUCCESS);
+
+    /* Range past the end of the device */
+    req.buffers[0] = (struct virtqueue_buffer) { &segs[2], sizeof(segs[2]), true };
+    vblk_enqueue_req(&dev, 0, &req, 16);
+    CU_ASSERT(0 != virtio_blk_dequeue_request(&dev.vblk, &dev.queues[0].vq, &bio));
+
+    /* Range segments in a device-writable buffer */
+    req.buffers[0] = (struct virtqueue_buffer) { &segs[0], sizeof(segs[0]), false };
+    vblk_enqueue_req(&dev, 0, &req, 20);
+    CU_ASSERT(0 != virtio_blk_dequeue_request(&dev.vblk, &dev.queues[0].vq, &bio));
+
+    vblk_free(&dev);
+}
+
+/**
+ * Enqueue several requests, including a malformed one, and dequeue them in a single batch
+ */
+static void dequeue_batch_test(void)
+{
+    struct vblk_test_dev dev;
+    vblk_init_default(&dev);
+
+    struct vblk_req_data reqs[4];
+    for (uint16_t i = 0; i < 4; ++i) {
+        reqs[i] = (struct vblk_req_data) {
+            .hdr = { (i & 1) ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN, 0, i },
+            .buffers = {
+                { (void*) 0x1000, 0x1000, (i & 1) },
+            },
+            .num_buffers = 1,
+            .status = -1,
+        };
+    }
+
+    /* Request with no data buffers will be dropped */
+    reqs[2].num_buffers = 0;
+
+    for (uint16_t i = 0; i < 4; ++i) {
+        vblk_enqueue_req(&dev, 0, &reqs[i], i * 3);
+    }
+
+    struct blk_io_request* bios[8];
+    CU_ASSERT_EQUAL(3, virtio_blk_dequeue_requests(&dev.vblk, &dev.queues[0].vq, bios, 8));
+    CU_ASSERT_EQUAL(-ENOENT, virtio_blk_dequeue_requests(&dev.vblk, &dev.queues[0].vq, bios, 8));
+
+    CU_ASSERT_EQUAL(bios[0]->sector, 0);
+    CU_ASSERT_EQUAL(bios[1]->sector, 1);
+    CU_ASSERT_EQUAL(bios[2]->sector, 3);
+
+    /* Malformed request was released right away, the rest are published in one go */
+    CU_ASSERT_EQUAL(dev.queues[0].vq.used->idx, 1);
+
+    enum blk_io_status res[3] = { BLK_SUCCESS, BLK_IOERROR, BLK_SUCCESS };
+    virtio_blk_complete_requests(&dev.vblk, bios, res, 3);
+
+    CU_ASSERT_EQUAL(dev.queues[0].vq.used->idx, 4);
+    CU_ASSERT_EQUAL(reqs[0].status, BLK_SUCCESS);
+    CU_ASSERT_EQUAL(reqs[1].status, BLK_IOERROR);
+    CU_ASSERT_EQUAL(reqs[3].status, BLK_SUCCESS);
+
+    vblk_free(&dev);
+}
+
+/**
+ * Io contexts are reused from a per-queue pool indexed by chain head
+ */
+static void request_pool_test(void)
+{
+    struct vblk_test_dev dev;
+    vblk_init_default(&dev);
+
+    struct vblk_req_data req = {
+        .hdr = { VIRTIO_BLK_T_IN, 0 },
+        .buffers = {
+            { (void*) 0x1000, 0x1000, false },
+        },
+        .num_buffers = 1,
+        .status = -1,
+    };
+
+    vblk_enqueue_req(&dev, 0, &req, 0);
+    struct blk_io_request* bio = vblk_dequeue_and_verify(&dev, 0, &req);
+
+    /* Driver resubmits a head that is still in-flight, request is dropped */
+    struct blk_io_request* dup = NULL;
+    vblk_enqueue_req(&dev, 0, &req, 0);
+    CU_ASSERT_NOT_EQUAL(0, virtio_blk_dequeue_request(&dev.vblk, &dev.queues[0].vq, &dup));
+
+    /* Once completed the same context serves the next request with this head */
+    virtio_blk_complete_request(&dev.vblk, bio, BLK_SUCCESS);
+    CU_ASSERT_EQUAL(req.status, BLK_SUCCESS);
+
+    req.hdr.sector = 1;
+    vblk_enqueue_req(&dev, 0, &req, 0);
+    CU_ASSERT_EQUAL(bio, vblk_dequeue_and_verify(&dev, 0, &req));
+    virtio_blk_complete_request(&dev.vblk, bio, BLK_SUCCESS);
+
+    vblk_free(&dev);
+}
+
+/**
+ * Submit a request with more data segments than we have preallocated room for
+ */
+static void too_many_segments(void)
+{
+    struct vblk_test_dev dev;
+    vblk_init_default(&dev);
+
+    struct vblk_req_data req = {
+        .hdr = { VIRTIO_BLK_T_IN, 0 },
+        .num_buffers = 129,
+        .status = -1,
+    };
+
+    for (uint8_t i = 0; i < req.num_buffers; ++i) {
+        req.buffers[i] = (struct virtqueue_buffer) { (void*) 0x1000, VIRTIO_BLK_SECTOR_SIZE, false };
+    }
+
+    vblk_enqueue_req(&dev, 0, &req, 0);
+
+    struct blk_io_request* bio = NULL;
+    CU_ASSERT(0 != virtio_blk_dequeue_request(&dev.vblk, &dev.queues[0].vq, &bio));
+
+    /* One less segment fits */
+    req.num_buffers--;
+    vblk_enqueue_req(&dev, 0, &req, 0);
+    bio = vblk_dequeue_and_verify(&dev, 0, &req);
+    virtio_blk_complete_request(&dev.vblk, bio, BLK_SUCCESS);
+
+    vblk_free(&dev);
+}
+
 /**
  * Attempt to send a write request to a read-only device
  */
@@ -352,6 +751,211 @@ static void zero_data_size(void)
     vblk_free(&dev);
 }
 
+/** Test async backend: fails requests to sector 13, keeps the rest until the test completes them */
+static struct blk_io_request* g_submitted[8];
+static int g_nsubmitted;
+static bool g_poll_completes;
+
+static int test_backend_submit(struct virtio_blk* vblk, struct virtqueue* vq, struct blk_io_request* bio)
+{
+    if (bio->sector == 13) {
+        return -EIO;
+    }
+
+    CU_ASSERT_FATAL(g_nsubmitted < 8);
+    g_submitted[g_nsubmitted++] = bio;
+    return 0;
+}
+
+static void test_backend_poll(struct virtio_blk* vblk, struct virtqueue* vq)
+{
+    while (g_poll_completes && g_nsubmitted) {
+        virtio_blk_post_completion(vblk, g_submitted[--g_nsubmitted], BLK_SUCCESS);
+    }
+}
+
+static const struct virtio_blk_backend_ops g_test_backend = {
+    .submit = test_backend_submit,
+    .poll = test_backend_poll,
+};
+
+/**
+ * Serve requests with an asynchronous backend completing them out of order
+ */
+static void async_backend_test(void)
+{
+    struct vblk_test_dev dev;
+    vblk_init_default(&dev);
+    dev.vblk.backend = &g_test_backend;
+    g_nsubmitted = 0;
+    g_poll_completes = false;
+
+    /* Restart the queue with a wakeup eventfd */
+    int wakefd = eventfd(0, EFD_NONBLOCK);
+    CU_ASSERT_FATAL(wakefd >= 0);
+    virtio_dev_stop_queue(&dev.vblk.vdev, &dev.queues[0].vq);
+    CU_ASSERT_EQUAL(0, virtio_dev_start_queue(&dev.vblk.vdev, &dev.queues[0].vq, wakefd));
+
+    struct vblk_req_data reqs[4];
+    uint64_t sectors[4] = { 0, 1, 13, 2 };
+    for (uint16_t i = 0; i < 4; ++i) {
+        reqs[i] = (struct vblk_req_data) {
+            .hdr = { VIRTIO_BLK_T_IN, 0, sectors[i] },
+            .buffers = {
+                { (void*) 0x1000, 0x1000, false },
+            },
+            .num_buffers = 1,
+            .status = -1,
+        };
+    }
+
+    for (uint16_t i = 0; i < 3; ++i) {
+        vblk_enqueue_req(&dev, 0, &reqs[i], i * 3);
+    }
+
+    /* Rejected request is failed right away, the rest are in-flight */
+    CU_ASSERT_EQUAL(0, virtio_blk_process_queue(&dev.vblk, &dev.queues[0].vq));
+    CU_ASSERT_EQUAL(g_nsubmitted, 2);
+    CU_ASSERT_EQUAL(dev.queues[0].vq.used->idx, 1);
+    CU_ASSERT_EQUAL(reqs[2].status, BLK_IOERROR);
+
+    /* Complete out of order, only the first completion wakes up the queue */
+    virtio_blk_post_completion(&dev.vblk, g_submitted[1], BLK_SUCCESS);
+    virtio_blk_post_completion(&dev.vblk, g_submitted[0], BLK_IOERROR);
+
+    eventfd_t wakeups = 0;
+    CU_ASSERT_EQUAL(0, eventfd_read(wakefd, &wakeups));
+    CU_ASSERT_EQUAL(wakeups, 1);
+
+    /* Driver doesn't see completions until queue is processed */
+    CU_ASSERT_EQUAL(dev.queues[0].vq.used->idx, 1);
+    CU_ASSERT_EQUAL(0, virtio_blk_process_queue(&dev.vblk, &dev.queues[0].vq));
+    CU_ASSERT_EQUAL(dev.queues[0].vq.used->idx, 3);
+    CU_ASSERT_EQUAL(dev.queues[0].vq.used->ring[1].id, 3);
+    CU_ASSERT_EQUAL(dev.queues[0].vq.used->ring[2].id, 0);
+    CU_ASSERT_EQUAL(reqs[0].status, BLK_IOERROR);
+    CU_ASSERT_EQUAL(reqs[1].status, BLK_SUCCESS);
+
+    /* Draining returns in-flight requests to the driver and keeps the queue running */
+    g_nsubmitted = 0;
+    vblk_enqueue_req(&dev, 0, &reqs[3], 0);
+    CU_ASSERT_EQUAL(0, virtio_blk_process_queue(&dev.vblk, &dev.queues[0].vq));
+    CU_ASSERT_EQUAL(g_nsubmitted, 1);
+
+    g_poll_completes = true;
+    virtio_dev_drain_queue(&dev.vblk.vdev, &dev.queues[0].vq);
+    CU_ASSERT_EQUAL(reqs[3].status, BLK_SUCCESS);
+    CU_ASSERT_EQUAL(dev.queues[0].vq.used->idx, 4);
+    CU_ASSERT_PTR_NOT_NULL(dev.queues[0].vq.priv);
+
+    /* Reaping a disabled queue returns completed requests but leaves new ones in the ring */
+    g_poll_completes = false;
+    reqs[3].status = -1;
+    vblk_enqueue_req(&dev, 0, &reqs[3], 0);
+    CU_ASSERT_EQUAL(0, virtio_blk_process_queue(&dev.vblk, &dev.queues[0].vq));
+    CU_ASSERT_EQUAL(g_nsubmitted, 1);
+
+    reqs[1].status = -1;
+    vblk_enqueue_req(&dev, 0, &reqs[1], 3);
+    g_poll_completes = true;
+    virtio_dev_reap_queue(&dev.vblk.vdev, &dev.queues[0].vq);
+    CU_ASSERT_EQUAL(reqs[3].status, BLK_SUCCESS);
+    CU_ASSERT_EQUAL(reqs[1].status, (uint8_t) -1);
+    CU_ASSERT_EQUAL(dev.queues[0].vq.used->idx, 5);
+    CU_ASSERT_EQUAL(g_nsubmitted, 0);
+
+    CU_ASSERT_EQUAL(0, virtio_blk_process_queue(&dev.vblk, &dev.queues[0].vq));
+    CU_ASSERT_EQUAL(reqs[1].status, BLK_SUCCESS);
+    CU_ASSERT_EQUAL(dev.queues[0].vq.used->idx, 6);
+
+    /* Completions backend posts from our own poll calls are reaped without waking us up again */
+    CU_ASSERT_NOT_EQUAL(0, eventfd_read(wakefd, &wakeups));
+    CU_ASSERT_EQUAL(errno, EAGAIN);
+
+    /* Stopping the queue waits for in-flight requests */
+    g_poll_completes = false;
+    reqs[3].status = -1;
+    vblk_enqueue_req(&dev, 0, &reqs[3], 0);
+    CU_ASSERT_EQUAL(0, virtio_blk_process_queue(&dev.vblk, &dev.queues[0].vq));
+    CU_ASSERT_EQUAL(g_nsubmitted, 1);
+
+    g_poll_completes = true;
+    vblk_free(&dev);
+    CU_ASSERT_EQUAL(reqs[3].status, BLK_SUCCESS);
+
+    close(wakefd);
+}
+
+/** Test backend switching cache modes, refuses to when asked to */
+static int g_set_writeback_calls;
+static int g_set_writeback_error;
+
+static int test_backend_set_writeback(struct virtio_blk* vblk, bool writeback)
+{
+    g_set_writeback_calls++;
+    return g_set_writeback_error;
+}
+
+static const struct virtio_blk_backend_ops g_wce_backend = {
+    .submit = test_backend_submit,
+    .set_writeback = test_backend_set_writeback,
+};
+
+/**
+ * Driver switches device cache mode through the writeback config field
+ */
+static void config_wce_test(void)
+{
+    struct vblk_test_dev dev;
+    vblk_init_default(&dev);
+    CU_ASSERT_FALSE(dev.vblk.vdev.supported_features & (1ull << VIRTIO_BLK_F_CONFIG_WCE));
+
+    uint32_t wce_offset = offsetof(struct virtio_blk_config, writeback);
+    uint8_t wce = 1;
+    CU_ASSERT(0 != virtio_dev_set_config(&dev.vblk.vdev, &wce, wce_offset, sizeof(wce)));
+
+    /* Backend able to switch modes gets both the switch and flush offered */
+    dev.vblk.backend = &g_wce_backend;
+    CU_ASSERT_EQUAL(0, virtio_blk_init(&dev.vblk));
+    CU_ASSERT(dev.vblk.vdev.supported_features & (1ull << VIRTIO_BLK_F_CONFIG_WCE));
+    CU_ASSERT(dev.vblk.vdev.supported_features & (1ull << VIRTIO_BLK_F_FLUSH));
+    g_set_writeback_calls = 0;
+    g_set_writeback_error = 0;
+
+    /* Not negotiated yet */
+    CU_ASSERT(0 != virtio_dev_set_config(&dev.vblk.vdev, &wce, wce_offset, sizeof(wce)));
+    CU_ASSERT_EQUAL(0, virtio_dev_set_features(&dev.vblk.vdev, 1ull << VIRTIO_BLK_F_CONFIG_WCE));
+
+    CU_ASSERT_EQUAL(0, virtio_dev_set_config(&dev.vblk.vdev, &wce, wce_offset, sizeof(wce)));
+    CU_ASSERT_EQUAL(g_set_writeback_calls, 1);
+    CU_ASSERT_TRUE(dev.vblk.writeback);
+
+    struct virtio_blk_config cfg = { 0 };
+    CU_ASSERT_EQUAL(0, virtio_dev_get_config(&dev.vblk.vdev, &cfg, sizeof(cfg)));
+    CU_ASSERT_EQUAL(cfg.writeback, 1);
+
+    /* Same mode again does not bother the backend */
+    CU_ASSERT_EQUAL(0, virtio_dev_set_config(&dev.vblk.vdev, &wce, wce_offset, sizeof(wce)));
+    CU_ASSERT_EQUAL(g_set_writeback_calls, 1);
+
+    /* Backend failure keeps the old mode */
+    wce = 0;
+    g_set_writeback_error = -EIO;
+    CU_ASSERT_EQUAL(-EIO, virtio_dev_set_config(&dev.vblk.vdev, &wce, wce_offset, sizeof(wce)));
+    CU_ASSERT_TRUE(dev.vblk.writeback);
+
+    g_set_writeback_error = 0;
+    CU_ASSERT_EQUAL(0, virtio_dev_set_config(&dev.vblk.vdev, &wce, wce_offset, sizeof(wce)));
+    CU_ASSERT_FALSE(dev.vblk.writeback);
+
+    /* Other fields are read-only, and writes can't go past config space */
+    uint32_t capacity = 1;
+    CU_ASSERT(0 != virtio_dev_set_config(&dev.vblk.vdev, &capacity, 0, sizeof(capacity)));
+    CU_ASSERT(0 != virtio_dev_set_config(&dev.vblk.vdev, &wce, dev.vblk.vdev.config_size, sizeof(wce)));
+
+    vblk_free(&dev);
+}
+
 int main(int argc, char** argv)
 {
     if (CUE_SUCCESS != CU_initialize_registry()) {
@@ -365,7 +969,16 @@ int main(int argc, char** argv)
     }
 
     CU_add_test(suite, "init_test", init_test);
+    CU_add_test(suite, "multi_queue_test", multi_queue_test);
+    CU_add_test(suite, "config_limits_test", config_limits_test);
     CU_add_test(suite, "rw_request_test", rw_request_test);
+    CU_add_test(suite, "flush_request_test", flush_request_test);
+    CU_add_test(suite, "discard_write_zeroes_test", discard_write_zeroes_test);
+    CU_add_test(suite, "dequeue_batch_test", dequeue_batch_test);
+    CU_add_test(suite, "request_pool_test", request_pool_test);
+    CU_add_test(suite, "too_many_segments", too_many_segments);
+    CU_add_test(suite, "async_backend_test", async_backend_test);
+    CU_add_test(suite, "config_wce_test", config_wce_test);
     CU_add_test(suite, "write_request_for_ro_device", write_request_for_ro_device);
     CU_add_test(suite, "read_only_status_buffer", read_only_status_buffer);
     CU_add_test(suite, "incorrect_status_buffer_size", incorrect_status_buffer_size);
@@ -4,6 +4,8 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
 #include <CUnit/Basic.h>
 #include <CUnit/CUnit.h>
@@ -17,6 +19,7 @@
  * Specific tests might use something more restictive. */
 static struct virtio_memory_map g_default_memory_map = {
     .num_regions = 1,
+    .gpa_start = { 0 },
     .regions = {
         { 0, UINTPTR_MAX, NULL, false },
     },
@@ -247,6 +250,178 @@ static void dequeue_many_indirect_test(void)
     free(mem);
 }
 
+/* Test batched dequeues */
+static void dequeue_batch_test(void)
+{
+    const uint16_t qsize = 256;
+    const uint16_t nchains = 100;
+    const size_t batch = 32;
+
+    struct virtqueue vq;
+    void* mem = vq_alloc(qsize, &g_default_memory_map, &vq);
+
+    struct virtq_desc* chain[nchains];
+    for (uint16_t i = 0; i < nchains; ++i) {
+        chain[i] = vq_fill_desc_id(&vq, i, (void*)(uintptr_t)(i * 0x1000), 0x10, 0, 0);
+        vq_publish_desc_id(&vq, i);
+    }
+
+    struct virtqueue_buffer buf;
+    struct virtqueue_buffer_iter iters[batch];
+    uint16_t ndequeued = 0;
+    while (ndequeued < nchains) {
+        size_t remaining = nchains - ndequeued;
+        size_t count = virtqueue_dequeue_avail_batch(&vq, iters, batch);
+        CU_ASSERT_EQUAL(count, remaining < batch ? remaining : batch);
+
+        for (size_t i = 0; i < count; ++i, ++ndequeued) {
+            CU_ASSERT_EQUAL(iters[i].head, ndequeued);
+            CU_ASSERT_TRUE(virtqueue_next_buffer(&iters[i], &buf));
+            validate_desc(chain[ndequeued], &buf);
+            CU_ASSERT_FALSE(virtqueue_next_buffer(&iters[i], &buf));
+        }
+    }
+
+    CU_ASSERT_EQUAL(0, virtqueue_dequeue_avail_batch(&vq, iters, batch));
+    CU_ASSERT_FALSE(virtqueue_is_broken(&vq));
+
+    free(mem);
+}
+
+/* Bad head id in the middle of a batch breaks the queue but keeps chains before it */
+static void dequeue_batch_bad_head_test(void)
+{
+    const uint16_t qsize = 256;
+
+    struct virtqueue vq;
+    void* mem = vq_alloc(qsize, &g_default_memory_map, &vq);
+
+    vq_fill_desc_id(&vq, 0, (void*) 0x1000, 0x10, 0, 0);
+    vq_publish_desc_id(&vq, 0);
+    vq_publish_desc_id(&vq, qsize);
+    vq_publish_desc_id(&vq, 0);
+
+    struct virtqueue_buffer_iter iters[3];
+    CU_ASSERT_EQUAL(1, virtqueue_dequeue_avail_batch(&vq, iters, 3));
+    CU_ASSERT_TRUE(virtqueue_is_broken(&vq));
+
+    free(mem);
+}
+
+/* Staged used elements are exposed at once with a single notification */
+static void publish_used_batch_test(void)
+{
+    const uint16_t qsize = 16;
+
+    size_t size_bytes = virtq_size(qsize);
+    void* base = aligned_alloc(4096, size_bytes);
+    CU_ASSERT_FATAL(base != NULL);
+    memset(base, 0, size_bytes);
+
+    int callfd = eventfd(0, EFD_NONBLOCK);
+    CU_ASSERT_FATAL(callfd >= 0);
+
+    uint64_t desc_addr = (uint64_t) base;
+    uint64_t avail_addr = desc_addr + sizeof(struct virtq_desc) * qsize;
+    uint64_t used_addr = VIRTQ_ALIGN_UP(avail_addr + sizeof(uint16_t) * (3 + qsize));
+
+    struct virtqueue vq;
+    CU_ASSERT_FATAL(0 == virtqueue_start(&vq, qsize, desc_addr, avail_addr, used_addr, 0, callfd, 0,
+                                         &g_default_memory_map));
+
+    for (uint16_t i = 0; i < 3; ++i) {
+        virtqueue_stage_used(&vq, i, i * 0x10);
+    }
+
+    /* Driver doesn't see anything yet */
+    CU_ASSERT_EQUAL(vq.used->idx, 0);
+
+    virtqueue_publish_used(&vq);
+    CU_ASSERT_EQUAL(vq.used->idx, 3);
+    for (uint16_t i = 0; i < 3; ++i) {
+        CU_ASSERT_EQUAL(vq.used->ring[i].id, i);
+        CU_ASSERT_EQUAL(vq.used->ring[i].len, i * 0x10);
+    }
+
+    eventfd_t count = 0;
+    CU_ASSERT_EQUAL(0, eventfd_read(callfd, &count));
+    CU_ASSERT_EQUAL(count, 1);
+
+    /* Nothing staged - nothing to publish */
+    virtqueue_publish_used(&vq);
+    CU_ASSERT_EQUAL(vq.used->idx, 3);
+    CU_ASSERT_NOT_EQUAL(0, eventfd_read(callfd, &count));
+
+    close(callfd);
+    free(base);
+}
+
+/* Available buffer notification suppression for polling in split layout */
+static void avail_notify_suppression_test(void)
+{
+    const uint16_t qsize = 16;
+
+    size_t size_bytes = virtq_size(qsize);
+    void* base = aligned_alloc(4096, size_bytes);
+    CU_ASSERT_FATAL(base != NULL);
+
+    uint64_t desc_addr = (uint64_t) base;
+    uint64_t avail_addr = desc_addr + sizeof(struct virtq_desc) * qsize;
+    uint64_t used_addr = VIRTQ_ALIGN_UP(avail_addr + sizeof(uint16_t) * (3 + qsize));
+
+    for (int event_idx = 0; event_idx < 2; ++event_idx) {
+        memset(base, 0, size_bytes);
+
+        struct virtqueue vq;
+        CU_ASSERT_FATAL(0 == virtqueue_start(&vq, qsize, desc_addr, avail_addr, used_addr, 0, -1,
+                                             event_idx ? (1ull << VIRTIO_F_EVENT_IDX) : 0,
+                                             &g_default_memory_map));
+
+        uint16_t* avail_event = (uint16_t*) &vq.used->ring[qsize];
+        struct virtqueue_buffer_iter iter;
+
+        CU_ASSERT_FALSE(virtqueue_has_avail(&vq));
+        virtqueue_disable_notifications(&vq);
+
+        if (event_idx) {
+            /* Driver won't cross avail event until avail idx wraps around */
+            CU_ASSERT_EQUAL(*avail_event, (uint16_t) -1);
+        } else {
+            CU_ASSERT_EQUAL(vq.used->flags, VIRTQ_USED_F_NO_NOTIFY);
+        }
+
+        vq_fill_desc_id(&vq, 0, (void*) 0x1000, 0x10, 0, 0);
+        vq_publish_desc_id(&vq, 0);
+        CU_ASSERT_TRUE(virtqueue_has_avail(&vq));
+
+        /* Dequeue while polling does not move avail event */
+        CU_ASSERT_TRUE(virtqueue_dequeue_avail(&vq, &iter));
+        CU_ASSERT_FALSE(virtqueue_has_avail(&vq));
+        if (event_idx) {
+            CU_ASSERT_EQUAL(*avail_event, (uint16_t) -1);
+        }
+
+        /* Buffer made available before driver saw notifications enabled is reported */
+        vq_publish_desc_id(&vq, 0);
+        CU_ASSERT_TRUE(virtqueue_enable_notifications(&vq));
+        if (event_idx) {
+            CU_ASSERT_EQUAL(*avail_event, 1);
+        } else {
+            CU_ASSERT_EQUAL(vq.used->flags, 0);
+        }
+
+        CU_ASSERT_TRUE(virtqueue_dequeue_avail(&vq, &iter));
+        CU_ASSERT_FALSE(virtqueue_enable_notifications(&vq));
+        if (event_idx) {
+            CU_ASSERT_EQUAL(*avail_event, 2);
+        }
+
+        virtqueue_stop(&vq);
+    }
+
+    free(base);
+}
+
 /* Break virtqueue init */
 static void init_negative_test(void)
 {
@@ -603,6 +778,633 @@ static void unmapped_indirect_table_test(void)
     free(base);
 }
 
+/* Queue switched to a new memory map translates buffers with it */
+static void set_memory_map_test(void)
+{
+    const uint16_t qsize = 1024;
+
+    size_t size_bytes = virtq_size(qsize);
+    void* base = aligned_alloc(4096, size_bytes);
+    CU_ASSERT(base != NULL);
+    memset(base, 0, size_bytes);
+
+    /* Both maps have the queue memory itself and the same gpa range backed by different hvas */
+    struct virtio_memory_map old_map = VIRTIO_INIT_MEMORY_MAP;
+    CU_ASSERT_TRUE(0 == virtio_add_guest_region(&old_map, (uint64_t) base, size_bytes, base, false));
+    CU_ASSERT_TRUE(0 == virtio_add_guest_region(&old_map, 0x1000, 0x1000, (void*) 0x10000, false));
+
+    struct virtio_memory_map new_map = VIRTIO_INIT_MEMORY_MAP;
+    CU_ASSERT_TRUE(0 == virtio_add_guest_region(&new_map, (uint64_t) base, size_bytes, base, false));
+    CU_ASSERT_TRUE(0 == virtio_add_guest_region(&new_map, 0x1000, 0x1000, (void*) 0x20000, false));
+
+    struct virtqueue vq;
+    CU_ASSERT_TRUE(0 == vq_init(&vq, qsize, base, &old_map));
+
+    struct virtqueue_buffer buf;
+    struct virtqueue_buffer_iter iter;
+
+    vq_fill_desc_id(&vq, 0, (void*) 0x1000, 0x100, VIRTQ_DESC_F_WRITE, 0);
+    vq_publish_desc_id(&vq, 0);
+    CU_ASSERT_TRUE(virtqueue_dequeue_avail(&vq, &iter));
+    CU_ASSERT_TRUE(virtqueue_next_buffer(&iter, &buf));
+    CU_ASSERT_EQUAL(buf.ptr, (void*) 0x10000);
+    CU_ASSERT_EQUAL(buf.gpa, 0x1000);
+
+    virtqueue_set_memory_map(&vq, &new_map);
+
+    vq_fill_desc_id(&vq, 1, (void*) 0x1000, 0x100, VIRTQ_DESC_F_WRITE, 0);
+    vq_publish_desc_id(&vq, 1);
+    CU_ASSERT_TRUE(virtqueue_dequeue_avail(&vq, &iter));
+    CU_ASSERT_TRUE(virtqueue_next_buffer(&iter, &buf));
+    CU_ASSERT_EQUAL(buf.ptr, (void*) 0x20000);
+    CU_ASSERT_FALSE(virtqueue_is_broken(&vq));
+
+    free(base);
+}
+
+/* Device writes and used ring updates are logged while dirty log is set */
+static void dirty_log_test(void)
+{
+    const uint16_t qsize = 16;
+    const uint64_t ring_gpa = 0x10000;
+    const uint64_t data_gpa = 0x40000;
+    const uint64_t page = 1ull << VIRTIO_LOG_PAGE_SHIFT;
+
+    size_t size_bytes = virtq_size(qsize);
+    void* base = aligned_alloc(4096, size_bytes);
+    CU_ASSERT(base != NULL);
+    memset(base, 0, size_bytes);
+
+    static uint8_t data[0x1000];
+
+    /* Place everything at low guest addresses to keep the log small */
+    struct virtio_memory_map map = VIRTIO_INIT_MEMORY_MAP;
+    CU_ASSERT_TRUE(0 == virtio_add_guest_region(&map, ring_gpa, size_bytes, base, false));
+    CU_ASSERT_TRUE(0 == virtio_add_guest_region(&map, data_gpa, sizeof(data), data, false));
+
+    uint64_t avail_gpa = ring_gpa + sizeof(struct virtq_desc) * qsize;
+    uint64_t used_gpa = VIRTQ_ALIGN_UP(avail_gpa + sizeof(uint16_t) * (3 + qsize));
+
+    struct virtqueue vq;
+    CU_ASSERT_TRUE(0 == virtqueue_start(&vq, qsize, ring_gpa, avail_gpa, used_gpa, 0, -1, 0, &map));
+
+    uint64_t bitmap[2] = {0};
+    struct virtio_dirty_log log = { bitmap, 128 };
+    const uint64_t used_bit = 1ull << (used_gpa / page);
+    const uint64_t data_bit = 1ull << (data_gpa / page - 64);
+
+    /* Rings are logged as soon as logging starts */
+    virtqueue_set_dirty_log(&vq, &log);
+    CU_ASSERT_EQUAL(bitmap[0], used_bit);
+
+    bitmap[0] = 0;
+    virtqueue_log_write(&vq, data_gpa + 0x10, 0x20);
+    CU_ASSERT_EQUAL(bitmap[0], 0);
+    CU_ASSERT_EQUAL(bitmap[1], data_bit);
+
+    virtqueue_enqueue_used(&vq, 0, 0);
+    CU_ASSERT_EQUAL(bitmap[0], used_bit);
+
+    /* Nothing is logged once logging stops */
+    virtqueue_set_dirty_log(&vq, NULL);
+    bitmap[0] = bitmap[1] = 0;
+    virtqueue_log_write(&vq, data_gpa, sizeof(data));
+    virtqueue_enqueue_used(&vq, 1, 0);
+    CU_ASSERT_EQUAL(bitmap[0], 0);
+    CU_ASSERT_EQUAL(bitmap[1], 0);
+
+    virtqueue_stop(&vq);
+    free(base);
+}
+
+/* Chains dequeued but not returned by a previous queue instance are dequeued again after restart */
+static void inflight_test(void)
+{
+    const uint16_t qsize = 16;
+    static uint8_t data[0x100];
+
+    struct virtqueue vq;
+    void* base = vq_alloc(qsize, &g_default_memory_map, &vq);
+
+    struct virtq_inflight* inflight = calloc(1, virtq_inflight_size(qsize));
+    CU_ASSERT_FATAL(inflight != NULL);
+
+    CU_ASSERT_EQUAL(0, virtqueue_set_inflight(&vq, inflight));
+    CU_ASSERT_EQUAL(inflight->version, VIRTQ_INFLIGHT_VERSION);
+    CU_ASSERT_EQUAL(inflight->desc_num, qsize);
+
+    const uint16_t heads[] = { 3, 5, 7, 9 };
+    for (size_t i = 0; i < sizeof(heads) / sizeof(*heads); ++i) {
+        vq_fill_desc_id(&vq, heads[i], data, sizeof(data), VIRTQ_DESC_F_WRITE, 0);
+        vq_publish_desc_id(&vq, heads[i]);
+    }
+
+    struct virtqueue_buffer_iter iters[4];
+    CU_ASSERT_EQUAL(4, virtqueue_dequeue_avail_batch(&vq, iters, 4));
+    for (size_t i = 0; i < sizeof(heads) / sizeof(*heads); ++i) {
+        CU_ASSERT_EQUAL(inflight->desc[heads[i]].inflight, 1);
+    }
+
+    virtqueue_stage_used(&vq, 9, 0);
+    virtqueue_stage_used(&vq, 5, 0);
+    virtqueue_publish_used(&vq);
+    CU_ASSERT_EQUAL(inflight->desc[5].inflight, 0);
+    CU_ASSERT_EQUAL(inflight->desc[9].inflight, 0);
+    CU_ASSERT_EQUAL(inflight->used_idx, 2);
+
+    /* Restarted queue gets the rest back in dequeue order and then nothing new */
+    CU_ASSERT_EQUAL(0, vq_init(&vq, qsize, base, &g_default_memory_map));
+    CU_ASSERT_EQUAL(2, virtqueue_set_inflight(&vq, inflight));
+    CU_ASSERT_EQUAL(virtqueue_get_avail_base(&vq), 4);
+
+    CU_ASSERT_TRUE(virtqueue_has_avail(&vq));
+    CU_ASSERT_TRUE(virtqueue_dequeue_avail(&vq, &iters[0]));
+    CU_ASSERT_EQUAL(iters[0].head, 3);
+    CU_ASSERT_TRUE(virtqueue_dequeue_avail(&vq, &iters[0]));
+    CU_ASSERT_EQUAL(iters[0].head, 7);
+    CU_ASSERT_FALSE(virtqueue_has_avail(&vq));
+    CU_ASSERT_FALSE(virtqueue_dequeue_avail(&vq, &iters[0]));
+
+    /* Pretend we went away right after publishing a batch, before it was cleared */
+    virtqueue_enqueue_used(&vq, 3, 0);
+    inflight->desc[3].inflight = 1;
+    inflight->used_idx = 2;
+
+    CU_ASSERT_EQUAL(0, vq_init(&vq, qsize, base, &g_default_memory_map));
+    CU_ASSERT_EQUAL(1, virtqueue_set_inflight(&vq, inflight));
+    CU_ASSERT_EQUAL(inflight->desc[3].inflight, 0);
+    CU_ASSERT_EQUAL(inflight->used_idx, 3);
+    CU_ASSERT_TRUE(virtqueue_dequeue_avail(&vq, &iters[0]));
+    CU_ASSERT_EQUAL(iters[0].head, 7);
+    CU_ASSERT_FALSE(virtqueue_is_broken(&vq));
+
+    virtqueue_stop(&vq);
+    free(inflight);
+    free(base);
+}
+
+/* Restarted queue resubmits inflight chains even if driver has nothing new for it and never kicks */
+static void inflight_resubmit_without_kick_test(void)
+{
+    const uint16_t qsize = 16;
+    static uint8_t data[0x100];
+
+    struct virtqueue vq;
+    void* base = vq_alloc(qsize, &g_default_memory_map, &vq);
+
+    struct virtq_inflight* inflight = calloc(1, virtq_inflight_size(qsize));
+    CU_ASSERT_FATAL(inflight != NULL);
+
+    /* Fresh region has nothing to resubmit */
+    CU_ASSERT_FALSE(virtq_inflight_has_chains(inflight, qsize));
+    CU_ASSERT_EQUAL(0, virtqueue_set_inflight(&vq, inflight));
+    CU_ASSERT_FALSE(virtq_inflight_has_chains(inflight, qsize));
+
+    vq_fill_desc_id(&vq, 2, data, sizeof(data), VIRTQ_DESC_F_WRITE, 0);
+    vq_publish_desc_id(&vq, 2);
+
+    struct virtqueue_buffer_iter iter;
+    CU_ASSERT_TRUE(virtqueue_dequeue_avail(&vq, &iter));
+    CU_ASSERT_FALSE(virtqueue_has_avail(&vq));
+    CU_ASSERT_TRUE(virtq_inflight_has_chains(inflight, qsize));
+
+    /* Region that claims a different queue size is not scanned */
+    inflight->desc_num = qsize * 2;
+    CU_ASSERT_FALSE(virtq_inflight_has_chains(inflight, qsize));
+    inflight->desc_num = qsize;
+
+    /* Driver has made nothing new available since, restarted queue still has the chain for us */
+    CU_ASSERT_EQUAL(0, vq_init(&vq, qsize, base, &g_default_memory_map));
+    CU_ASSERT_TRUE(virtq_inflight_has_chains(inflight, qsize));
+    CU_ASSERT_EQUAL(1, virtqueue_set_inflight(&vq, inflight));
+    CU_ASSERT_TRUE(virtqueue_has_avail(&vq));
+    CU_ASSERT_TRUE(virtqueue_dequeue_avail(&vq, &iter));
+    CU_ASSERT_EQUAL(iter.head, 2);
+    CU_ASSERT_FALSE(virtqueue_has_avail(&vq));
+
+    /* Once the chain is returned there is nothing left to resubmit */
+    virtqueue_enqueue_used(&vq, 2, 0);
+    CU_ASSERT_FALSE(virtq_inflight_has_chains(inflight, qsize));
+    CU_ASSERT_FALSE(virtqueue_is_broken(&vq));
+
+    virtqueue_stop(&vq);
+    free(inflight);
+    free(base);
+}
+
+/*
+ * Packed virtqueue layout
+ */
+
+static void validate_packed_desc(const struct pvirtq_desc* desc, const struct virtqueue_buffer* buf)
+{
+    CU_ASSERT_EQUAL(buf->ptr, (void*) desc->addr);
+    CU_ASSERT_EQUAL(buf->len, desc->len);
+    CU_ASSERT_EQUAL(buf->ro, (desc->flags & VIRTQ_DESC_F_WRITE) == 0);
+}
+
+static void packed_dequeue_and_verify(struct virtqueue* vq,
+                                      const struct pvirtq_desc* chain,
+                                      uint16_t chain_len,
+                                      uint16_t id)
+{
+    struct virtqueue_buffer buf;
+    struct virtqueue_buffer_iter iter;
+    CU_ASSERT_TRUE(virtqueue_dequeue_avail(vq, &iter));
+    CU_ASSERT_EQUAL(iter.head, id);
+
+    for (uint16_t i = 0; i < chain_len; ++i) {
+        CU_ASSERT_TRUE(virtqueue_next_buffer(&iter, &buf));
+        if (chain) {
+            validate_packed_desc(&chain[i], &buf);
+        }
+    }
+
+    CU_ASSERT_FALSE(virtqueue_next_buffer(&iter, &buf));
+}
+
+/* Test direct descriptors chain in packed layout */
+static void packed_dequeue_test(void)
+{
+    const uint16_t qsize = 1024;
+
+    struct virtqueue vq;
+    void* mem = vq_alloc_packed(qsize, &g_default_memory_map, &vq);
+
+    struct vq_packed_driver drv;
+    vq_packed_driver_init(&drv, &vq);
+
+    /* Chain of max length, buffer id goes into the last descriptor */
+    struct pvirtq_desc chain[qsize];
+    for (uint16_t i = 0; i < qsize; ++i) {
+        chain[i] = (struct pvirtq_desc) { i * 0x1000, 0x10, 0, (i & 1) ? VIRTQ_DESC_F_WRITE : 0 };
+    }
+
+    chain[qsize - 1].id = 42;
+    vq_packed_publish_chain(&drv, chain, qsize);
+
+    packed_dequeue_and_verify(&vq, chain, qsize, 42);
+    CU_ASSERT_FALSE(virtqueue_is_broken(&vq));
+
+    virtqueue_stop(&vq);
+    free(mem);
+}
+
+/* Test indirect descriptors in packed layout */
+static void packed_dequeue_indirect_test(void)
+{
+    const uint16_t qsize = 1024;
+
+    struct virtqueue vq;
+    void* mem = vq_alloc_packed(qsize, &g_default_memory_map, &vq);
+
+    struct vq_packed_driver drv;
+    vq_packed_driver_init(&drv, &vq);
+
+    /* Table pointer descriptor counts towards max chain length */
+    const uint16_t chain_len = qsize - 1;
+    struct pvirtq_desc itbl[chain_len];
+    for (uint16_t i = 0; i < chain_len; ++i) {
+        itbl[i] = (struct pvirtq_desc) { i * 0x1000, 0x10, 0, VIRTQ_DESC_F_WRITE };
+    }
+
+    struct pvirtq_desc desc = { (uintptr_t) itbl, sizeof(itbl), 7, VIRTQ_DESC_F_INDIRECT };
+    vq_packed_publish_chain(&drv, &desc, 1);
+
+    packed_dequeue_and_verify(&vq, itbl, chain_len, 7);
+    CU_ASSERT_FALSE(virtqueue_is_broken(&vq));
+
+    virtqueue_stop(&vq);
+    free(mem);
+}
+
+/* Fill and drain packed queue several times so that both wrap counters flip */
+static void packed_dequeue_many_test(void)
+{
+    /* Packed queues don't need power-of-2 sizes */
+    const uint16_t qsize = 100;
+    const uint16_t chain_len = 3;
+
+    struct virtqueue vq;
+    void* mem = vq_alloc_packed(qsize, &g_default_memory_map, &vq);
+
+    struct vq_packed_driver drv;
+    vq_packed_driver_init(&drv, &vq);
+
+    struct pvirtq_desc chain[chain_len];
+    for (uint16_t i = 0; i < chain_len; ++i) {
+        chain[i] = (struct pvirtq_desc) { (i + 1) * 0x1000, 0x10, 0, 0 };
+    }
+
+    for (uint16_t round = 0; round < 8; ++round) {
+        const uint16_t nchains = qsize / chain_len;
+
+        for (uint16_t i = 0; i < nchains; ++i) {
+            chain[chain_len - 1].id = i;
+            vq_packed_publish_chain(&drv, chain, chain_len);
+        }
+
+        for (uint16_t i = 0; i < nchains; ++i) {
+            packed_dequeue_and_verify(&vq, chain, chain_len, i);
+        }
+
+        struct virtqueue_buffer_iter iter;
+        CU_ASSERT_FALSE(virtqueue_dequeue_avail(&vq, &iter));
+
+        /* Complete in reverse order, used ring is filled in completion order */
+        for (uint16_t i = 0; i < nchains; ++i) {
+            virtqueue_enqueue_used(&vq, nchains - i - 1, i);
+        }
+
+        for (uint16_t i = 0; i < nchains; ++i) {
+            uint16_t id;
+            uint32_t len;
+            CU_ASSERT_TRUE(vq_packed_get_used(&drv, chain_len, &id, &len));
+            CU_ASSERT_EQUAL(id, nchains - i - 1);
+            CU_ASSERT_EQUAL(len, i);
+        }
+
+        uint16_t id;
+        uint32_t len;
+        CU_ASSERT_FALSE(vq_packed_get_used(&drv, chain_len, &id, &len));
+        CU_ASSERT_FALSE(virtqueue_is_broken(&vq));
+    }
+
+    /* Avail base reflects ring position and wrap counter */
+    CU_ASSERT_EQUAL(virtqueue_get_avail_base(&vq), drv.avail_idx | (drv.avail_wrap << 15));
+
+    virtqueue_stop(&vq);
+    free(mem);
+}
+
+/* Test batched dequeues in packed layout */
+static void packed_dequeue_batch_test(void)
+{
+    const uint16_t qsize = 64;
+    const size_t batch = 16;
+
+    struct virtqueue vq;
+    void* mem = vq_alloc_packed(qsize, &g_default_memory_map, &vq);
+
+    struct vq_packed_driver drv;
+    vq_packed_driver_init(&drv, &vq);
+
+    struct pvirtq_desc chain[2] = {
+        { 0x1000, 0x10, 0, 0 },
+        { 0x2000, 0x10, 0, VIRTQ_DESC_F_WRITE },
+    };
+
+    const uint16_t nchains = qsize / 2;
+    for (uint16_t i = 0; i < nchains; ++i) {
+        chain[1].id = i;
+        vq_packed_publish_chain(&drv, chain, 2);
+    }
+
+    struct virtqueue_buffer buf;
+    struct virtqueue_buffer_iter iters[batch];
+    for (uint16_t n = 0; n < nchains; n += batch) {
+        CU_ASSERT_EQUAL(batch, virtqueue_dequeue_avail_batch(&vq, iters, batch));
+        for (size_t i = 0; i < batch; ++i) {
+            CU_ASSERT_EQUAL(iters[i].head, n + i);
+            CU_ASSERT_TRUE(virtqueue_next_buffer(&iters[i], &buf));
+            validate_packed_desc(&chain[0], &buf);
+            CU_ASSERT_TRUE(virtqueue_next_buffer(&iters[i], &buf));
+            validate_packed_desc(&chain[1], &buf);
+            CU_ASSERT_FALSE(virtqueue_next_buffer(&iters[i], &buf));
+        }
+    }
+
+    CU_ASSERT_EQUAL(0, virtqueue_dequeue_avail_batch(&vq, iters, batch));
+    CU_ASSERT_FALSE(virtqueue_is_broken(&vq));
+
+    virtqueue_stop(&vq);
+    free(mem);
+}
+
+/* Staged used elements in packed layout are exposed at once */
+static void packed_publish_used_batch_test(void)
+{
+    const uint16_t qsize = 16;
+
+    struct virtqueue vq;
+    void* mem = vq_alloc_packed(qsize, &g_default_memory_map, &vq);
+
+    struct vq_packed_driver drv;
+    vq_packed_driver_init(&drv, &vq);
+
+    struct pvirtq_desc desc = { 0x1000, 0x10, 0, 0 };
+    for (uint16_t i = 0; i < qsize; ++i) {
+        desc.id = i;
+        vq_packed_publish_chain(&drv, &desc, 1);
+    }
+
+    struct virtqueue_buffer_iter iters[qsize];
+    CU_ASSERT_EQUAL(qsize, virtqueue_dequeue_avail_batch(&vq, iters, qsize));
+
+    /* Stage the whole ring so that the batch ends exactly where it started */
+    for (uint16_t i = 0; i < qsize; ++i) {
+        virtqueue_stage_used(&vq, iters[i].head, 0);
+    }
+
+    uint16_t id;
+    uint32_t len;
+    CU_ASSERT_FALSE(vq_packed_get_used(&drv, 1, &id, &len));
+
+    virtqueue_publish_used(&vq);
+    for (uint16_t i = 0; i < qsize; ++i) {
+        CU_ASSERT_TRUE(vq_packed_get_used(&drv, 1, &id, &len));
+        CU_ASSERT_EQUAL(id, i);
+    }
+
+    CU_ASSERT_FALSE(vq_packed_get_used(&drv, 1, &id, &len));
+
+    virtqueue_stop(&vq);
+    free(mem);
+}
+
+/* Check used buffer notifications with packed event suppression */
+static void packed_notify_test(void)
+{
+    const uint16_t qsize = 16;
+
+    void* base = aligned_alloc(4096, VIRTQ_ALIGN_UP(pvirtq_size(qsize)));
+    CU_ASSERT_FATAL(base != NULL);
+    memset(base, 0, pvirtq_size(qsize));
+
+    int callfd = eventfd(0, EFD_NONBLOCK);
+    CU_ASSERT_FATAL(callfd >= 0);
+
+    uint64_t desc_addr = (uint64_t) base;
+    uint64_t driver_addr = desc_addr + sizeof(struct pvirtq_desc) * qsize;
+    uint64_t device_addr = driver_addr + sizeof(struct pvirtq_event_suppress);
+    uint64_t features = (1ull << VIRTIO_F_RING_PACKED) | (1ull << VIRTIO_F_EVENT_IDX);
+
+    struct virtqueue vq;
+    CU_ASSERT_FATAL(0 == virtqueue_start(&vq, qsize, desc_addr, driver_addr, device_addr, 1u << 15, callfd,
+                                         features, &g_default_memory_map));
+
+    /* Device always wants to be kicked */
+    CU_ASSERT_EQUAL(vq.device_event->flags, RING_EVENT_FLAGS_ENABLE);
+
+    struct vq_packed_driver drv;
+    vq_packed_driver_init(&drv, &vq);
+
+    struct pvirtq_desc desc = { 0x1000, 0x10, 0, 0 };
+    for (uint16_t i = 0; i < 4; ++i) {
+        desc.id = i;
+        vq_packed_publish_chain(&drv, &desc, 1);
+    }
+
+    struct virtqueue_buffer_iter iter;
+    eventfd_t count = 0;
+
+    /* Notifications disabled */
+    vq.driver_event->flags = RING_EVENT_FLAGS_DISABLE;
+    CU_ASSERT_TRUE(virtqueue_dequeue_avail(&vq, &iter));
+    virtqueue_release_buffers(&iter, 0);
+    CU_ASSERT_NOT_EQUAL(0, eventfd_read(callfd, &count));
+
+    /* Notifications enabled */
+    vq.driver_event->flags = RING_EVENT_FLAGS_ENABLE;
+    CU_ASSERT_TRUE(virtqueue_dequeue_avail(&vq, &iter));
+    virtqueue_release_buffers(&iter, 0);
+    CU_ASSERT_EQUAL(0, eventfd_read(callfd, &count));
+
+    /* Driver asks to be notified once used position 4 (in current wrap) is passed */
+    vq.driver_event->flags = RING_EVENT_FLAGS_DESC;
+    vq.driver_event->off_wrap = 3 | (1u << 15);
+    CU_ASSERT_TRUE(virtqueue_dequeue_avail(&vq, &iter));
+    virtqueue_release_buffers(&iter, 0);
+    CU_ASSERT_NOT_EQUAL(0, eventfd_read(callfd, &count));
+
+    CU_ASSERT_TRUE(virtqueue_dequeue_avail(&vq, &iter));
+    virtqueue_release_buffers(&iter, 0);
+    CU_ASSERT_EQUAL(0, eventfd_read(callfd, &count));
+
+    virtqueue_stop(&vq);
+    close(callfd);
+    free(base);
+}
+
+/* Available buffer notification suppression for polling in packed layout */
+static void packed_avail_notify_suppression_test(void)
+{
+    const uint16_t qsize = 16;
+
+    struct virtqueue vq;
+    void* mem = vq_alloc_packed(qsize, &g_default_memory_map, &vq);
+
+    struct vq_packed_driver drv;
+    vq_packed_driver_init(&drv, &vq);
+
+    CU_ASSERT_FALSE(virtqueue_has_avail(&vq));
+
+    virtqueue_disable_notifications(&vq);
+    CU_ASSERT_EQUAL(vq.device_event->flags, RING_EVENT_FLAGS_DISABLE);
+
+    struct pvirtq_desc desc = { 0x1000, 0x10, 0, 0 };
+    vq_packed_publish_chain(&drv, &desc, 1);
+    CU_ASSERT_TRUE(virtqueue_has_avail(&vq));
+
+    struct virtqueue_buffer_iter iter;
+    CU_ASSERT_TRUE(virtqueue_dequeue_avail(&vq, &iter));
+    CU_ASSERT_FALSE(virtqueue_has_avail(&vq));
+
+    desc.id = 1;
+    vq_packed_publish_chain(&drv, &desc, 1);
+    CU_ASSERT_TRUE(virtqueue_enable_notifications(&vq));
+    CU_ASSERT_EQUAL(vq.device_event->flags, RING_EVENT_FLAGS_ENABLE);
+
+    CU_ASSERT_TRUE(virtqueue_dequeue_avail(&vq, &iter));
+    CU_ASSERT_FALSE(virtqueue_enable_notifications(&vq));
+
+    virtqueue_stop(&vq);
+    free(mem);
+}
+
+/* Packed queue init with bad arguments */
+static void packed_init_negative_test(void)
+{
+    size_t size_bytes = VIRTQ_ALIGN_UP(pvirtq_size(VIRTQ_MAX_SIZE));
+    void* mem = aligned_alloc(4096, size_bytes);
+    CU_ASSERT_TRUE(mem != NULL);
+
+    struct virtqueue vq;
+
+    /* invalid qsize */
+    CU_ASSERT_TRUE(0 != vq_init_packed(&vq, 0, mem, &g_default_memory_map));
+    CU_ASSERT_TRUE(0 != vq_init_packed(&vq, VIRTQ_MAX_SIZE + 1, mem, &g_default_memory_map));
+
+    /* base memory not aligned */
+    CU_ASSERT_TRUE(0 != vq_init_packed(&vq, VIRTQ_MAX_SIZE, mem + 1, &g_default_memory_map));
+
+    /* avail base outside of the ring */
+    uint64_t desc_addr = (uint64_t) mem;
+    uint64_t driver_addr = desc_addr + sizeof(struct pvirtq_desc) * 16;
+    CU_ASSERT_TRUE(0 != virtqueue_start(&vq, 16, desc_addr, driver_addr, driver_addr + 4, 16, -1,
+                                        1ull << VIRTIO_F_RING_PACKED, &g_default_memory_map));
+
+    /* Non power-of-2 size is fine */
+    CU_ASSERT_TRUE(0 == vq_init_packed(&vq, VIRTQ_MAX_SIZE - 1, mem, &g_default_memory_map));
+    virtqueue_stop(&vq);
+
+    free(mem);
+}
+
+/* Malformed packed chains should mark the queue broken */
+static void packed_broken_chain_test(void)
+{
+    const uint16_t qsize = 64;
+
+    struct pvirtq_desc itbl[2] = {
+        { 0x1000, 0x10, 0, 0 },
+        { 0x2000, 0x10, 0, VIRTQ_DESC_F_INDIRECT },
+    };
+
+    struct {
+        struct pvirtq_desc chain[2];
+        uint16_t len;
+        uint16_t nbufs;
+    } cases[] = {
+        /* Buffer id out of range */
+        { { { 0x1000, 0x10, qsize, 0 } }, 1, 0 },
+        /* Zero length buffer */
+        { { { 0x1000, 0, 0, 0 } }, 1, 0 },
+        /* Indirect descriptor is not the last one in chain */
+        { { { (uintptr_t) itbl, sizeof(itbl[0]), 0, VIRTQ_DESC_F_INDIRECT }, { 0x1000, 0x10, 0, 0 } }, 2, 0 },
+        /* Empty indirect table */
+        { { { (uintptr_t) itbl, sizeof(itbl[0]) - 1, 0, VIRTQ_DESC_F_INDIRECT } }, 1, 0 },
+        /* Nested indirect table */
+        { { { (uintptr_t) &itbl[1], sizeof(itbl[1]), 0, VIRTQ_DESC_F_INDIRECT } }, 1, 0 },
+        /* Indirect table in indirect table, after a good descriptor */
+        { { { (uintptr_t) itbl, sizeof(itbl), 0, VIRTQ_DESC_F_INDIRECT } }, 1, 1 },
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(*cases); ++i) {
+        struct virtqueue vq;
+        void* mem = vq_alloc_packed(qsize, &g_default_memory_map, &vq);
+
+        struct vq_packed_driver drv;
+        vq_packed_driver_init(&drv, &vq);
+        vq_packed_publish_chain(&drv, cases[i].chain, cases[i].len);
+
+        struct virtqueue_buffer buf;
+        struct virtqueue_buffer_iter iter;
+        if (virtqueue_dequeue_avail(&vq, &iter)) {
+            for (uint16_t j = 0; j < cases[i].nbufs; ++j) {
+                CU_ASSERT_TRUE(virtqueue_next_buffer(&iter, &buf));
+            }
+
+            CU_ASSERT_FALSE(virtqueue_next_buffer(&iter, &buf));
+        }
+
+        CU_ASSERT_TRUE(virtqueue_is_broken(&vq));
+
+        virtqueue_stop(&vq);
+        free(mem);
+    }
+}
+
 int main(int argc, char** argv)
 {
     if (CUE_SUCCESS != CU_initialize_registry()) {
@@ -620,6 +1422,10 @@ int main(int argc, char** argv)
     CU_add_test(suite, "dequeue_combined_test", dequeue_combined_test);
     CU_add_test(suite, "dequeue_many_test", dequeue_many_test);
     CU_add_test(suite, "dequeue_many_indirect_test", dequeue_many_indirect_test);
+    CU_add_test(suite, "dequeue_batch_test", dequeue_batch_test);
+    CU_add_test(suite, "dequeue_batch_bad_head_test", dequeue_batch_bad_head_test);
+    CU_add_test(suite, "publish_used_batch_test", publish_used_batch_test);
+    CU_add_test(suite, "avail_notify_suppression_test", avail_notify_suppression_test);
 
     CU_add_test(suite, "init_negative_test", init_negative_test);
     CU_add_test(suite, "dequeue_empty_test", dequeue_empty_test);
@@ -637,6 +1443,20 @@ int main(int argc, char** argv)
 
     CU_add_test(suite, "buffer_crosses_ro_boundary_test", buffer_crosses_ro_boundary_test);
     CU_add_test(suite, "unmapped_indirect_table_test", unmapped_indirect_table_test);
+    CU_add_test(suite, "set_memory_map_test", set_memory_map_test);
+    CU_add_test(suite, "dirty_log_test", dirty_log_test);
+    CU_add_test(suite, "inflight_test", inflight_test);
+    CU_add_test(suite, "inflight_resubmit_without_kick_test", inflight_resubmit_without_kick_test);
+
+    CU_add_test(suite, "packed_dequeue_test", packed_dequeue_test);
+    CU_add_test(suite, "packed_dequeue_indirect_test", packed_dequeue_indirect_test);
+    CU_add_test(suite, "packed_dequeue_many_test", packed_dequeue_many_test);
+    CU_add_test(suite, "packed_dequeue_batch_test", packed_dequeue_batch_test);
+    CU_add_test(suite, "packed_publish_used_batch_test", packed_publish_used_batch_test);
+    CU_add_test(suite, "packed_notify_test", packed_notify_test);
+    CU_add_test(suite, "packed_avail_notify_suppression_test", packed_avail_notify_suppression_test);
+    CU_add_test(suite, "packed_init_negative_test", packed_init_negative_test);
+    CU_add_test(suite, "packed_broken_chain_test", packed_broken_chain_test);
 
     /* run tests */
     CU_basic_set_mode(CU_BRM_VERBOSE);
@@ -9,7 +9,7 @@ int vq_init(struct virtqueue* vq, uint16_t qsize, void* base, struct virtio_memo
     uint64_t avail_addr = desc_addr + sizeof(struct virtq_desc) * qsize;
     uint64_t used_addr = VIRTQ_ALIGN_UP(avail_addr + sizeof(uint16_t) * (3 + qsize));
 
-    return virtqueue_start(vq, qsize, desc_addr, avail_addr, used_addr, 0, -1, false, mem);
+    return virtqueue_start(vq, qsize, desc_addr, avail_addr, used_addr, 0, -1, 0, mem);
 }
 
 /* Allocate memory to hold a queue of qsize descriptors and init a virtqueue on top of it */
@@ -59,3 +59,96 @@ void vq_publish_desc_id(struct virtqueue* vq, uint16_t id)
     vq->avail->ring[vq->avail->idx] = id;
     vq->avail->idx++;
 }
+
+int vq_init_packed(struct virtqueue* vq, uint16_t qsize, void* base, struct virtio_memory_map* mem)
+{
+    uint64_t desc_addr = (uint64_t) base;
+    uint64_t driver_addr = desc_addr + sizeof(struct pvirtq_desc) * qsize;
+    uint64_t device_addr = driver_addr + sizeof(struct pvirtq_event_suppress);
+
+    return virtqueue_start(vq, qsize, desc_addr, driver_addr, device_addr, 1u << 15, -1,
+                           1ull << VIRTIO_F_RING_PACKED, mem);
+}
+
+void* vq_alloc_packed(uint16_t qsize, struct virtio_memory_map* mem, struct virtqueue* vq)
+{
+    size_t size_bytes = VIRTQ_ALIGN_UP(pvirtq_size(qsize));
+    void* base = aligned_alloc(4096, size_bytes);
+    CU_ASSERT(base != NULL);
+    memset(base, 0, size_bytes);
+
+    int res = vq_init_packed(vq, qsize, base, mem);
+    CU_ASSERT(res == 0);
+    return base;
+}
+
+void vq_packed_driver_init(struct vq_packed_driver* drv, struct virtqueue* vq)
+{
+    drv->vq = vq;
+    drv->avail_idx = 0;
+    drv->avail_wrap = true;
+    drv->used_idx = 0;
+    drv->used_wrap = true;
+}
+
+static uint16_t packed_avail_flags(bool wrap)
+{
+    return wrap ? VIRTQ_DESC_F_AVAIL : VIRTQ_DESC_F_USED;
+}
+
+uint16_t vq_packed_publish_chain(struct vq_packed_driver* drv, const struct pvirtq_desc* chain, uint16_t len)
+{
+    struct virtqueue* vq = drv->vq;
+    uint16_t head = drv->avail_idx;
+    uint16_t head_flags = 0;
+
+    for (uint16_t i = 0; i < len; ++i) {
+        uint16_t flags = chain[i].flags | packed_avail_flags(drv->avail_wrap);
+        if (i + 1 < len) {
+            flags |= VIRTQ_DESC_F_NEXT;
+        }
+
+        struct pvirtq_desc* pdesc = &vq->pdesc[drv->avail_idx];
+        pdesc->addr = chain[i].addr;
+        pdesc->len = chain[i].len;
+        pdesc->id = chain[i].id;
+
+        /* Head descriptor flags are written last to make the whole chain available at once */
+        if (i == 0) {
+            head_flags = flags;
+        } else {
+            pdesc->flags = flags;
+        }
+
+        if (++drv->avail_idx == vq->qsize) {
+            drv->avail_idx = 0;
+            drv->avail_wrap = !drv->avail_wrap;
+        }
+    }
+
+    vq->pdesc[head].flags = head_flags;
+    return head;
+}
+
+bool vq_packed_get_used(struct vq_packed_driver* drv, uint16_t chain_len, uint16_t* id, uint32_t* len)
+{
+    struct virtqueue* vq = drv->vq;
+    struct pvirtq_desc* pdesc = &vq->pdesc[drv->used_idx];
+
+    bool avail = (pdesc->flags & VIRTQ_DESC_F_AVAIL) != 0;
+    bool used = (pdesc->flags & VIRTQ_DESC_F_USED) != 0;
+    if (avail != used || used != drv->used_wrap) {
+        return false;
+    }
+
+    *id = pdesc->id;
+    *len = pdesc->len;
+
+    drv->used_idx += chain_len;
+    if (drv->used_idx >= vq->qsize) {
+        drv->used_idx -= vq->qsize;
+        drv->used_wrap = !drv->used_wrap;
+    }
+
+    return true;
+}
@@ -30,3 +30,36 @@ struct virtq_desc* vq_fill_desc_id(
 
 /** Publish specified desc id in available ring */
 void vq_publish_desc_id(struct virtqueue* vq, uint16_t id);
+
+/*
+ * Packed virtqueue layout
+ */
+
+/** Driver-side state of a packed virtqueue */
+struct vq_packed_driver
+{
+    struct virtqueue* vq;
+    uint16_t avail_idx;
+    bool avail_wrap;
+    uint16_t used_idx;
+    bool used_wrap;
+};
+
+/** Init an allocated packed virtqueue */
+int vq_init_packed(struct virtqueue* vq, uint16_t qsize, void* base, struct virtio_memory_map* mem);
+
+/** Allocate memory to hold a packed queue of qsize descriptors and init a virtqueue on top of it */
+void* vq_alloc_packed(uint16_t qsize, struct virtio_memory_map* mem, struct virtqueue* vq);
+
+/** Init driver state for a freshly started packed virtqueue */
+void vq_packed_driver_init(struct vq_packed_driver* drv, struct virtqueue* vq);
+
+/**
+ * Make a chain of len buffers available in the descriptor ring.
+ * Driver sets chain and avail flags, caller only provides WRITE/INDIRECT flags and buffer id.
+ * Returns ring position of chain head.
+ */
+uint16_t vq_packed_publish_chain(struct vq_packed_driver* drv, const struct pvirtq_desc* chain, uint16_t len);
+
+/** Consume next used element that occupies chain_len ring entries. Returns false if there is none. */
+bool vq_packed_get_used(struct vq_packed_driver* drv, uint16_t chain_len, uint16_t* id, uint32_t* len);
@@ -4,24 +4,68 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <stddef.h>
+#include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #include <vhost.h>
+#include <worker.h>
+#include <uring.h>
 #include <virtio/blk.h>
+#include <virtio/memory.h>
 
 #define DIE(fmt, ...) do { \
     fprintf(stderr, fmt "\n", ##__VA_ARGS__); \
     exit(EXIT_FAILURE); \
 } while (0);
 
+#define SERVER_MAX_WORKERS 64
+
+/* Submission queue size of per-queue io_uring instances */
+#define SERVER_URING_ENTRIES 128
+
+/* Buffers and offsets aligned to this are sent to the O_DIRECT fd */
+#define SERVER_DIRECT_IO_ALIGN 512
+
+/* Kernel limit on the size of a single io_uring fixed buffer */
+#define SERVER_FIXED_BUF_MAX_SIZE (1ull << 30)
+
+/* Guest regions are split into fixed buffers of at most SERVER_FIXED_BUF_MAX_SIZE */
+#define SERVER_MAX_FIXED_BUFS 1024
+
+/* Limits of discard and write zeroes requests, ranges are handed to fallocate one by one */
+#define SERVER_MAX_DISCARD_SECTORS (1u << 22)
+#define SERVER_MAX_DISCARD_SEGS 32
+
 static int g_fd = -1;
 
+/* Disk image opened with O_DIRECT, -1 if filesystem does not support it */
+static int g_direct_fd = -1;
+
+/*
+ * Writes complete from the page cache and guest flushes make them durable.
+ * Otherwise every write is issued with RWF_DSYNC. Guest can switch modes through device config.
+ */
+static bool g_writeback;
+
 static void usage(void)
 {
-    fprintf(stderr, "vhost-server socket-path disk-image\n");
+    fprintf(stderr, "vhost-server [-u] [-w cpu[,cpu...]] [-p usecs] [-q queues] [-b sync|uring] [-f] [-m policy[,policy...]] [-n] [-c writethrough|writeback] "
+                    "socket-path disk-image\n");
+    fprintf(stderr, "  -u  use io_uring event loop\n");
+    fprintf(stderr, "  -w  service vrings on worker threads pinned to given cpus\n");
+    fprintf(stderr, "  -p  busy poll vrings for up to usecs after a kick\n");
+    fprintf(stderr, "  -q  number of request queues (default 1)\n");
+    fprintf(stderr, "  -b  disk io backend: blocking pread/pwrite (default) or io_uring\n");
+    fprintf(stderr, "  -f  register guest memory as io_uring fixed buffers (with -b uring), pins guest memory\n");
+    fprintf(stderr, "  -m  guest memory policy: populate (prefault), mlock, numa (prefer node of the first worker cpu, needs -w)\n");
+    fprintf(stderr, "  -n  offer host notifiers, guest kicks become memory writes we busy poll for, needs -w\n");
+    fprintf(stderr, "  -c  initial disk cache mode: synchronous writes (default) or page cache writes made durable by guest flushes\n");
 }
 
 static int handle_rw(struct virtio_blk* vblk, struct blk_io_request* bio)
@@ -48,7 +92,8 @@ static int handle_rw(struct virtio_blk* vblk, struct blk_io_request* bio)
         if (bio->type == BLK_IO_READ) {
             res = pread(g_fd, pvec->ptr, count, offset);
         } else if (bio->type == BLK_IO_WRITE) {
-            res = pwrite(g_fd, pvec->ptr, count, offset);
+            struct iovec iov = { pvec->ptr, count };
+            res = pwritev2(g_fd, &iov, 1, offset, (g_writeback ? 0 : RWF_DSYNC));
         } else {
             DIE("Unexpected request type %d", bio->type);
         }
@@ -69,41 +114,554 @@ static int handle_rw(struct virtio_blk* vblk, struct blk_io_request* bio)
     return 0;
 }
 
-int process_event(struct virtio_dev* vdev, struct vring* vring)
+/* Zero out the range, allocating it back if filesystem can only punch holes */
+static int zero_range(off_t offset, off_t len, bool unmap)
 {
-    int error = 0;
-    struct virtio_blk* vblk = (struct virtio_blk*) vdev; /* TODO: add a type conversion helper in virtio */
+    if (unmap) {
+        return fallocate(g_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+    }
+
+    int res = fallocate(g_fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, offset, len);
+    if (res != 0 && errno == EOPNOTSUPP) {
+        res = fallocate(g_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+        if (res == 0) {
+            res = fallocate(g_fd, FALLOC_FL_KEEP_SIZE, offset, len);
+        }
+    }
+
+    return res;
+}
+
+static int handle_discard_write_zeroes(struct virtio_blk* vblk, struct blk_io_request* bio)
+{
+    for (uint32_t i = 0; i < bio->nranges; ++i) {
+        const struct blk_io_range* range = &bio->ranges[i];
+        off_t offset = range->sector << VIRTIO_BLK_SECTOR_SHIFT;
+        off_t len = (off_t)range->num_sectors << VIRTIO_BLK_SECTOR_SHIFT;
+
+        int res = (bio->type == BLK_IO_DISCARD ?
+                   fallocate(g_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) :
+                   zero_range(offset, len, range->unmap));
+        if (res != 0) {
+            fprintf(stderr, "fallocate failed at offset %lu, size %lu: %d\n", offset, len, -errno);
+            return -errno;
+        }
+    }
+
+    /* fallocate has no per-call sync flag, in writethrough mode completed request has to be durable */
+    if (!g_writeback && fdatasync(g_fd) != 0) {
+        return -errno;
+    }
+
+    return 0;
+}
+
+static enum blk_io_status handle_request(struct virtio_blk* vblk, struct blk_io_request* bio)
+{
+    fprintf(stdout, "Handling request type %d\n", bio->type);
+
+    if (bio->type == BLK_IO_GET_ID) {
+        snprintf(bio->vecs[0].ptr, bio->vecs[0].len, "vhost-blk-0");
+        return BLK_SUCCESS;
+    }
+
+    if (bio->type == BLK_IO_FLUSH) {
+        if (fdatasync(g_fd) != 0) {
+            fprintf(stderr, "Flush failed: %d\n", -errno);
+            return BLK_IOERROR;
+        }
 
+        return BLK_SUCCESS;
+    }
+
+    if (bio->type == BLK_IO_DISCARD || bio->type == BLK_IO_WRITE_ZEROES) {
+        return (handle_discard_write_zeroes(vblk, bio) == 0 ? BLK_SUCCESS : BLK_IOERROR);
+    }
+
+    /*
+     * All IO error are reported to guest and not vhost implementation
+     */
+
+    int error = handle_rw(vblk, bio);
+    if (error) {
+        fprintf(stderr, "Failed handling bio %p: %d\n", bio, error);
+        return BLK_IOERROR;
+    }
+
+    return BLK_SUCCESS;
+}
+
+/*
+ * Cache mode switch requested by the guest, shared by both backends
+ */
+static int set_writeback(struct virtio_blk* vblk, bool writeback)
+{
+    /* Writes completed from page cache so far become durable before guest relies on writethrough */
+    if (!writeback && fdatasync(g_fd) != 0) {
+        fprintf(stderr, "Flush failed: %d\n", -errno);
+        return -errno;
+    }
+
+    fprintf(stdout, "Switching to %s cache mode\n", (writeback ? "writeback" : "writethrough"));
+    g_writeback = writeback;
+    return 0;
+}
+
+/*
+ * Blocking backend, completes every request before returning from submit
+ */
+static int sync_submit(struct virtio_blk* vblk, struct virtqueue* vq, struct blk_io_request* bio)
+{
+    virtio_blk_post_completion(vblk, bio, handle_request(vblk, bio));
+    return 0;
+}
+
+static const struct virtio_blk_backend_ops g_sync_backend = {
+    .submit = sync_submit,
+    .set_writeback = set_writeback,
+};
+
+/*
+ * io_uring backend, each queue has its own ring that signals vring wakefd on completions
+ */
+
+/* virtio_iovec mirrors struct iovec, so bio vectors can be handed to the kernel as is */
+_Static_assert(sizeof(struct virtio_iovec) == sizeof(struct iovec), "iovec size mismatch");
+_Static_assert(offsetof(struct virtio_iovec, ptr) == offsetof(struct iovec, iov_base), "iovec layout mismatch");
+_Static_assert(offsetof(struct virtio_iovec, len) == offsetof(struct iovec, iov_len), "iovec layout mismatch");
+
+/*
+ * Low bits of sqe user_data mark requests sent to the O_DIRECT fd and remainders of short transfers.
+ * Both bios and remainders are at least 4-byte aligned.
+ */
+#define URING_REQ_DIRECT 1ull
+#define URING_REQ_REST 2ull
+#define URING_REQ_FLAGS (URING_REQ_DIRECT | URING_REQ_REST)
+
+/* Part of a read or write the kernel has not transferred yet */
+struct uring_rest
+{
     struct blk_io_request* bio;
-    while (true) {
-        error = virtio_blk_dequeue_request(vblk, &vring->vq, &bio);
-        if (error == -ENOENT) {
-            break;
+
+    /* Bytes transferred so far */
+    uint64_t done;
+
+    struct iovec vecs[/* bio->nvecs */];
+};
+
+struct uring_queue
+{
+    struct uring ring;
+
+    /* Requests submitted to the ring without a reaped completion */
+    uint32_t inflight;
+};
+
+static struct uring_queue* g_uring_queues;
+static int g_num_uring_queues;
+
+/* Guest memory registered with every queue ring, buffer index is the position in this table */
+static bool g_use_fixed_bufs;
+static struct iovec g_fixed_bufs[SERVER_MAX_FIXED_BUFS];
+static int g_num_fixed_bufs;
+
+static struct uring_queue* get_uring_queue(struct virtqueue* vq)
+{
+    struct vring* vring = (struct vring*)((char*)vq - offsetof(struct vring, vq));
+    return &g_uring_queues[vring - vring->dev->vrings];
+}
+
+static bool can_use_direct_io(const struct blk_io_request* bio)
+{
+    if (g_direct_fd < 0) {
+        return false;
+    }
+
+    if ((bio->sector << VIRTIO_BLK_SECTOR_SHIFT) % SERVER_DIRECT_IO_ALIGN) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < bio->nvecs; ++i) {
+        if ((uintptr_t)bio->vecs[i].ptr % SERVER_DIRECT_IO_ALIGN || bio->vecs[i].len % SERVER_DIRECT_IO_ALIGN) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Find fixed buffer covering the whole range, -1 if there is none */
+static int find_fixed_buf(const void* ptr, size_t len)
+{
+    for (int i = 0; i < g_num_fixed_bufs; ++i) {
+        const uint8_t* base = g_fixed_bufs[i].iov_base;
+        if (base <= (const uint8_t*)ptr && (const uint8_t*)ptr + len <= base + g_fixed_bufs[i].iov_len) {
+            return i;
         }
+    }
+
+    return -1;
+}
 
-        fprintf(stdout, "Handling request type %d\n", bio->type);
+static void reap_uring_queue(struct virtio_blk* vblk, struct uring_queue* q);
 
-        if (error) {
-            fprintf(stderr, "Could not dequeue vblk request: %d\n", error);
-            return error;
+static struct io_uring_sqe* get_uring_sqe(struct virtio_blk* vblk, struct uring_queue* q)
+{
+    /* Don't let in-flight requests outgrow the completion queue */
+    while (q->inflight >= q->ring.params.cq_entries) {
+        int res = uring_submit_and_wait(&q->ring, 1);
+        if (res < 0 && res != -EINTR) {
+            DIE("io_uring wait failed: %d", res);
+        }
+
+        reap_uring_queue(vblk, q);
+    }
+
+    struct io_uring_sqe* sqe = uring_get_sqe(&q->ring);
+    if (!sqe) {
+        int res = uring_submit(&q->ring);
+        if (res < 0) {
+            DIE("io_uring submit failed: %d", res);
+        }
+
+        sqe = uring_get_sqe(&q->ring);
+        if (!sqe) {
+            DIE("io_uring submission queue is stuck");
+        }
+    }
+
+    return sqe;
+}
+
+static void queue_uring_rw(struct virtio_blk* vblk, struct uring_queue* q, struct blk_io_request* bio, bool direct)
+{
+    struct io_uring_sqe* sqe = get_uring_sqe(vblk, q);
+    sqe->fd = (direct ? g_direct_fd : g_fd);
+    sqe->off = bio->sector << VIRTIO_BLK_SECTOR_SHIFT;
+
+    /* Fixed buffer ops take a single buffer, so only single-segment requests can use them */
+    int buf_index = (bio->nvecs == 1 ? find_fixed_buf(bio->vecs[0].ptr, bio->vecs[0].len) : -1);
+    if (buf_index >= 0) {
+        sqe->opcode = (bio->type == BLK_IO_READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED);
+        sqe->addr = (uintptr_t)bio->vecs[0].ptr;
+        sqe->len = bio->vecs[0].len;
+        sqe->buf_index = buf_index;
+    } else {
+        sqe->opcode = (bio->type == BLK_IO_READ ? IORING_OP_READV : IORING_OP_WRITEV);
+        sqe->addr = (uintptr_t)bio->vecs;
+        sqe->len = bio->nvecs;
+    }
+
+    sqe->user_data = (uintptr_t)bio | (direct ? URING_REQ_DIRECT : 0);
+
+    if (bio->type == BLK_IO_WRITE && !g_writeback) {
+        sqe->rw_flags = RWF_DSYNC;
+    }
+
+    q->inflight++;
+}
+
+/* Queue whatever is left of a short read or write, remaining vectors start done bytes into the bio */
+static void queue_uring_rest(struct virtio_blk* vblk, struct uring_queue* q, struct uring_rest* rest, bool direct)
+{
+    const struct blk_io_request* bio = rest->bio;
+    uint64_t skip = rest->done;
+    uint32_t nvecs = 0;
+
+    for (uint32_t i = 0; i < bio->nvecs; ++i) {
+        if (skip >= bio->vecs[i].len) {
+            skip -= bio->vecs[i].len;
+            continue;
+        }
+
+        rest->vecs[nvecs++] = (struct iovec) { (uint8_t*)bio->vecs[i].ptr + skip, bio->vecs[i].len - skip };
+        skip = 0;
+    }
+
+    struct io_uring_sqe* sqe = get_uring_sqe(vblk, q);
+    sqe->opcode = (bio->type == BLK_IO_READ ? IORING_OP_READV : IORING_OP_WRITEV);
+    sqe->fd = (direct ? g_direct_fd : g_fd);
+    sqe->off = (bio->sector << VIRTIO_BLK_SECTOR_SHIFT) + rest->done;
+    sqe->addr = (uintptr_t)rest->vecs;
+    sqe->len = nvecs;
+    sqe->user_data = (uintptr_t)rest | URING_REQ_REST | (direct ? URING_REQ_DIRECT : 0);
+
+    if (bio->type == BLK_IO_WRITE && !g_writeback) {
+        sqe->rw_flags = RWF_DSYNC;
+    }
+
+    q->inflight++;
+}
+
+static void queue_uring_flush(struct virtio_blk* vblk, struct uring_queue* q, struct blk_io_request* bio)
+{
+    struct io_uring_sqe* sqe = get_uring_sqe(vblk, q);
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = g_fd;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe->user_data = (uintptr_t)bio;
+
+    q->inflight++;
+}
+
+static void reap_uring_queue(struct virtio_blk* vblk, struct uring_queue* q)
+{
+    struct io_uring_cqe* cqe;
+    while ((cqe = uring_peek_cqe(&q->ring)) != NULL) {
+        void* ptr = (void*)(uintptr_t)(cqe->user_data & ~URING_REQ_FLAGS);
+        struct uring_rest* rest = (cqe->user_data & URING_REQ_REST ? ptr : NULL);
+        struct blk_io_request* bio = (rest ? rest->bio : ptr);
+        bool direct = (cqe->user_data & URING_REQ_DIRECT) != 0;
+        int res = cqe->res;
+
+        uring_cqe_seen(&q->ring);
+        q->inflight--;
+
+        /* Filesystem wants a stricter alignment than we guessed, go through page cache */
+        if (res == -EINVAL && direct) {
+            if (rest) {
+                queue_uring_rest(vblk, q, rest, false);
+            } else {
+                queue_uring_rw(vblk, q, bio, false);
+            }
+            continue;
+        }
+
+        if (bio->type == BLK_IO_FLUSH) {
+            if (res < 0) {
+                fprintf(stderr, "Flush failed: %d\n", res);
+            }
+
+            virtio_blk_post_completion(vblk, bio, (res < 0 ? BLK_IOERROR : BLK_SUCCESS));
+            continue;
+        }
+
+        /* Short transfers are legal, resubmit the rest until the kernel makes no progress */
+        uint64_t expected = (uint64_t)bio->total_sectors << VIRTIO_BLK_SECTOR_SHIFT;
+        uint64_t done = (rest ? rest->done : 0) + (res > 0 ? (uint64_t)res : 0);
+        if (res > 0 && done < expected) {
+            if (!rest) {
+                rest = malloc(sizeof(*rest) + sizeof(struct iovec) * bio->nvecs);
+                if (!rest) {
+                    DIE("Could not allocate short transfer remainder");
+                }
+
+                rest->bio = bio;
+            }
+
+            rest->done = done;
+            queue_uring_rest(vblk, q, rest, direct && done % SERVER_DIRECT_IO_ALIGN == 0);
+            continue;
         }
 
-        if (bio->type == BLK_IO_GET_ID) {
-            snprintf(bio->vecs[0].ptr, bio->vecs[0].len, "vhost-blk-0");
-            goto complete;
+        free(rest);
+
+        if (res <= 0) {
+            fprintf(stderr, "Read/write failed at sector %lu after %lu bytes: %d\n", bio->sector, done, res);
+            virtio_blk_post_completion(vblk, bio, BLK_IOERROR);
+        } else {
+            virtio_blk_post_completion(vblk, bio, BLK_SUCCESS);
         }
+    }
+}
+
+static int uring_submit_bio(struct virtio_blk* vblk, struct virtqueue* vq, struct blk_io_request* bio)
+{
+    /* Driver only flushes after the writes it cares about have completed, no need to drain the ring */
+    if (bio->type == BLK_IO_FLUSH) {
+        queue_uring_flush(vblk, get_uring_queue(vq), bio);
+        return 0;
+    }
+
+    if (bio->type != BLK_IO_READ && bio->type != BLK_IO_WRITE) {
+        virtio_blk_post_completion(vblk, bio, handle_request(vblk, bio));
+        return 0;
+    }
 
-        /*
-         * All IO error are reported to guest and not vhost implementation
-         */
+    queue_uring_rw(vblk, get_uring_queue(vq), bio, can_use_direct_io(bio));
+    return 0;
+}
+
+static void uring_poll(struct virtio_blk* vblk, struct virtqueue* vq)
+{
+    struct uring_queue* q = get_uring_queue(vq);
+
+    /* Reaping may queue the rest of short transfers or buffered retries, submit those too */
+    do {
+        int res = uring_submit(&q->ring);
+        if (res < 0 && res != -EBUSY && res != -EAGAIN) {
+            DIE("io_uring submit failed: %d", res);
+        }
+
+        reap_uring_queue(vblk, q);
+    } while (q->ring.sqe_tail != *q->ring.sq_tail);
+}
 
-        error = handle_rw(vblk, bio);
+/*
+ * Called with vrings locked, so queue threads are not submitting while we swap the buffers.
+ * In-flight requests keep their old buffers referenced in the kernel until they complete.
+ */
+static void uring_set_memory_map(struct virtio_blk* vblk, const struct virtio_memory_map* map)
+{
+    if (!g_use_fixed_bufs) {
+        return;
+    }
+
+    for (int i = 0; g_num_fixed_bufs && i < g_num_uring_queues; ++i) {
+        uring_register(&g_uring_queues[i].ring, IORING_UNREGISTER_BUFFERS, NULL, 0);
+    }
+
+    g_num_fixed_bufs = 0;
+
+    for (uint32_t i = 0; i < map->num_regions; ++i) {
+        const struct virtio_memory_region* region = &map->regions[i];
+        for (uint64_t offset = 0; offset < region->len; offset += SERVER_FIXED_BUF_MAX_SIZE) {
+            if (g_num_fixed_bufs == SERVER_MAX_FIXED_BUFS) {
+                fprintf(stderr, "Too many guest memory regions for fixed buffers\n");
+                g_num_fixed_bufs = 0;
+                return;
+            }
+
+            g_fixed_bufs[g_num_fixed_bufs++] = (struct iovec) {
+                (uint8_t*)region->hva + offset,
+                (region->len - offset < SERVER_FIXED_BUF_MAX_SIZE ? region->len - offset : SERVER_FIXED_BUF_MAX_SIZE),
+            };
+        }
+    }
+
+    for (int i = 0; g_num_fixed_bufs && i < g_num_uring_queues; ++i) {
+        int error = uring_register(&g_uring_queues[i].ring, IORING_REGISTER_BUFFERS, g_fixed_bufs, g_num_fixed_bufs);
+        if (error < 0) {
+            fprintf(stderr, "Could not register fixed buffers, using regular reads and writes: %d\n", error);
+            while (i-- > 0) {
+                uring_register(&g_uring_queues[i].ring, IORING_UNREGISTER_BUFFERS, NULL, 0);
+            }
+            g_num_fixed_bufs = 0;
+        }
+    }
+}
+
+/*
+ * Called with vrings locked, like set_memory_map. Writes still in the rings have not reached
+ * the page cache yet, so fdatasync in set_writeback would not cover them: wait them out first.
+ */
+static int uring_set_writeback(struct virtio_blk* vblk, bool writeback)
+{
+    for (int i = 0; !writeback && i < g_num_uring_queues; ++i) {
+        struct uring_queue* q = &g_uring_queues[i];
+        while (q->inflight) {
+            int res = uring_submit_and_wait(&q->ring, 1);
+            if (res < 0 && res != -EINTR) {
+                DIE("io_uring wait failed: %d", res);
+            }
+
+            reap_uring_queue(vblk, q);
+        }
+    }
+
+    return set_writeback(vblk, writeback);
+}
+
+static const struct virtio_blk_backend_ops g_uring_backend = {
+    .submit = uring_submit_bio,
+    .poll = uring_poll,
+    .set_memory_map = uring_set_memory_map,
+    .set_writeback = uring_set_writeback,
+};
+
+static void init_uring_queues(struct vhost_dev* dev)
+{
+    g_uring_queues = calloc(dev->num_queues, sizeof(*g_uring_queues));
+    if (!g_uring_queues) {
+        DIE("Could not allocate io_uring queues");
+    }
+
+    g_num_uring_queues = dev->num_queues;
+
+    for (int i = 0; i < dev->num_queues; ++i) {
+        struct uring_queue* q = &g_uring_queues[i];
+
+        int error = uring_init(&q->ring, SERVER_URING_ENTRIES, 0);
         if (error) {
-            fprintf(stderr, "Failed handling bio %p: %d\n", bio, error);
+            DIE("Could not create io_uring instance: %d", error);
+        }
+
+        /* Completions wake up the vring to reap them */
+        error = uring_register(&q->ring, IORING_REGISTER_EVENTFD, &dev->vrings[i].wakefd, 1);
+        if (error < 0) {
+            DIE("Could not register io_uring eventfd: %d", error);
         }
+    }
+}
+
+int process_event(struct virtio_dev* vdev, struct vring* vring)
+{
+    struct virtio_blk* vblk = (struct virtio_blk*) vdev; /* TODO: add a type conversion helper in virtio */
 
-complete:
-        virtio_blk_complete_request(vblk, bio, (error ? BLK_IOERROR : BLK_SUCCESS));
+    int error = virtio_blk_process_queue(vblk, &vring->vq);
+    if (error) {
+        fprintf(stderr, "Could not process vblk requests: %d\n", error);
+        return error;
+    }
+
+    return 0;
+}
+
+static int parse_cpu_list(char* str, int* cpus, int max)
+{
+    int ncpus = 0;
+    for (char* tok = strtok(str, ","); tok; tok = strtok(NULL, ",")) {
+        if (ncpus == max) {
+            return -1;
+        }
+
+        char* end;
+        long cpu = strtol(tok, &end, 10);
+        if (*end != '\0' || cpu < 0) {
+            return -1;
+        }
+
+        cpus[ncpus++] = cpu;
+    }
+
+    return ncpus;
+}
+
+/* Returns NUMA node of the cpu or -1 if we can't tell */
+static int cpu_to_node(int cpu)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+
+    DIR* dir = opendir(path);
+    if (!dir) {
+        return -1;
+    }
+
+    int node = -1;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (sscanf(entry->d_name, "node%d", &node) == 1) {
+            break;
+        }
+    }
+
+    closedir(dir);
+    return node;
+}
+
+static int parse_mem_policy(char* str, struct vhost_mem_policy* policy, bool* use_numa)
+{
+    for (char* tok = strtok(str, ","); tok; tok = strtok(NULL, ",")) {
+        if (!strcmp(tok, "populate")) {
+            policy->flags |= VHOST_MEM_F_POPULATE;
+        } else if (!strcmp(tok, "mlock")) {
+            policy->flags |= VHOST_MEM_F_MLOCK;
+        } else if (!strcmp(tok, "numa")) {
+            *use_numa = true;
+        } else {
+            return -1;
+        }
     }
 
     return 0;
@@ -111,14 +669,99 @@ complete:
 
 int main(int argc, char** argv)
 {
-    if (argc != 3) {
+    enum evloop_backend evloop_backend = EVLOOP_BACKEND_EPOLL;
+    int worker_cpus[SERVER_MAX_WORKERS];
+    int nworkers = 0;
+    long poll_us = 0;
+    long num_queues = 1;
+    bool use_uring_backend = false;
+    struct vhost_mem_policy mem_policy = { 0, VHOST_MEM_NODE_ANY };
+    bool use_numa = false;
+    bool use_host_notifiers = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "uw:p:q:b:fm:nc:")) != -1) {
+        switch (opt) {
+        case 'u':
+            evloop_backend = EVLOOP_BACKEND_IO_URING;
+            break;
+        case 'w':
+            nworkers = parse_cpu_list(optarg, worker_cpus, SERVER_MAX_WORKERS);
+            if (nworkers <= 0) {
+                usage();
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'p': {
+            char* end;
+            poll_us = strtol(optarg, &end, 10);
+            if (*end != '\0' || poll_us < 0 || poll_us > UINT32_MAX) {
+                usage();
+                exit(EXIT_FAILURE);
+            }
+            break;
+        }
+        case 'q': {
+            char* end;
+            num_queues = strtol(optarg, &end, 10);
+            if (*end != '\0' || num_queues < 1 || num_queues > UINT8_MAX) {
+                usage();
+                exit(EXIT_FAILURE);
+            }
+            break;
+        }
+        case 'b':
+            if (!strcmp(optarg, "uring")) {
+                use_uring_backend = true;
+            } else if (strcmp(optarg, "sync")) {
+                usage();
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'f':
+            g_use_fixed_bufs = true;
+            break;
+        case 'm':
+            if (parse_mem_policy(optarg, &mem_policy, &use_numa) != 0) {
+                usage();
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'n':
+            use_host_notifiers = true;
+            break;
+        case 'c':
+            if (!strcmp(optarg, "writeback")) {
+                g_writeback = true;
+            } else if (strcmp(optarg, "writethrough")) {
+                usage();
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default:
+            usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (argc - optind != 2) {
         usage();
         exit(EXIT_FAILURE);
     }
 
+    /* Unpinned main thread can run anywhere, only a worker cpu tells which node vrings live on */
+    if (use_numa && !nworkers) {
+        DIE("NUMA memory policy needs vring workers (-w)");
+    }
+
+    /* Doorbells are busy polled, which only workers can afford */
+    if (use_host_notifiers && !nworkers) {
+        DIE("Host notifiers need vring workers (-w)");
+    }
+
     int error = 0;
-    const char* socket_path = argv[1];
-    const char* disk_image = argv[2];
+    const char* socket_path = argv[optind];
+    const char* disk_image = argv[optind + 1];
 
     error = access(socket_path, F_OK);
     if (!error) {
@@ -137,11 +780,19 @@ int main(int argc, char** argv)
         ro = true;
     }
 
-    g_fd = open(disk_image, O_SYNC | (ro ? O_RDONLY : O_RDWR));
+    /* Writethrough mode syncs each write instead of opening with O_SYNC, so guest can switch modes */
+    g_fd = open(disk_image, (ro ? O_RDONLY : O_RDWR));
     if (g_fd < 0) {
         DIE("Could not open disk image file %s", disk_image);
     }
 
+    if (use_uring_backend) {
+        g_direct_fd = open(disk_image, O_DIRECT | (ro ? O_RDONLY : O_RDWR));
+        if (g_direct_fd < 0) {
+            fprintf(stdout, "Disk image %s does not support O_DIRECT, using page cache\n", disk_image);
+        }
+    }
+
     struct stat st;
     error = fstat(g_fd, &st);
     if (error) {
@@ -156,21 +807,92 @@ int main(int argc, char** argv)
     fprintf(stdout, "Using disk image %s, %u blocks\n", disk_image, blocks);
 
     struct virtio_blk vblk;
+    memset(&vblk, 0, sizeof(vblk));
     vblk.total_sectors = blocks;
     vblk.block_size = VIRTIO_BLK_SECTOR_SIZE;
+
+    /* Steer guest io to whole filesystem blocks, partial block writes cost a read-modify-write in page cache */
+    uint32_t fs_blocks = st.st_blksize / vblk.block_size;
+    if (fs_blocks > 1 && (fs_blocks & (fs_blocks - 1)) == 0 && fs_blocks <= UINT16_MAX) {
+        vblk.physical_block_exp = __builtin_ctz(fs_blocks);
+        vblk.min_io_size = fs_blocks;
+    }
+
     vblk.readonly = ro;
-    vblk.writeback = false;
+    vblk.writeback = g_writeback;
+    vblk.max_discard_sectors = SERVER_MAX_DISCARD_SECTORS;
+    vblk.max_discard_segs = SERVER_MAX_DISCARD_SEGS;
+    vblk.discard_sector_alignment = vblk.block_size >> VIRTIO_BLK_SECTOR_SHIFT;
+    vblk.max_write_zeroes_sectors = SERVER_MAX_DISCARD_SECTORS;
+    vblk.max_write_zeroes_segs = SERVER_MAX_DISCARD_SEGS;
+    vblk.write_zeroes_may_unmap = true;
+    vblk.num_queues = num_queues;
+    vblk.backend = (use_uring_backend ? &g_uring_backend : &g_sync_backend);
     error = virtio_blk_init(&vblk);
     if (error) {
         DIE("Failed to initialize virtio-blk device: %d", error);
     }
 
+    error = vhost_set_evloop_backend(evloop_backend);
+    if (error) {
+        DIE("Failed to select event loop backend: %d", error);
+    }
+
     struct vhost_dev dev;
-    error = vhost_register_device_server(&dev, socket_path, 1, &vblk.vdev, process_event);
+    error = vhost_register_device_server(&dev, socket_path, num_queues, &vblk.vdev, process_event);
     if (error) {
         DIE("Failed to register device server: %d", error);
     }
 
+    if (use_uring_backend) {
+        init_uring_queues(&dev);
+    }
+
+    /* Guest memory is best placed next to whoever services the vrings */
+    if (use_numa) {
+        int cpu = worker_cpus[0];
+        mem_policy.numa_node = cpu_to_node(cpu);
+        if (mem_policy.numa_node < 0) {
+            fprintf(stderr, "Could not find NUMA node of cpu %d, not binding guest memory\n", cpu);
+            mem_policy.numa_node = VHOST_MEM_NODE_ANY;
+        }
+    }
+
+    error = vhost_set_mem_policy(&dev, &mem_policy);
+    if (error) {
+        DIE("Failed to set memory policy: %d", error);
+    }
+
+    /* Spread vrings between workers, protocol messages stay on the main thread */
+    struct vhost_worker* workers[SERVER_MAX_WORKERS];
+    for (int i = 0; i < nworkers; ++i) {
+        workers[i] = vhost_worker_create(worker_cpus[i], evloop_backend);
+        if (!workers[i]) {
+            DIE("Failed to start worker on cpu %d", worker_cpus[i]);
+        }
+    }
+
+    for (int i = 0; nworkers && i < dev.num_queues; ++i) {
+        error = vhost_set_vring_evloop(&dev, i, vhost_worker_evloop(workers[i % nworkers]));
+        if (error) {
+            DIE("Failed to assign vring %d to a worker: %d", i, error);
+        }
+    }
+
+    for (int i = 0; poll_us && i < dev.num_queues; ++i) {
+        error = vhost_set_vring_polling(&dev, i, poll_us);
+        if (error) {
+            DIE("Failed to enable polling on vring %d: %d", i, error);
+        }
+    }
+
+    for (int i = 0; use_host_notifiers && i < dev.num_queues; ++i) {
+        error = vhost_set_vring_host_notifier(&dev, i, true);
+        if (error) {
+            DIE("Failed to enable host notifier on vring %d: %d", i, error);
+        }
+    }
+
     while (1) {
         error = vhost_run();
         if (error) {
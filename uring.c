@@ -0,0 +1,190 @@
+/**
+ * Minimal io_uring wrapper over raw syscalls.
+ * We only need a handful of operations and don't want to depend on liburing.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "platform.h"
+#include "uring.h"
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void* arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void* map_ring(int fd, size_t size, off_t offset)
+{
+    void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+int uring_init(struct uring* ring, unsigned entries, unsigned flags)
+{
+    VHOST_VERIFY(ring);
+
+    memset(ring, 0, sizeof(*ring));
+    ring->params.flags = flags;
+
+    ring->fd = sys_io_uring_setup(entries, &ring->params);
+    if (ring->fd < 0) {
+        return -errno;
+    }
+
+    struct io_uring_params* p = &ring->params;
+    ring->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+
+    /* Kernels with IORING_FEAT_SINGLE_MMAP share a single mapping for both rings */
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_ring_size = VHOST_MAX(ring->sq_ring_size, ring->cq_ring_size);
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = map_ring(ring->fd, ring->sq_ring_size, IORING_OFF_SQ_RING);
+    if (!ring->sq_ring) {
+        goto error_out;
+    }
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = map_ring(ring->fd, ring->cq_ring_size, IORING_OFF_CQ_RING);
+        if (!ring->cq_ring) {
+            goto error_out;
+        }
+    }
+
+    ring->sqes = map_ring(ring->fd, ring->sqes_size, IORING_OFF_SQES);
+    if (!ring->sqes) {
+        goto error_out;
+    }
+
+    uint8_t* sq = ring->sq_ring;
+    ring->sq_head = (unsigned*)(sq + p->sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + p->sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + p->sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + p->sq_off.array);
+    ring->sqe_tail = *ring->sq_tail;
+
+    uint8_t* cq = ring->cq_ring;
+    ring->cq_head = (unsigned*)(cq + p->cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + p->cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + p->cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + p->cq_off.cqes);
+
+    /* We always fill sqes in order, so sq index array is an identity mapping */
+    for (unsigned i = 0; i < p->sq_entries; ++i) {
+        ring->sq_array[i] = i;
+    }
+
+    return 0;
+
+error_out:
+    uring_free(ring);
+    return -ENOMEM;
+}
+
+void uring_free(struct uring* ring)
+{
+    if (!ring) {
+        return;
+    }
+
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+
+    if (ring->sq_ring) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+struct io_uring_sqe* uring_get_sqe(struct uring* ring)
+{
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= ring->params.sq_entries) {
+        return NULL;
+    }
+
+    struct io_uring_sqe* sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+    ring->sqe_tail++;
+
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+unsigned uring_flush_sq(struct uring* ring)
+{
+    /* Make filled sqes visible to the kernel */
+    unsigned tail = *ring->sq_tail;
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    return ring->sqe_tail - tail;
+}
+
+int uring_enter(struct uring* ring, unsigned to_submit, unsigned wait_nr)
+{
+    if (!to_submit && !wait_nr) {
+        return 0;
+    }
+
+    int res = sys_io_uring_enter(ring->fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    if (res < 0) {
+        return -errno;
+    }
+
+    return res;
+}
+
+int uring_submit_and_wait(struct uring* ring, unsigned wait_nr)
+{
+    return uring_enter(ring, uring_flush_sq(ring), wait_nr);
+}
+
+struct io_uring_cqe* uring_peek_cqe(struct uring* ring)
+{
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring* ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_register(struct uring* ring, unsigned opcode, const void* arg, unsigned nr_args)
+{
+    int res = sys_io_uring_register(ring->fd, opcode, arg, nr_args);
+    return res < 0 ? -errno : res;
+}
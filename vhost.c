@@ -16,6 +16,13 @@
 #include <sys/un.h>
 #include <sys/mman.h>
 #include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+#include <linux/magic.h>
+#include <linux/mempolicy.h>
 
 #include "platform.h"
 #include "vhost.h"
@@ -25,15 +32,24 @@
 
 #define VHOST_SUPPORTED_FEATURES (\
     (1ull << VHOST_USER_F_PROTOCOL_FEATURES) | \
+    (1ull << VHOST_F_LOG_ALL) | \
     (1ull << VIRTIO_F_INDIRECT_DESC) | \
     (1ull << VIRTIO_F_EVENT_IDX) | \
-    (1ull << VIRTIO_F_VERSION_1))
+    (1ull << VIRTIO_F_VERSION_1) | \
+    (1ull << VIRTIO_F_RING_PACKED))
 
 #define VHOST_SUPPORTED_PROTOCOL_FEATURES (\
     (1ull << VHOST_USER_PROTOCOL_F_MQ) | \
+    (1ull << VHOST_USER_PROTOCOL_F_LOG_SHMFD) | \
     (1ull << VHOST_USER_PROTOCOL_F_REPLY_ACK) | \
+    (1ull << VHOST_USER_PROTOCOL_F_SLAVE_REQ) | \
     (1ull << VHOST_USER_PROTOCOL_F_CONFIG) | \
+    (1ull << VHOST_USER_PROTOCOL_F_SLAVE_SEND_FD) | \
+    (1ull << VHOST_USER_PROTOCOL_F_HOST_NOTIFIER) | \
+    (1ull << VHOST_USER_PROTOCOL_F_INBAND_NOTIFICATIONS) | \
+    (1ull << VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD) | \
     (1ull << VHOST_USER_PROTOCOL_F_RESET_DEVICE) | \
+    (1ull << VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS) | \
     0)
 
 static inline bool has_feature(uint64_t features, int fbit)
@@ -41,12 +57,20 @@ static inline bool has_feature(uint64_t features, int fbit)
     return (features & (1ull << fbit)) != 0;
 }
 
+static inline bool has_inband_notifications(const struct vhost_dev* dev)
+{
+    return has_feature(dev->negotiated_protocol_features, VHOST_USER_PROTOCOL_F_INBAND_NOTIFICATIONS);
+}
+
 /* Global device list */
 LIST_HEAD(, vhost_dev) g_vhost_dev_list;
 
 /* Vhost global event loop. */
 struct event_loop* g_vhost_evloop;
 
+/* Map of devices without guest memory, shared and never freed (zero-initialized map is empty) */
+static struct virtio_memory_map g_empty_memory_map;
+
 /*
  * Vhost global event loop.
  * We have separate event loops for vhost protocols event and actual device queue events.
@@ -55,10 +79,34 @@ struct event_loop* g_vhost_evloop;
 __attribute__((constructor))
 static void libvhost_init(void)
 {
-    g_vhost_evloop = evloop_create();
+    g_vhost_evloop = evloop_create(EVLOOP_BACKEND_EPOLL);
     VHOST_VERIFY(g_vhost_evloop);
 }
 
+int vhost_set_evloop_backend(enum evloop_backend backend)
+{
+    /* Registered fds live in the current loop, so we can only switch before anything is registered */
+    if (!LIST_EMPTY(&g_vhost_dev_list)) {
+        return -EBUSY;
+    }
+
+    struct event_loop* evloop = evloop_create(backend);
+    if (!evloop) {
+        return -ENOTSUP;
+    }
+
+    evloop_free(g_vhost_evloop);
+    g_vhost_evloop = evloop;
+    return 0;
+}
+
+static void lock_vrings(struct vhost_dev* dev);
+static void unlock_vrings(struct vhost_dev* dev);
+static void handle_vring_poll(struct evloop_poller* poller);
+static void handle_vring_wake(struct event_cb* cb, int fd, uint32_t events);
+static void handle_vring_doorbell(struct evloop_poller* poller);
+static void vring_del_kickfd(struct vring* vring);
+
 static void vhost_evloop_add_fd(int fd, struct event_cb* cb)
 {
     evloop_add_fd(g_vhost_evloop, fd, cb);
@@ -115,6 +163,7 @@ static void on_read_avail(struct vhost_dev* dev)
     int res = 0;
     struct vhost_user_message msg;
     int fds[VHOST_USER_MAX_FDS];
+    size_t nfds = 0;
 
     union {
         char buf[CMSG_SPACE(sizeof(fds))];
@@ -163,12 +212,18 @@ static void on_read_avail(struct vhost_dev* dev)
          * since we can't actually know from the cmsg header itself how much there is (portably).
          */
         memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+        nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
     }
 
     /*
      * Recv message body if any
      */
 
+    if (msg.hdr.size > sizeof(msg) - sizeof(msg.hdr)) {
+        vhost_reset_dev(dev);
+        return;
+    }
+
     if (msg.hdr.size) {
         res = recv(dev->connfd, (char*)&msg + sizeof(msg.hdr), msg.hdr.size, MSG_WAITALL);
         if (res != msg.hdr.size) {
@@ -177,17 +232,12 @@ static void on_read_avail(struct vhost_dev* dev)
         }
     }
 
-    handle_message(dev, &msg, fds, VHOST_USER_MAX_FDS);
+    handle_message(dev, &msg, fds, nfds);
 }
 
-static void send_reply(struct vhost_dev* dev, struct vhost_user_message* msg)
+/* Message can pass a single fd, -1 if there is none */
+static int send_message(int sockfd, struct vhost_user_message* msg, int fd)
 {
-    VHOST_VERIFY(dev);
-    VHOST_VERIFY(msg);
-    VHOST_VERIFY(dev->connfd >= 0);
-
-    msg->hdr.flags = 0x1 | (1ul << VHOST_USER_MESSAGE_F_REPLY); /* Set reply flag */
-
     struct iovec iov[1];
     iov[0].iov_base = (void*) msg;
     iov[0].iov_len = sizeof(msg->hdr) + msg->hdr.size;
@@ -196,13 +246,49 @@ static void send_reply(struct vhost_dev* dev, struct vhost_user_message* msg)
     msghdr.msg_iov = iov;
     msghdr.msg_iovlen = sizeof(iov) / sizeof(*iov);
 
-    ssize_t res = sendmsg(dev->connfd, &msghdr, 0);
+    char control[CMSG_SPACE(sizeof(fd))];
+    if (fd != -1) {
+        memset(control, 0, sizeof(control));
+        msghdr.msg_control = control;
+        msghdr.msg_controllen = sizeof(control);
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msghdr);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fd));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+    }
+
+    ssize_t res = sendmsg(sockfd, &msghdr, 0);
     if (res < 0) {
+        return -errno;
+    }
+
+    return 0;
+}
+
+static void send_reply(struct vhost_dev* dev, struct vhost_user_message* msg, int fd)
+{
+    VHOST_VERIFY(dev);
+    VHOST_VERIFY(msg);
+    VHOST_VERIFY(dev->connfd >= 0);
+
+    msg->hdr.flags = 0x1 | (1ul << VHOST_USER_MESSAGE_F_REPLY); /* Set reply flag */
+
+    if (send_message(dev->connfd, msg, fd) != 0) {
         vhost_reset_dev(dev);
-        return;
     }
 }
 
+/* We never ask master to reply, so this does not wait for it */
+static int send_slave_request(struct vhost_dev* dev, struct vhost_user_message* msg, int fd)
+{
+    VHOST_VERIFY(dev->slave_fd >= 0);
+
+    msg->hdr.flags = 0x1;
+    return send_message(dev->slave_fd, msg, fd);
+}
+
 static void handle_server_event(struct event_cb* cb, int fd, uint32_t events)
 {
     struct vhost_dev* dev = cb->ptr;
@@ -231,6 +317,17 @@ static void handle_server_event(struct event_cb* cb, int fd, uint32_t events)
     }
 }
 
+static void handle_reset_event(struct event_cb* cb, int fd, uint32_t events)
+{
+    struct vhost_dev* dev = cb->ptr;
+    VHOST_VERIFY(dev);
+
+    /* Several vrings could have asked for a reset, only the first one finds us connected */
+    if (dev->connfd >= 0) {
+        vhost_reset_dev(dev);
+    }
+}
+
 static int create_listen_socket(const char* path)
 {
     int error = 0;
@@ -278,28 +375,64 @@ int vhost_register_device_server(struct vhost_dev* dev,
     VHOST_VERIFY(vring_cb);
 
     memset(dev, 0, sizeof(*dev));
+    dev->memory_map = &g_empty_memory_map;
+    dev->inflight_fd = -1;
+    dev->slave_fd = -1;
+    dev->notify_fd = -1;
+    dev->mem_policy = (struct vhost_mem_policy){ 0, VHOST_MEM_NODE_ANY };
 
     dev->listenfd = create_listen_socket(socket_path);
     if (dev->listenfd < 0) {
         return -1;
     }
 
-    dev->connfd = -1;
-    dev->server_cb = (struct event_cb){ EPOLLIN | EPOLLHUP, dev, handle_server_event };
-    vhost_evloop_add_fd(dev->listenfd, &dev->server_cb);
+    dev->resetfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (dev->resetfd < 0) {
+        goto close_listenfd;
+    }
 
     dev->num_queues = num_queues;
     dev->vrings = vhost_calloc(num_queues, sizeof(*dev->vrings));
     for (uint8_t i = 0; i < num_queues; ++i) {
-        dev->vrings[i].dev = dev;
-        vring_reset(dev->vrings + i);
+        struct vring* vring = dev->vrings + i;
+        vring->dev = dev;
+        vring->kickfd = -1;
+        vring->callfd = -1;
+        vring->errfd = -1;
+        vring->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (vring->wakefd < 0) {
+            while (i-- > 0) {
+                close(dev->vrings[i].wakefd);
+            }
+            goto free_vrings;
+        }
+
+        vring->wake_cb = (struct event_cb){ EPOLLIN | EVLOOP_F_EVENTFD, vring, handle_vring_wake };
+        vring->evloop = g_vhost_evloop;
+        vring->poller = (struct evloop_poller){ vring, handle_vring_poll };
+        vring->doorbell_poller = (struct evloop_poller){ vring, handle_vring_doorbell };
+        vring_reset(vring);
     }
 
+    dev->connfd = -1;
+    dev->server_cb = (struct event_cb){ EPOLLIN | EPOLLHUP, dev, handle_server_event };
+    vhost_evloop_add_fd(dev->listenfd, &dev->server_cb);
+
+    dev->reset_cb = (struct event_cb){ EPOLLIN | EVLOOP_F_EVENTFD, dev, handle_reset_event };
+    vhost_evloop_add_fd(dev->resetfd, &dev->reset_cb);
+
     dev->vdev = vdev;
     dev->vring_cb = vring_cb;
 
     LIST_INSERT_HEAD(&g_vhost_dev_list, dev, link);
     return 0;
+
+free_vrings:
+    vhost_free(dev->vrings);
+    close(dev->resetfd);
+close_listenfd:
+    close(dev->listenfd);
+    return -1;
 }
 
 /*
@@ -312,18 +445,139 @@ static void vring_close_fd(struct vring* vring, int* fd)
         return;
     }
 
-    if (*fd == vring->kickfd) {
+    /* Only enabled vrings have their kickfd registered */
+    if (*fd == vring->kickfd && vring->is_enabled) {
+        vring_del_kickfd(vring);
+    }
+
+    if (*fd == vring->callfd && vring->has_inband_call) {
         vhost_evloop_del_fd(*fd);
+        vring->has_inband_call = false;
+        vring->has_pending_inband_call = false;
     }
 
     close(*fd);
     *fd = -1;
 }
 
+/* Device state belongs to the global loop, vrings running on workers can only request a reset */
+static void vring_fail(struct vring* vring)
+{
+    if (vring->evloop == g_vhost_evloop) {
+        vhost_reset_dev(vring->dev);
+    } else {
+        eventfd_write(vring->dev->resetfd, 1);
+    }
+}
+
+/*
+ * Vring polling
+ */
+
+/* Polling window never gets smaller than this */
+#define VRING_POLL_MIN_WINDOW_NS 2000ull
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void vring_stop_polling(struct vring* vring)
+{
+    if (!vring->poller.is_active) {
+        return;
+    }
+
+    evloop_del_poller(vring->evloop, &vring->poller);
+
+    /*
+     * Buffers kept arriving while we polled - next time poll for longer,
+     * otherwise we wasted the whole window and should poll less.
+     */
+    if (vring->poll_hits) {
+        vring->poll_window_ns = VHOST_MIN(vring->poll_window_ns * 2, vring->poll_max_ns);
+    } else {
+        vring->poll_window_ns = VHOST_MAX(vring->poll_window_ns / 2, VRING_POLL_MIN_WINDOW_NS);
+    }
+}
+
+static void vring_start_polling(struct vring* vring)
+{
+    if (!vring->poll_max_ns || vring->poller.is_active) {
+        return;
+    }
+
+    virtqueue_disable_notifications(&vring->vq);
+
+    vring->poll_hits = 0;
+    vring->poll_deadline_ns = now_ns() + vring->poll_window_ns;
+    evloop_add_poller(vring->evloop, &vring->poller);
+}
+
+static void handle_vring_poll(struct evloop_poller* poller)
+{
+    struct vring* vring = poller->ptr;
+    struct vhost_dev* dev = vring->dev;
+
+    VHOST_VERIFY(vring);
+    VHOST_VERIFY(vring->is_started);
+
+    if (!virtqueue_has_avail(&vring->vq)) {
+        if (now_ns() < vring->poll_deadline_ns) {
+            return;
+        }
+
+        /* Window expired, go back to kicks unless driver raced with us */
+        if (!virtqueue_enable_notifications(&vring->vq)) {
+            vring_stop_polling(vring);
+            return;
+        }
+
+        virtqueue_disable_notifications(&vring->vq);
+    }
+
+    vring->poll_hits++;
+    vring->poll_deadline_ns = now_ns() + vring->poll_window_ns;
+
+    int error = dev->vring_cb(dev->vdev, vring);
+    if (error) {
+        vring_stop_polling(vring);
+        vring_fail(vring);
+    }
+}
+
+/* Guest kick, either from kickfd or from host notifier doorbell */
+static void handle_vring_kick(struct vring* vring)
+{
+    struct vhost_dev* dev = vring->dev;
+    int error = 0;
+
+    /*
+     * According to the spec vrings are started when they receive a first kick.
+     * Kicks that came in before the vring was enabled are merged with it, so don't leave
+     * buffers driver has already made available waiting for the next one.
+     */
+    if (!vring->is_started) {
+        error = vring_start(vring);
+    }
+
+    if (!error) {
+        error = dev->vring_cb(dev->vdev, vring);
+        if (!error) {
+            vring_start_polling(vring);
+        }
+    }
+
+    if (error) {
+        vring_fail(vring);
+    }
+}
+
 static void handle_vring_event(struct event_cb* cb, int fd, uint32_t events)
 {
     struct vring* vring = cb->ptr;
-    struct vhost_dev* dev = vring->dev;
 
     VHOST_VERIFY(vring);
     VHOST_VERIFY((events & ~(uint32_t)(EPOLLIN | EPOLLHUP | EPOLLERR)) == 0);
@@ -333,33 +587,102 @@ static void handle_vring_event(struct event_cb* cb, int fd, uint32_t events)
         vring_close_fd(vring, &vring->kickfd);
     } else {
         if (events & EPOLLIN) {
-            int error = 0;
-
-            /* Consume the input event */
-            eventfd_t unused;
-            error = eventfd_read(fd, &unused);
-            if (error) {
-                VHOST_LOG_DEBUG("eventfd_read(%d) failed", fd);
-                goto reset_dev;
-            }
+            /* Event loop has already consumed the kick for us (see EVLOOP_F_EVENTFD) */
+            handle_vring_kick(vring);
+        }
+    }
+}
 
-            /* According to the spec vrings are started when they receive a first kick */
-            if (!vring->is_started) {
-                error = vring_start(vring);
-            } else {
-                error = dev->vring_cb(dev->vdev, vring);
-            }
+/* Doorbell value while guest has not written to it since we last looked, guest writes a queue index */
+#define VRING_DOORBELL_IDLE 0xFFFF
 
-            if (error) {
-                goto reset_dev;
-            }
-        }
+static void handle_vring_doorbell(struct evloop_poller* poller)
+{
+    struct vring* vring = poller->ptr;
+    VHOST_VERIFY(vring);
+
+    /* Don't dirty the doorbell cache line unless guest has rung it */
+    if (__atomic_load_n(vring->doorbell, __ATOMIC_RELAXED) == VRING_DOORBELL_IDLE) {
+        return;
     }
 
-    return;
+    /* Exchange is a full barrier, we won't miss buffers made available before the next ring */
+    __atomic_exchange_n(vring->doorbell, VRING_DOORBELL_IDLE, __ATOMIC_SEQ_CST);
+    handle_vring_kick(vring);
+}
 
-reset_dev:
-    vhost_reset_dev(dev);
+static void handle_vring_wake(struct event_cb* cb, int fd, uint32_t events)
+{
+    struct vring* vring = cb->ptr;
+    struct vhost_dev* dev = vring->dev;
+
+    VHOST_VERIFY(vring);
+
+    /* Wakeup could have been posted just before the vring was stopped */
+    if (!vring->is_started) {
+        return;
+    }
+
+    /* Disabled vrings still return what the backend completes, but don't take new requests */
+    if (!vring->is_enabled) {
+        virtio_dev_reap_queue(dev->vdev, &vring->vq);
+        return;
+    }
+
+    int error = dev->vring_cb(dev->vdev, vring);
+    if (error) {
+        vring_fail(vring);
+    }
+}
+
+static void vring_add_kickfd(struct vring* vring)
+{
+    vring->kick_cb = (struct event_cb){ EPOLLIN | EPOLLHUP | EVLOOP_F_EVENTFD, vring, handle_vring_event };
+    evloop_add_fd(vring->evloop, vring->kickfd, &vring->kick_cb);
+
+    if (vring->doorbell) {
+        evloop_add_poller(vring->evloop, &vring->doorbell_poller);
+    }
+}
+
+static void vring_del_kickfd(struct vring* vring)
+{
+    evloop_del_poller(vring->evloop, &vring->doorbell_poller);
+    evloop_del_fd(vring->evloop, vring->kickfd);
+}
+
+/*
+ * Disabled vrings keep their state but are taken out of their event loop and stop polling,
+ * so they cost nothing until master enables them again.
+ */
+static void vring_set_enabled(struct vring* vring, bool enable)
+{
+    if (vring->is_enabled == enable) {
+        return;
+    }
+
+    vring->is_enabled = enable;
+    if (vring->kickfd == -1) {
+        return;
+    }
+
+    if (!enable) {
+        vring_stop_polling(vring);
+        vring_del_kickfd(vring);
+        return;
+    }
+
+    /* Pending kicks are still in the eventfd and will be seen by the loop */
+    vring_add_kickfd(vring);
+
+    /*
+     * We could have stopped polling with guest notifications disabled,
+     * ask for them again and handle what was made available without one.
+     */
+    if (vring->is_started) {
+        virtqueue_enable_notifications(&vring->vq);
+        eventfd_write(vring->wakefd, 1);
+    }
 }
 
 void vring_reset(struct vring* vring)
@@ -370,6 +693,10 @@ void vring_reset(struct vring* vring)
     vring_close_fd(vring, &vring->callfd);
     vring_close_fd(vring, &vring->errfd);
 
+    if (vring->is_started) {
+        vring_stop(vring);
+    }
+
     /**
      * Vring is enabled when:
      * - if VHOST_USER_F_PROTOCOL_FEATURES has been negotiated -> on VHOST_USER_SET_VRING_ENABLE(1)
@@ -380,6 +707,68 @@ void vring_reset(struct vring* vring)
      */
     vring->is_enabled = !vring->dev->has_protocol_features;
     vring->is_started = false;
+    vring->doorbell = NULL;
+}
+
+/* Dirty log vrings should write to, NULL if master is not logging */
+static struct virtio_dirty_log* get_dirty_log(struct vhost_dev* dev)
+{
+    return (dev->log_all && dev->log.bitmap) ? &dev->log : NULL;
+}
+
+/* Switch started vrings to the current dirty log state, vrings must be locked */
+static void update_vrings_dirty_log(struct vhost_dev* dev)
+{
+    struct virtio_dirty_log* log = get_dirty_log(dev);
+    for (uint8_t i = 0; i < dev->num_queues; ++i) {
+        if (dev->vrings[i].is_started) {
+            virtqueue_set_dirty_log(&dev->vrings[i].vq, log);
+        }
+    }
+}
+
+/* Vring part of the inflight region, NULL if region does not cover the vring */
+static struct virtq_inflight* get_vring_inflight(struct vring* vring)
+{
+    struct vhost_dev* dev = vring->dev;
+    size_t idx = vring - dev->vrings;
+
+    if (!dev->inflight_base || idx >= dev->inflight_num_queues) {
+        return NULL;
+    }
+
+    uint64_t offset = idx * virtq_inflight_size(dev->inflight_queue_size);
+    return (struct virtq_inflight*)((uint8_t*)dev->inflight_base + offset);
+}
+
+/* Attach vring to its part of the inflight region, returns number of chains to resubmit */
+static int vring_set_inflight(struct vring* vring)
+{
+    struct vhost_dev* dev = vring->dev;
+    size_t idx = vring - dev->vrings;
+
+    struct virtq_inflight* inflight = get_vring_inflight(vring);
+    if (!inflight) {
+        return 0;
+    }
+
+    /* Region is laid out for the queue size master told us about */
+    if (vring->size != dev->inflight_queue_size) {
+        VHOST_LOG_ERROR("vring %zu: size %u does not match inflight region queue size %u",
+                        idx, vring->size, dev->inflight_queue_size);
+        return 0;
+    }
+
+    int res = virtqueue_set_inflight(&vring->vq, inflight);
+    if (res == -ENOTSUP) {
+        VHOST_LOG_DEBUG("vring %zu: inflight tracking is not supported for packed layout", idx);
+    } else if (res < 0) {
+        VHOST_LOG_ERROR2(res, "vring %zu: inconsistent inflight region, not tracking inflight requests", idx);
+    } else if (res > 0) {
+        VHOST_LOG_DEBUG("vring %zu: resubmitting %d inflight requests", idx, res);
+    }
+
+    return VHOST_MAX(res, 0);
 }
 
 int vring_start(struct vring* vring)
@@ -404,13 +793,29 @@ int vring_start(struct vring* vring)
                                 vring->used_addr,
                                 vring->avail_base,
                                 vring->callfd,
-                                has_feature(vdev->features, VIRTIO_F_EVENT_IDX),
-                                &vring->dev->memory_map);
+                                vdev->features,
+                                __atomic_load_n(&vring->dev->memory_map, __ATOMIC_ACQUIRE));
+
+    if (error) {
+        return error;
+    }
+
+    virtqueue_set_dirty_log(&vring->vq, get_dirty_log(vring->dev));
+    int nresubmit = vring_set_inflight(vring);
 
+    error = virtio_dev_start_queue(vdev, &vring->vq, vring->wakefd);
     if (error) {
+        virtqueue_stop(&vring->vq);
         return error;
     }
 
+    evloop_add_fd(vring->evloop, vring->wakefd, &vring->wake_cb);
+
+    /* Requests left by the previous device instance are handled without waiting for a guest kick */
+    if (nresubmit > 0) {
+        eventfd_write(vring->wakefd, 1);
+    }
+
     vring->is_started = true;
     return 0;
 }
@@ -424,7 +829,10 @@ void vring_stop(struct vring* vring)
         return;
     }
 
-    /* There is nothing to tell the actual virtqueue for now */
+    vring_stop_polling(vring);
+    virtio_dev_stop_queue(vring->dev->vdev, &vring->vq);
+    evloop_del_fd(vring->evloop, vring->wakefd);
+    virtqueue_stop(&vring->vq);
     vring->is_started = false;
 }
 
@@ -443,6 +851,7 @@ static bool message_assumes_reply(const struct vhost_user_message* msg)
     case VHOST_USER_GET_INFLIGHT_FD:
     case VHOST_USER_GET_QUEUE_NUM:
     case VHOST_USER_GET_CONFIG:
+    case VHOST_USER_GET_MAX_MEM_SLOTS:
         return true;
     default:
         return false;
@@ -467,7 +876,8 @@ static bool must_reply_ack(const struct vhost_dev* dev, const struct vhost_user_
  * - =0 command was handled successfully and handler potentially prepared a reply in msg buffer.
  *      prepared reply will be sent to master if command assumes a reply.
  *      if command doesn't assume a reply, but master set REPLY_ACK, caller will sent a zero-value ACK.
- * - >0 we failed to handle request. caller will reply with -res if master set REPLY_ACK
+ * - >0 we failed to handle request, value is a positive errno and the connection stays up.
+ *      caller will ack with the negative errno if master set REPLY_ACK.
  * - <0 if we didn't like master's request and need to close connection immediately.
  */
 typedef int (*handler_fptr) (struct vhost_dev*, struct vhost_user_message*, int*, size_t);
@@ -487,12 +897,20 @@ static int set_features(struct vhost_dev* dev, struct vhost_user_message* msg, i
         return -1;
     }
 
-    if (has_feature(msg->u64, VHOST_USER_F_PROTOCOL_FEATURES)) {
+    /* With protocol features vrings start disabled and wait for VHOST_USER_SET_VRING_ENABLE */
+    if (has_feature(msg->u64, VHOST_USER_F_PROTOCOL_FEATURES) && !dev->has_protocol_features) {
         dev->has_protocol_features = true;
+        for (uint8_t i = 0; i < dev->num_queues; ++i) {
+            vring_set_enabled(&dev->vrings[i], false);
+        }
     }
 
+    /* Master toggles logging with features while vrings are running */
+    dev->log_all = has_feature(msg->u64, VHOST_F_LOG_ALL);
+    update_vrings_dirty_log(dev);
+
     /* Devices don't care about vhost protocol features */
-    msg->u64 &= ~(1ull << VHOST_USER_F_PROTOCOL_FEATURES);
+    msg->u64 &= ~((1ull << VHOST_USER_F_PROTOCOL_FEATURES) | (1ull << VHOST_F_LOG_ALL));
     return virtio_dev_set_features(dev->vdev, msg->u64);
 }
 
@@ -550,8 +968,8 @@ static int reset_owner(struct vhost_dev* dev, struct vhost_user_message* msg, in
 /* Convert user address (VA mapped into master's space) to gpa */
 static uint64_t uva_to_gpa(struct vhost_dev* dev, uint64_t uva)
 {
-    for (uint32_t i = 0; i < dev->num_regions; ++i) {
-        struct vhost_user_mem_region* mr = &dev->regions[i];
+    for (uint32_t i = 0; i < dev->num_mem_slots; ++i) {
+        struct vhost_user_mem_region* mr = &dev->mem_slots[i].region;
         if (mr->user_addr <= uva && uva <= mr->user_addr + mr->size - 1) {
             return mr->guest_addr + (uva - mr->user_addr);
         }
@@ -560,62 +978,537 @@ static uint64_t uva_to_gpa(struct vhost_dev* dev, uint64_t uva)
     return (uint64_t)MAP_FAILED;
 }
 
-static void reset_memory_map(struct vhost_dev* dev)
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+/*
+ * Prefer NUMA node for pages of the mapping that are not faulted in yet.
+ * Guest memory is shared with master, so pages it already touched can't be moved,
+ * and for shmem and hugetlbfs files this sets the file's shared policy, see vhost_set_mem_policy.
+ */
+static int bind_mem_node(void* ptr, size_t size, int node)
 {
-    /* Unmap mapped regions */
-    for (size_t i = 0; i < dev->memory_map.num_regions; ++i) {
-        munmap(dev->memory_map.regions[i].hva, dev->memory_map.regions[i].len);
+    unsigned long nodemask[(VHOST_MAX_NUMA_NODE + 1) / (8 * sizeof(unsigned long))] = {0};
+    nodemask[node / (8 * sizeof(unsigned long))] |= 1ul << (node % (8 * sizeof(unsigned long)));
+
+    /* Kernel only looks at the first maxnode - 1 bits */
+    if (syscall(SYS_mbind, ptr, size, MPOL_PREFERRED, nodemask, VHOST_MAX_NUMA_NODE + 2, 0) != 0) {
+        return -errno;
     }
 
-    dev->memory_map = VIRTIO_INIT_MEMORY_MAP;
-    dev->num_regions = 0;
+    return 0;
 }
 
-static int set_mem_table(struct vhost_dev* dev, struct vhost_user_message* msg, int* fds, size_t nfds)
+/* Apply memory policy to a new mapping, failures are not fatal */
+static void apply_mem_policy(const struct vhost_mem_policy* policy, void* ptr, size_t size, bool is_populated)
 {
-    if (msg->mem_regions.num_regions > VHOST_USER_MAX_FDS) {
-        return -1;
-    }
-
-    /* Drop current memory map */
-    reset_memory_map(dev);
-
-    for (size_t i = 0; i < msg->mem_regions.num_regions; ++i) {
-        struct vhost_user_mem_region* mr = &msg->mem_regions.regions[i];
-        int fd = fds[i];
-
-        /* Zero-sized regions look fishy */
-        if (mr->size == 0) {
-            goto reset_dev;
-        }
+    int error;
 
-        /* We assume regions to be at least page-aligned */
-        if ((mr->guest_addr & (PAGE_SIZE - 1)) ||
-            (mr->size & (PAGE_SIZE - 1)) ||
-            ((mr->user_addr + mr->mmap_offset) & (PAGE_SIZE - 1))) {
-            goto reset_dev;
+    if (policy->numa_node != VHOST_MEM_NODE_ANY) {
+        error = bind_mem_node(ptr, size, policy->numa_node);
+        if (error) {
+            VHOST_LOG_ERROR2(error, "could not bind guest memory to node %d", policy->numa_node);
         }
+    }
 
-        void* ptr = mmap(NULL, mr->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, mr->mmap_offset);
-        if (ptr == MAP_FAILED) {
-            goto reset_dev;
+    /* mlock faults the pages in by itself */
+    if (policy->flags & VHOST_MEM_F_MLOCK) {
+        if (mlock(ptr, size) != 0) {
+            VHOST_LOG_ERROR2(-errno, "could not lock guest memory");
         }
-
-        int error = virtio_add_guest_region(&dev->memory_map, mr->guest_addr, mr->size, ptr, false);
-        if (error) {
-            goto reset_dev;
+    } else if ((policy->flags & VHOST_MEM_F_POPULATE) && !is_populated) {
+        if (madvise(ptr, size, MADV_POPULATE_WRITE) != 0) {
+            VHOST_LOG_ERROR2(-errno, "could not prefault guest memory");
         }
-
-        close(fd);
     }
+}
 
-    memcpy(dev->regions, msg->mem_regions.regions, sizeof(*dev->regions) * msg->mem_regions.num_regions);
-    dev->num_regions = msg->mem_regions.num_regions;
+/* Validate region description and map it */
+static int map_mem_slot(struct vhost_dev* dev,
+                        struct vhost_mem_slot* slot,
+                        const struct vhost_user_mem_region* mr,
+                        int fd,
+                        const struct stat* st)
+{
+    /* Zero-sized regions look fishy */
+    if (mr->size == 0) {
+        return -EINVAL;
+    }
+
+    struct statfs fs;
+    if (fstatfs(fd, &fs) != 0) {
+        return -errno;
+    }
+
+    /* We assume regions to be at least page-aligned, hugetlbfs can only be mapped in its own pages */
+    uint64_t page_size = (fs.f_type == HUGETLBFS_MAGIC ? (uint64_t)fs.f_bsize : PAGE_SIZE);
+    if ((mr->guest_addr & (page_size - 1)) ||
+        (mr->size & (page_size - 1)) ||
+        ((mr->user_addr + mr->mmap_offset) & (page_size - 1))) {
+        return -EINVAL;
+    }
+
+    /* Pages should be allocated on the preferred node, so populate after binding if we have one */
+    const struct vhost_mem_policy* policy = &dev->mem_policy;
+    bool populate_on_map = (policy->flags & VHOST_MEM_F_POPULATE) && policy->numa_node == VHOST_MEM_NODE_ANY;
+
+    void* ptr = mmap(NULL, mr->size, PROT_READ | PROT_WRITE, MAP_SHARED | (populate_on_map ? MAP_POPULATE : 0),
+                     fd, mr->mmap_offset);
+    if (ptr == MAP_FAILED) {
+        return -errno;
+    }
+
+    /* Shmem hands out transparent huge pages only to mappings that ask for them */
+    if (fs.f_type == TMPFS_MAGIC) {
+        madvise(ptr, mr->size, MADV_HUGEPAGE);
+    }
+
+    apply_mem_policy(policy, ptr, mr->size, populate_on_map);
 
+    slot->region = *mr;
+    slot->hva = ptr;
+    slot->st_dev = st->st_dev;
+    slot->st_ino = st->st_ino;
     return 0;
+}
+
+static void unmap_mem_slot(struct vhost_mem_slot* slot)
+{
+    munmap(slot->hva, slot->region.size);
+}
+
+/* Tell if slot already maps this region of the same file */
+static bool is_same_mem_slot(const struct vhost_mem_slot* slot, const struct vhost_user_mem_region* mr, const struct stat* st)
+{
+    return slot->region.guest_addr == mr->guest_addr &&
+           slot->region.size == mr->size &&
+           slot->region.user_addr == mr->user_addr &&
+           slot->region.mmap_offset == mr->mmap_offset &&
+           slot->st_dev == st->st_dev &&
+           slot->st_ino == st->st_ino;
+}
+
+/*
+ * Published memory maps are never modified, every update builds a new map and swaps it in.
+ *
+ * Vrings translate guest addresses only from their event loop handlers, which run under the loop lock.
+ * Taking a vring loop lock once after the swap is thus a quiescent point: the vring is not using
+ * the old map and will only see the new one from then on. Once every vring has passed it,
+ * the old map can go away. Requests the device translated earlier can still be in flight
+ * on an asynchronous backend though, so regions that are not in the new map are only unmapped
+ * after drain_vrings.
+ * Vrings are held up one at a time and only for as long as it takes to switch the pointer,
+ * and the translation path itself doesn't synchronize with anything.
+ */
+static void publish_memory_map(struct vhost_dev* dev, struct virtio_memory_map* map)
+{
+    struct virtio_memory_map* old = dev->memory_map;
+    if (map == old) {
+        return;
+    }
+
+    /* Vrings that are not started yet pick up the new map on start */
+    __atomic_store_n(&dev->memory_map, map, __ATOMIC_RELEASE);
+
+    for (uint8_t i = 0; i < dev->num_queues; ++i) {
+        struct vring* vring = &dev->vrings[i];
+
+        evloop_lock(vring->evloop);
+        if (vring->is_started) {
+            virtqueue_set_memory_map(&vring->vq, map);
+        }
+        evloop_unlock(vring->evloop);
+    }
+
+    /* Device hook can touch whatever its queues use, it runs with all vrings stopped */
+    if (dev->vdev->set_memory_map) {
+        lock_vrings(dev);
+        virtio_dev_set_memory_map(dev->vdev, map);
+        unlock_vrings(dev);
+    }
+
+    if (old != &g_empty_memory_map) {
+        vhost_free(old);
+    }
+}
+
+/* Wait for device requests that can reference memory of a previous map to complete */
+static void drain_vrings(struct vhost_dev* dev)
+{
+    for (uint8_t i = 0; i < dev->num_queues; ++i) {
+        struct vring* vring = &dev->vrings[i];
+
+        evloop_lock(vring->evloop);
+        if (vring->is_started) {
+            virtio_dev_drain_queue(dev->vdev, &vring->vq);
+        }
+        evloop_unlock(vring->evloop);
+    }
+}
+
+/* Copy current map for an update */
+static struct virtio_memory_map* clone_memory_map(const struct vhost_dev* dev)
+{
+    struct virtio_memory_map* map = vhost_alloc(sizeof(*map));
+    *map = *dev->memory_map;
+    return map;
+}
+
+static void reset_memory_map(struct vhost_dev* dev)
+{
+    /* Device must let go of the regions before they are gone */
+    publish_memory_map(dev, &g_empty_memory_map);
+    drain_vrings(dev);
+
+    /* Unmap mapped regions */
+    for (uint32_t i = 0; i < dev->num_mem_slots; ++i) {
+        unmap_mem_slot(&dev->mem_slots[i]);
+    }
+
+    dev->num_mem_slots = 0;
+}
+
+/* Handlers own the fds received with their message and close them on every path */
+static void close_fds(int* fds, size_t nfds)
+{
+    for (size_t i = 0; i < nfds; ++i) {
+        close(fds[i]);
+    }
+}
+
+/*
+ * Master sends the whole memory table every time it changes.
+ * Regions that did not change keep their mappings, so we only map what's new and unmap what's gone.
+ */
+static int set_mem_table(struct vhost_dev* dev, struct vhost_user_message* msg, int* fds, size_t nfds)
+{
+    uint32_t num_regions = msg->mem_regions.num_regions;
+    if (num_regions > VHOST_USER_MAX_FDS || num_regions > nfds) {
+        close_fds(fds, nfds);
+        return -1;
+    }
+
+    struct vhost_mem_slot slots[VHOST_USER_MAX_FDS];
+    bool is_new[VHOST_USER_MAX_FDS] = {0};
+    bool is_kept[VHOST_MAX_MEM_SLOTS] = {0};
+    struct virtio_memory_map* map = vhost_alloc(sizeof(*map));
+    *map = VIRTIO_INIT_MEMORY_MAP;
+
+    uint32_t i;
+    for (i = 0; i < num_regions; ++i) {
+        /* Message is packed, work on an aligned copy */
+        struct vhost_user_mem_region region = msg->mem_regions.regions[i];
+        struct vhost_user_mem_region* mr = &region;
+
+        struct stat st;
+        if (fstat(fds[i], &st) != 0) {
+            goto error_out;
+        }
+
+        uint32_t j;
+        for (j = 0; j < dev->num_mem_slots; ++j) {
+            if (!is_kept[j] && is_same_mem_slot(&dev->mem_slots[j], mr, &st)) {
+                break;
+            }
+        }
+
+        if (j < dev->num_mem_slots) {
+            slots[i] = dev->mem_slots[j];
+            is_kept[j] = true;
+        } else if (map_mem_slot(dev, &slots[i], mr, fds[i], &st) == 0) {
+            is_new[i] = true;
+        } else {
+            goto error_out;
+        }
+
+        if (virtio_add_guest_region(map, mr->guest_addr, mr->size, slots[i].hva, false) != 0) {
+            i++;
+            goto error_out;
+        }
+    }
+
+    /* Switch device to the new map before regions that are not in it go away */
+    publish_memory_map(dev, map);
+
+    bool has_removed = false;
+    for (uint32_t j = 0; j < dev->num_mem_slots; ++j) {
+        has_removed |= !is_kept[j];
+    }
+
+    if (has_removed) {
+        drain_vrings(dev);
+    }
+
+    for (uint32_t j = 0; j < dev->num_mem_slots; ++j) {
+        if (!is_kept[j]) {
+            unmap_mem_slot(&dev->mem_slots[j]);
+        }
+    }
+
+    memcpy(dev->mem_slots, slots, sizeof(*slots) * num_regions);
+    dev->num_mem_slots = num_regions;
+
+    close_fds(fds, nfds);
+    return 0;
+
+error_out:
+    while (i-- > 0) {
+        if (is_new[i]) {
+            unmap_mem_slot(&slots[i]);
+        }
+    }
+
+    vhost_free(map);
+    close_fds(fds, nfds);
+    return -1;
+}
+
+static void unmap_dirty_log(struct vhost_dev* dev)
+{
+    if (dev->log.bitmap) {
+        munmap(dev->log.bitmap, dev->log_mmap_size);
+    }
+
+    dev->log = (struct virtio_dirty_log){ NULL, 0 };
+    dev->log_mmap_size = 0;
+}
+
+static int set_log_base(struct vhost_dev* dev, struct vhost_user_message* msg, int* fds, size_t nfds)
+{
+    if (msg->hdr.size < sizeof(msg->log) || nfds != 1) {
+        close_fds(fds, nfds);
+        return -1;
+    }
+
+    /* Mapping keeps the log alive, we don't need the fd either way */
+    uint64_t size = msg->log.mmap_size;
+    void* ptr = (size ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], msg->log.mmap_offset) : MAP_FAILED);
+    close(fds[0]);
+
+    if (ptr == MAP_FAILED) {
+        return -1;
+    }
+
+    /* Master can resize the log when guest memory grows, vrings are locked so we can just switch them */
+    unmap_dirty_log(dev);
+    dev->log = (struct virtio_dirty_log){ ptr, size * 8 };
+    dev->log_mmap_size = size;
+    update_vrings_dirty_log(dev);
+
+    /* Master waits for a reply to know we are done with the old log */
+    msg->u64 = 0;
+    msg->hdr.size = sizeof(msg->u64);
+    return 0;
+}
+
+static void unmap_inflight(struct vhost_dev* dev)
+{
+    if (!dev->inflight_base) {
+        return;
+    }
+
+    /* Vrings are locked, started ones just stop tracking */
+    for (uint8_t i = 0; i < dev->num_queues; ++i) {
+        if (dev->vrings[i].is_started) {
+            virtqueue_set_inflight(&dev->vrings[i].vq, NULL);
+        }
+    }
+
+    munmap(dev->inflight_base, dev->inflight_mmap_size);
+    close(dev->inflight_fd);
+
+    dev->inflight_base = NULL;
+    dev->inflight_mmap_size = 0;
+    dev->inflight_fd = -1;
+    dev->inflight_num_queues = 0;
+    dev->inflight_queue_size = 0;
+}
+
+static bool is_valid_inflight_geometry(const struct vhost_dev* dev, uint16_t num_queues, uint16_t queue_size)
+{
+    return num_queues != 0 && num_queues <= dev->num_queues &&
+           queue_size != 0 && queue_size <= VIRTQ_MAX_SIZE;
+}
+
+static void set_inflight(struct vhost_dev* dev, void* base, uint64_t size, int fd,
+                         uint16_t num_queues, uint16_t queue_size)
+{
+    unmap_inflight(dev);
+
+    dev->inflight_base = base;
+    dev->inflight_mmap_size = size;
+    dev->inflight_fd = fd;
+    dev->inflight_num_queues = num_queues;
+    dev->inflight_queue_size = queue_size;
+}
+
+static int get_inflight_fd(struct vhost_dev* dev, struct vhost_user_message* msg, int* fds, size_t nfds)
+{
+    if (msg->hdr.size < sizeof(msg->inflight)) {
+        return -1;
+    }
+
+    uint16_t num_queues = msg->inflight.num_queues;
+    uint16_t queue_size = msg->inflight.queue_size;
+    if (!is_valid_inflight_geometry(dev, num_queues, queue_size)) {
+        return -1;
+    }
+
+    /* Zero-size reply tells master we don't have a region, it can go on without one */
+    msg->inflight.mmap_size = 0;
+    msg->inflight.mmap_offset = 0;
+    msg->hdr.size = sizeof(msg->inflight);
+
+    uint64_t size = num_queues * virtq_inflight_size(queue_size);
+    int fd = memfd_create("vhost-inflight", MFD_CLOEXEC);
+    if (fd < 0) {
+        VHOST_LOG_ERROR2(-errno, "could not create inflight region");
+        return 0;
+    }
+
+    /* Fresh memfd pages are zeroed, which makes a valid unused region */
+    if (ftruncate(fd, size) != 0) {
+        VHOST_LOG_ERROR2(-errno, "could not size inflight region");
+        close(fd);
+        return 0;
+    }
+
+    void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED) {
+        VHOST_LOG_ERROR2(-errno, "could not map inflight region");
+        close(fd);
+        return 0;
+    }
+
+    set_inflight(dev, ptr, size, fd, num_queues, queue_size);
+
+    msg->inflight.mmap_size = size;
+    return 0;
+}
+
+static int set_inflight_fd(struct vhost_dev* dev, struct vhost_user_message* msg, int* fds, size_t nfds)
+{
+    if (msg->hdr.size < sizeof(msg->inflight) || nfds != 1) {
+        close_fds(fds, nfds);
+        return -1;
+    }
+
+    uint64_t size = msg->inflight.mmap_size;
+    uint16_t num_queues = msg->inflight.num_queues;
+    uint16_t queue_size = msg->inflight.queue_size;
+    if (!is_valid_inflight_geometry(dev, num_queues, queue_size) ||
+        size < num_queues * virtq_inflight_size(queue_size)) {
+        close(fds[0]);
+        return -1;
+    }
+
+    void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], msg->inflight.mmap_offset);
+    if (ptr == MAP_FAILED) {
+        close(fds[0]);
+        return -1;
+    }
+
+    /* Region is picked up by vrings when they start */
+    set_inflight(dev, ptr, size, fds[0], num_queues, queue_size);
+    return 0;
+}
+
+static int set_log_fd(struct vhost_dev* dev, struct vhost_user_message* msg, int* fds, size_t nfds)
+{
+    /* We never need to tell master about log changes, so we don't keep the fd */
+    close_fds(fds, nfds);
+
+    return 0;
+}
+
+static int get_max_mem_slots(struct vhost_dev* dev, struct vhost_user_message* msg, int* fds, size_t nfds)
+{
+    msg->u64 = VHOST_MAX_MEM_SLOTS;
+    msg->hdr.size = sizeof(msg->u64);
+    return 0;
+}
+
+static int add_mem_reg(struct vhost_dev* dev, struct vhost_user_message* msg, int* fds, size_t nfds)
+{
+    int res = -1;
+    if (msg->hdr.size < sizeof(msg->mem_slot) || nfds != 1) {
+        goto out;
+    }
+
+    /* Message is packed, work on an aligned copy */
+    struct vhost_user_mem_region region = msg->mem_slot.region;
+    struct vhost_user_mem_region* mr = &region;
+
+    struct stat st;
+    if (fstat(fds[0], &st) != 0) {
+        goto out;
+    }
+
+    /* Master can resend a region we already have */
+    for (uint32_t i = 0; i < dev->num_mem_slots; ++i) {
+        if (is_same_mem_slot(&dev->mem_slots[i], mr, &st)) {
+            res = 0;
+            goto out;
+        }
+    }
+
+    if (dev->num_mem_slots == VHOST_MAX_MEM_SLOTS) {
+        goto out;
+    }
+
+    struct vhost_mem_slot* slot = &dev->mem_slots[dev->num_mem_slots];
+    if (map_mem_slot(dev, slot, mr, fds[0], &st) != 0) {
+        goto out;
+    }
+
+    struct virtio_memory_map* map = clone_memory_map(dev);
+    if (virtio_add_guest_region(map, mr->guest_addr, mr->size, slot->hva, false) != 0) {
+        vhost_free(map);
+        unmap_mem_slot(slot);
+        goto out;
+    }
+
+    dev->num_mem_slots++;
+    publish_memory_map(dev, map);
+    res = 0;
+
+out:
+    close_fds(fds, nfds);
+    return res;
+}
+
+static int rem_mem_reg(struct vhost_dev* dev, struct vhost_user_message* msg, int* fds, size_t nfds)
+{
+    /* Master passes region fd along but we don't need it */
+    close_fds(fds, nfds);
+
+    if (msg->hdr.size < sizeof(msg->mem_slot)) {
+        return -1;
+    }
+
+    struct vhost_user_mem_region region = msg->mem_slot.region;
+    struct vhost_user_mem_region* mr = &region;
+    for (uint32_t i = 0; i < dev->num_mem_slots; ++i) {
+        struct vhost_mem_slot* slot = &dev->mem_slots[i];
+        if (slot->region.guest_addr != mr->guest_addr || slot->region.size != mr->size) {
+            continue;
+        }
+
+        struct virtio_memory_map* map = clone_memory_map(dev);
+        if (virtio_remove_guest_region(map, mr->guest_addr, mr->size, NULL) != 0) {
+            vhost_free(map);
+            return -1;
+        }
+
+        publish_memory_map(dev, map);
+        drain_vrings(dev);
+        unmap_mem_slot(slot);
+
+        *slot = dev->mem_slots[--dev->num_mem_slots];
+        return 0;
+    }
 
-reset_dev:
-    /* device reset will handle unmapping if anything that was potentially mapped */
     return -1;
 }
 
@@ -644,6 +1537,30 @@ static int get_config(struct vhost_dev* dev, struct vhost_user_message* msg, int
     return virtio_dev_get_config(dev->vdev, msg->device_config_space.data + offset, space_avail);
 }
 
+static int set_config(struct vhost_dev* dev, struct vhost_user_message* msg, int* fds, size_t nfds)
+{
+    size_t hdr_size = sizeof(msg->device_config_space) - VHOST_USER_MAX_CONFIG_SIZE;
+    if (msg->hdr.size < hdr_size) {
+        return -1;
+    }
+
+    /* Payload holds size bytes to write at config space offset */
+    uint32_t size = msg->device_config_space.size;
+    uint32_t offset = msg->device_config_space.offset;
+    if (size > VHOST_USER_MAX_CONFIG_SIZE || msg->hdr.size < hdr_size + size) {
+        return -1;
+    }
+
+    /* Rejected write fails the request, the connection is fine: see handler_fptr */
+    int error = virtio_dev_set_config(dev->vdev, msg->device_config_space.data, offset, size);
+    if (error) {
+        VHOST_LOG_ERROR2(error, "could not write %u bytes of device config at offset %u", size, offset);
+        return -error;
+    }
+
+    return 0;
+}
+
 enum {
     VRING_FD_KICK,
     VRING_FD_CALL,
@@ -659,6 +1576,10 @@ static int set_vring_fd(struct vhost_dev* dev, struct vhost_user_message* msg, i
     uint8_t vring_idx = msg->u64 & 0xFF;
     bool invalid_fd = (msg->u64 & (1ul << 8)) != 0;
 
+    if (!invalid_fd && nfds < 1) {
+        return -1;
+    }
+
     if (vring_idx >= dev->num_queues) {
         return -1;
     }
@@ -684,6 +1605,84 @@ static int set_vring_fd(struct vhost_dev* dev, struct vhost_user_message* msg, i
     return 0;
 }
 
+static int map_notify_area(struct vhost_dev* dev)
+{
+    size_t size = dev->num_queues * PAGE_SIZE;
+    int fd = memfd_create("vhost-notify", MFD_CLOEXEC);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    if (ftruncate(fd, size) != 0) {
+        int error = -errno;
+        close(fd);
+        return error;
+    }
+
+    void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED) {
+        int error = -errno;
+        close(fd);
+        return error;
+    }
+
+    for (uint8_t i = 0; i < dev->num_queues; ++i) {
+        *(uint16_t*)((uint8_t*)ptr + i * PAGE_SIZE) = VRING_DOORBELL_IDLE;
+    }
+
+    dev->notify_area = ptr;
+    dev->notify_fd = fd;
+    return 0;
+}
+
+static void unmap_notify_area(struct vhost_dev* dev)
+{
+    if (!dev->notify_area) {
+        return;
+    }
+
+    munmap(dev->notify_area, dev->num_queues * PAGE_SIZE);
+    close(dev->notify_fd);
+    dev->notify_area = NULL;
+    dev->notify_fd = -1;
+}
+
+/* Hand master the vring page of our notification area, failing that the vring just keeps using kickfd */
+static void vring_setup_host_notifier(struct vring* vring)
+{
+    struct vhost_dev* dev = vring->dev;
+    size_t idx = vring - dev->vrings;
+
+    vring->doorbell = NULL;
+
+    if (!vring->use_host_notifier || dev->slave_fd == -1 ||
+        !has_feature(dev->negotiated_protocol_features, VHOST_USER_PROTOCOL_F_HOST_NOTIFIER) ||
+        !has_feature(dev->negotiated_protocol_features, VHOST_USER_PROTOCOL_F_SLAVE_SEND_FD)) {
+        return;
+    }
+
+    int error = dev->notify_area ? 0 : map_notify_area(dev);
+    if (error) {
+        VHOST_LOG_ERROR2(error, "could not create host notifier area");
+        return;
+    }
+
+    struct vhost_user_message msg = {0};
+    msg.hdr.request = VHOST_USER_SLAVE_VRING_HOST_NOTIFIER_MSG;
+    msg.hdr.size = sizeof(msg.vring_area);
+    msg.vring_area.u64 = idx;
+    msg.vring_area.size = PAGE_SIZE;
+    msg.vring_area.offset = idx * PAGE_SIZE;
+
+    error = send_slave_request(dev, &msg, dev->notify_fd);
+    if (error) {
+        VHOST_LOG_ERROR2(error, "vring %zu: could not send host notifier to master", idx);
+        return;
+    }
+
+    vring->doorbell = (uint16_t*)((uint8_t*)dev->notify_area + idx * PAGE_SIZE);
+}
+
 static int set_vring_kick(struct vhost_dev* dev, struct vhost_user_message* msg, int* fds, size_t nfds)
 {
     int error = set_vring_fd(dev, msg, fds, nfds, VRING_FD_KICK);
@@ -692,22 +1691,96 @@ static int set_vring_kick(struct vhost_dev* dev, struct vhost_user_message* msg,
     }
 
     /*
-     * Register vring kickfd in event loop.
-     * TODO: for now we are using the global vhost event loop.
+     * With in-band notifications master kicks us with VHOST_USER_VRING_KICK instead,
+     * we turn those into events on our own kickfd so that they take the usual path.
      */
 
     struct vring* vring = &dev->vrings[msg->u64 & 0xFF];
+    if (vring->kickfd == -1 && has_inband_notifications(dev)) {
+        vring->kickfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (vring->kickfd < 0) {
+            vring->kickfd = -1;
+            return -1;
+        }
+    }
+
+    /*
+     * Vrings start on their first kick, but guest may never kick us for requests
+     * the previous instance has left inflight. Kick ourselves to get them resubmitted.
+     */
+
+    if (vring->kickfd != -1 && !vring->is_started) {
+        struct virtq_inflight* inflight = get_vring_inflight(vring);
+        if (inflight && vring->size == dev->inflight_queue_size && virtq_inflight_has_chains(inflight, vring->size)) {
+            eventfd_write(vring->kickfd, 1);
+        }
+    }
+
+    /*
+     * Register vring kickfd in its event loop, disabled vrings do that when they are enabled.
+     */
+
     if (vring->kickfd != -1) {
-        vring->kick_cb = (struct event_cb){ EPOLLIN | EPOLLHUP, vring, handle_vring_event };
-        vhost_evloop_add_fd(vring->kickfd, &vring->kick_cb);
+        vring_setup_host_notifier(vring);
+        if (vring->is_enabled) {
+            vring_add_kickfd(vring);
+        }
     }
 
     return 0;
 }
 
+static void send_inband_call(struct vring* vring)
+{
+    struct vhost_dev* dev = vring->dev;
+
+    struct vhost_user_message msg = {0};
+    msg.hdr.request = VHOST_USER_SLAVE_VRING_CALL;
+    msg.hdr.size = sizeof(msg.vring_state);
+    msg.vring_state.index = vring - dev->vrings;
+
+    int error = send_slave_request(dev, &msg, -1);
+    if (error) {
+        VHOST_LOG_ERROR2(error, "vring %u: could not send call to master", msg.vring_state.index);
+    }
+}
+
+/* Relay vring call signals to master, they can come from any vring thread but the slave channel is ours */
+static void handle_inband_call(struct event_cb* cb, int fd, uint32_t events)
+{
+    struct vring* vring = cb->ptr;
+
+    /* Master can set up the slave channel after the vrings, don't lose calls until it does */
+    if (vring->dev->slave_fd == -1) {
+        vring->has_pending_inband_call = true;
+        return;
+    }
+
+    send_inband_call(vring);
+}
+
 static int set_vring_call(struct vhost_dev* dev, struct vhost_user_message* msg, int* fds, size_t nfds)
 {
-    return set_vring_fd(dev, msg, fds, nfds, VRING_FD_CALL);
+    int error = set_vring_fd(dev, msg, fds, nfds, VRING_FD_CALL);
+    if (error) {
+        return error;
+    }
+
+    /* In-band calls go over the slave channel, they are held back until master gives us one */
+    struct vring* vring = &dev->vrings[msg->u64 & 0xFF];
+    if (vring->callfd == -1 && has_inband_notifications(dev)) {
+        vring->callfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (vring->callfd < 0) {
+            vring->callfd = -1;
+            return -1;
+        }
+
+        vring->inband_call_cb = (struct event_cb){ EPOLLIN | EVLOOP_F_EVENTFD, vring, handle_inband_call };
+        vhost_evloop_add_fd(vring->callfd, &vring->inband_call_cb);
+        vring->has_inband_call = true;
+    }
+
+    return 0;
 }
 
 static int set_vring_err(struct vhost_dev* dev, struct vhost_user_message* msg, int* fds, size_t nfds)
@@ -721,7 +1794,7 @@ static int set_vring_num(struct vhost_dev* dev, struct vhost_user_message* msg,
         return -1;
     }
 
-    if (msg->vring_state.index > dev->num_queues) {
+    if (msg->vring_state.index >= dev->num_queues) {
         return -1;
     }
 
@@ -739,14 +1812,14 @@ static int set_vring_addr(struct vhost_dev* dev, struct vhost_user_message* msg,
         return -1;
     }
 
-    if (msg->vring_state.index > dev->num_queues) {
+    if (msg->vring_state.index >= dev->num_queues) {
         return -1;
     }
 
-    /* Currently we don't support logging */
-    if (has_feature(msg->vring_address.flags, VHOST_VRING_F_LOG)) {
-        return -1;
-    }
+    /*
+     * With VHOST_VRING_F_LOG master also gives us the gpa of the used ring to log its updates at.
+     * We already know it from the used ring address, so there is nothing to keep.
+     */
 
     dev->vrings[msg->vring_state.index].avail_addr = uva_to_gpa(dev, msg->vring_address.available);
     dev->vrings[msg->vring_state.index].desc_addr = uva_to_gpa(dev, msg->vring_address.descriptor);
@@ -761,7 +1834,7 @@ static int set_vring_base(struct vhost_dev* dev, struct vhost_user_message* msg,
         return -1;
     }
 
-    if (msg->vring_state.index > dev->num_queues) {
+    if (msg->vring_state.index >= dev->num_queues) {
         return -1;
     }
 
@@ -775,13 +1848,15 @@ static int get_vring_base(struct vhost_dev* dev, struct vhost_user_message* msg,
         return -1;
     }
 
-    if (msg->vring_state.index > dev->num_queues) {
+    if (msg->vring_state.index >= dev->num_queues) {
         return -1;
     }
 
     /* Sync avail base between vring and underlying virtqueue */
     struct vring* vring = &dev->vrings[msg->vring_state.index];
-    vring->avail_base = vring->vq.last_seen_avail;
+    if (vring->is_started) {
+        vring->avail_base = virtqueue_get_avail_base(&vring->vq);
+    }
 
     /* Strangely enough spec says that we should stop vring on GET_VRING_BASE */
     vring_stop(vring);
@@ -790,6 +1865,80 @@ static int get_vring_base(struct vhost_dev* dev, struct vhost_user_message* msg,
     return 0;
 }
 
+static int vring_kick(struct vhost_dev* dev, struct vhost_user_message* msg, int* fds, size_t nfds)
+{
+    if (msg->hdr.size < sizeof(msg->vring_state)) {
+        return -1;
+    }
+
+    if (!has_inband_notifications(dev) || msg->vring_state.index >= dev->num_queues) {
+        return -1;
+    }
+
+    /* Vring thread picks the kick up like any other, disabled vrings keep it pending */
+    struct vring* vring = &dev->vrings[msg->vring_state.index];
+    if (vring->kickfd == -1) {
+        return -1;
+    }
+
+    eventfd_write(vring->kickfd, 1);
+    return 0;
+}
+
+static int set_slave_req_fd(struct vhost_dev* dev, struct vhost_user_message* msg, int* fds, size_t nfds)
+{
+    if (nfds != 1) {
+        return -1;
+    }
+
+    if (dev->slave_fd != -1) {
+        close(dev->slave_fd);
+    }
+
+    dev->slave_fd = fds[0];
+
+    for (uint8_t i = 0; i < dev->num_queues; ++i) {
+        struct vring* vring = &dev->vrings[i];
+        if (vring->has_pending_inband_call) {
+            vring->has_pending_inband_call = false;
+            send_inband_call(vring);
+        }
+    }
+
+    return 0;
+}
+
+static int set_vring_enable(struct vhost_dev* dev, struct vhost_user_message* msg, int* fds, size_t nfds)
+{
+    if (msg->hdr.size < sizeof(msg->vring_state)) {
+        return -1;
+    }
+
+    if (msg->vring_state.index >= dev->num_queues) {
+        return -1;
+    }
+
+    /* Bad state value only fails this request, see handler_fptr */
+    if (msg->vring_state.num > 1) {
+        return EINVAL;
+    }
+
+    /* Spec only defines this message with protocol features, without them vrings are always enabled */
+    if (!dev->has_protocol_features) {
+        return EPROTO;
+    }
+
+    vring_set_enabled(&dev->vrings[msg->vring_state.index], msg->vring_state.num != 0);
+    return 0;
+}
+
+static bool is_memory_request(uint32_t request)
+{
+    return request == VHOST_USER_SET_MEM_TABLE ||
+           request == VHOST_USER_ADD_MEM_REG ||
+           request == VHOST_USER_REM_MEM_REG;
+}
+
 static void handle_message(struct vhost_dev* dev, struct vhost_user_message* msg, int* fds, size_t nfds)
 {
     VHOST_VERIFY(dev);
@@ -803,8 +1952,8 @@ static void handle_message(struct vhost_dev* dev, struct vhost_user_message* msg
         set_owner,      /* VHOST_USER_SET_OWNER            */
         reset_owner,    /* VHOST_USER_RESET_OWNER          */
         set_mem_table,  /* VHOST_USER_SET_MEM_TABLE        */
-        NULL, /* VHOST_USER_SET_LOG_BASE         */
-        NULL, /* VHOST_USER_SET_LOG_FD           */
+        set_log_base,   /* VHOST_USER_SET_LOG_BASE         */
+        set_log_fd,     /* VHOST_USER_SET_LOG_FD           */
         set_vring_num,  /* VHOST_USER_SET_VRING_NUM        */
         set_vring_addr, /* VHOST_USER_SET_VRING_ADDR       */
         set_vring_base, /* VHOST_USER_SET_VRING_BASE       */
@@ -815,34 +1964,34 @@ static void handle_message(struct vhost_dev* dev, struct vhost_user_message* msg
         get_protocol_features, /* VHOST_USER_GET_PROTOCOL_FEATURES*/
         set_protocol_features, /* VHOST_USER_SET_PROTOCOL_FEATURES*/
         get_queue_num,         /* VHOST_USER_GET_QUEUE_NUM        */
-        NULL, /* VHOST_USER_SET_VRING_ENABLE     */
+        set_vring_enable,      /* VHOST_USER_SET_VRING_ENABLE     */
         NULL, /* VHOST_USER_SEND_RARP            */
         NULL, /* VHOST_USER_NET_SET_MTU          */
-        NULL, /* VHOST_USER_SET_SLAVE_REQ_FD     */
+        set_slave_req_fd,      /* VHOST_USER_SET_SLAVE_REQ_FD     */
         NULL, /* VHOST_USER_IOTLB_MSG            */
         NULL, /* VHOST_USER_SET_VRING_ENDIAN     */
         get_config, /* VHOST_USER_GET_CONFIG           */
-        NULL, /* VHOST_USER_SET_CONFIG           */
+        set_config, /* VHOST_USER_SET_CONFIG           */
         NULL, /* VHOST_USER_CREATE_CRYPTO_SESSION*/
         NULL, /* VHOST_USER_CLOSE_CRYPTO_SESSION */
         NULL, /* VHOST_USER_POSTCOPY_ADVISE      */
         NULL, /* VHOST_USER_POSTCOPY_LISTEN      */
         NULL, /* VHOST_USER_POSTCOPY_END         */
-        NULL, /* VHOST_USER_GET_INFLIGHT_FD      */
-        NULL, /* VHOST_USER_SET_INFLIGHT_FD      */
+        get_inflight_fd, /* VHOST_USER_GET_INFLIGHT_FD      */
+        set_inflight_fd, /* VHOST_USER_SET_INFLIGHT_FD      */
         NULL, /* VHOST_USER_GPU_SET_SOCKET       */
         NULL, /* VHOST_USER_RESET_DEVICE         */
-        NULL, /* VHOST_USER_VRING_KICK           */
-        NULL, /* VHOST_USER_GET_MAX_MEM_SLOTS    */
-        NULL, /* VHOST_USER_ADD_MEM_REG          */
-        NULL, /* VHOST_USER_REM_MEM_REG          */
+        vring_kick,        /* VHOST_USER_VRING_KICK           */
+        get_max_mem_slots, /* VHOST_USER_GET_MAX_MEM_SLOTS    */
+        add_mem_reg,       /* VHOST_USER_ADD_MEM_REG          */
+        rem_mem_reg,       /* VHOST_USER_REM_MEM_REG          */
         NULL, /* VHOST_USER_SET_STATUS           */
         NULL, /* VHOST_USER_GET_STATUS           */
     };
 
     VHOST_LOG_DEBUG("dev %p: request %u, size %u, flags 0x%x", dev, msg->hdr.request, msg->hdr.size, msg->hdr.flags);
 
-    if (msg->hdr.request == 0 || msg->hdr.request > sizeof(handler_tbl) / sizeof(*handler_tbl)) {
+    if (msg->hdr.request == 0 || msg->hdr.request >= sizeof(handler_tbl) / sizeof(*handler_tbl)) {
         VHOST_LOG_DEBUG("dev %p: malformed request", dev);
         goto reset;
     }
@@ -851,8 +2000,14 @@ static void handle_message(struct vhost_dev* dev, struct vhost_user_message* msg
     if (!handler_tbl[msg->hdr.request]) {
         VHOST_LOG_DEBUG("dev %p: unsupported request", dev);
         res = -ENOTSUP;
+    } else if (is_memory_request(msg->hdr.request)) {
+        /* Memory updates don't stop the vrings, they switch them to the new map one by one */
+        res = handler_tbl[msg->hdr.request](dev, msg, fds, nfds);
     } else {
+        /* Vrings can be running on worker threads, keep them off while we change device state */
+        lock_vrings(dev);
         res = handler_tbl[msg->hdr.request](dev, msg, fds, nfds);
+        unlock_vrings(dev);
     }
 
     if (res < 0) {
@@ -860,12 +2015,23 @@ static void handle_message(struct vhost_dev* dev, struct vhost_user_message* msg
         goto reset;
     }
 
+    /* Positive errno fails just this request, master only learns about it from the ack */
+    if (res > 0) {
+        VHOST_LOG_DEBUG("dev %p: request %u rejected: %d", dev, msg->hdr.request, -res);
+    }
+
     if (message_assumes_reply(msg)) {
-        send_reply(dev, msg);
+        /* Only inflight region reply carries an fd */
+        int fd = -1;
+        if (msg->hdr.request == VHOST_USER_GET_INFLIGHT_FD && msg->inflight.mmap_size != 0) {
+            fd = dev->inflight_fd;
+        }
+
+        send_reply(dev, msg, fd);
     } else if (must_reply_ack(dev, msg)) {
-        msg->u64 = -res;
+        msg->u64 = (res > 0 ? (uint64_t)-res : 0);
         msg->hdr.size = sizeof(msg->u64);
-        send_reply(dev, msg);
+        send_reply(dev, msg, -1);
     }
 
     return;
@@ -885,10 +2051,116 @@ void vhost_reset_dev(struct vhost_dev* dev)
     dev->negotiated_protocol_features = 0;
     dev->session_started = false;
 
+    lock_vrings(dev);
+
     /* Reset vrings */
     for (uint8_t i = 0; i < dev->num_queues; ++i) {
         vring_reset(dev->vrings + i);
     }
 
     reset_memory_map(dev);
+
+    dev->log_all = false;
+    unmap_dirty_log(dev);
+    unmap_inflight(dev);
+    unmap_notify_area(dev);
+
+    if (dev->slave_fd != -1) {
+        close(dev->slave_fd);
+        dev->slave_fd = -1;
+    }
+
+    unlock_vrings(dev);
+}
+
+/*
+ * Vring event loops are locked in vring order.
+ * Worker threads only ever hold their own loop lock, so this can't deadlock.
+ */
+static void lock_vrings(struct vhost_dev* dev)
+{
+    for (uint8_t i = 0; i < dev->num_queues; ++i) {
+        evloop_lock(dev->vrings[i].evloop);
+    }
+}
+
+static void unlock_vrings(struct vhost_dev* dev)
+{
+    for (uint8_t i = dev->num_queues; i > 0; --i) {
+        evloop_unlock(dev->vrings[i - 1].evloop);
+    }
+}
+
+int vhost_set_mem_policy(struct vhost_dev* dev, const struct vhost_mem_policy* policy)
+{
+    if (!dev || !policy) {
+        return -EINVAL;
+    }
+
+    if (policy->flags & ~(VHOST_MEM_F_POPULATE | VHOST_MEM_F_MLOCK)) {
+        return -EINVAL;
+    }
+
+    if (policy->numa_node != VHOST_MEM_NODE_ANY &&
+        (policy->numa_node < 0 || policy->numa_node > VHOST_MAX_NUMA_NODE)) {
+        return -EINVAL;
+    }
+
+    /* Memory slots are mapped by the global loop */
+    evloop_lock(g_vhost_evloop);
+    dev->mem_policy = *policy;
+    evloop_unlock(g_vhost_evloop);
+    return 0;
+}
+
+int vhost_set_vring_polling(struct vhost_dev* dev, uint8_t vring_idx, uint32_t budget_us)
+{
+    if (!dev || vring_idx >= dev->num_queues) {
+        return -EINVAL;
+    }
+
+    struct vring* vring = &dev->vrings[vring_idx];
+
+    evloop_lock(vring->evloop);
+
+    vring->poll_max_ns = budget_us * 1000ull;
+    vring->poll_window_ns = VHOST_MAX(vring->poll_max_ns / 2, VRING_POLL_MIN_WINDOW_NS);
+
+    evloop_unlock(vring->evloop);
+    return 0;
+}
+
+int vhost_set_vring_host_notifier(struct vhost_dev* dev, uint8_t vring_idx, bool enable)
+{
+    if (!dev || vring_idx >= dev->num_queues) {
+        return -EINVAL;
+    }
+
+    struct vring* vring = &dev->vrings[vring_idx];
+    if (vring->kickfd != -1) {
+        return -EBUSY;
+    }
+
+    /* Busy polling the doorbell on the global loop would keep the protocol thread spinning */
+    if (enable && vring->evloop == g_vhost_evloop) {
+        return -EINVAL;
+    }
+
+    vring->use_host_notifier = enable;
+    return 0;
+}
+
+int vhost_set_vring_evloop(struct vhost_dev* dev, uint8_t vring_idx, struct event_loop* evloop)
+{
+    if (!dev || !evloop || vring_idx >= dev->num_queues) {
+        return -EINVAL;
+    }
+
+    struct vring* vring = &dev->vrings[vring_idx];
+    if (vring->kickfd != -1) {
+        return -EBUSY;
+    }
+
+    vring->evloop = evloop;
+    return 0;
 }
@@ -3,22 +3,105 @@
 #include <stdbool.h>
 #include <string.h>
 #include <errno.h>
+#include <sched.h>
+#include <sys/eventfd.h>
 
 #include "platform.h"
 #include "virtio/virtqueue.h"
 #include "virtio/blk.h"
 
 #define VBLK_DEFAULT_FEATURES (\
+    (1ull << VIRTIO_BLK_F_SEG_MAX) | \
     (1ull << VIRTIO_BLK_F_BLK_SIZE) | \
+    (1ull << VIRTIO_BLK_F_MQ) | \
     0)
 
+/* Maximum number of chains we pull from the virtqueue at once */
+#define VBLK_MAX_DEQUEUE_BATCH 32
+
+/* Default number of data segments in a single request we preallocate io contexts for */
+#define VBLK_DEFAULT_SEG_MAX 128
+
+_Static_assert(sizeof(struct virtio_blk_config) == 60, "virtio_blk_config does not match virtio 1.1 layout");
+
+/* Discard and write zeroes ranges are kept in the io context's scatter-gather list storage */
+_Static_assert(sizeof(struct blk_io_range) <= sizeof(struct virtio_iovec), "blk_io_range does not fit iovec slot");
+
+static int vblk_start_queue(struct virtio_dev* vdev, struct virtqueue* vq, int wakefd);
+static void vblk_stop_queue(struct virtio_dev* vdev, struct virtqueue* vq);
+static void vblk_drain_queue(struct virtio_dev* vdev, struct virtqueue* vq);
+static void vblk_reap_queue(struct virtio_dev* vdev, struct virtqueue* vq);
+
+static void vblk_set_memory_map(struct virtio_dev* vdev, const struct virtio_memory_map* map)
+{
+    struct virtio_blk* vblk = container_of(vdev, struct virtio_blk, vdev);
+
+    vblk->backend->set_memory_map(vblk, map);
+}
+
+/* Ranges a single discard or write zeroes request can carry, they share io context storage with data segments */
+static inline uint32_t vblk_max_range_segs(const struct virtio_blk* vblk, uint32_t segs)
+{
+    return VHOST_MIN(VHOST_MAX(segs, 1), vblk->seg_max);
+}
+
 static void vblk_get_config(struct virtio_dev* vdev, void* buffer)
 {
     struct virtio_blk* vblk = container_of(vdev, struct virtio_blk, vdev);
     struct virtio_blk_config* cfg = buffer;
 
     cfg->capacity = vblk->total_sectors;
+    cfg->size_max = vblk->size_max;
+    cfg->seg_max = vblk->seg_max;
     cfg->blk_size = vblk->block_size;
+    cfg->topology.physical_block_exp = vblk->physical_block_exp;
+    cfg->topology.alignment_offset = vblk->alignment_offset;
+    cfg->topology.min_io_size = vblk->min_io_size;
+    cfg->topology.opt_io_size = vblk->opt_io_size;
+    cfg->num_queues = vblk->num_queues;
+
+    /* Fields past num_queues only exist in config space of devices offering these features */
+    if (vblk->max_discard_sectors) {
+        cfg->max_discard_sectors = vblk->max_discard_sectors;
+        cfg->max_discard_seg = vblk_max_range_segs(vblk, vblk->max_discard_segs);
+        cfg->discard_sector_alignment = vblk->discard_sector_alignment;
+    }
+
+    if (vblk->max_write_zeroes_sectors) {
+        cfg->max_write_zeroes_sectors = vblk->max_write_zeroes_sectors;
+        cfg->max_write_zeroes_seg = vblk_max_range_segs(vblk, vblk->max_write_zeroes_segs);
+        cfg->write_zeroes_may_unmap = vblk->write_zeroes_may_unmap;
+    }
+
+    cfg->writeback = vblk->writeback;
+}
+
+static int vblk_set_config(struct virtio_dev* vdev, const void* data, uint32_t offset, uint32_t size)
+{
+    struct virtio_blk* vblk = container_of(vdev, struct virtio_blk, vdev);
+    uint32_t wce_offset = offset_of(struct virtio_blk_config, writeback);
+
+    /* Cache mode is the only field driver can write, and only if it negotiated the feature */
+    if (!(vdev->features & (1ull << VIRTIO_BLK_F_CONFIG_WCE))) {
+        return -EPERM;
+    }
+
+    if (offset > wce_offset || offset + size <= wce_offset) {
+        return -EPERM;
+    }
+
+    bool writeback = ((const uint8_t*)data)[wce_offset - offset] != 0;
+    if (writeback == vblk->writeback) {
+        return 0;
+    }
+
+    int error = vblk->backend->set_writeback(vblk, writeback);
+    if (error) {
+        return error;
+    }
+
+    vblk->writeback = writeback;
+    return 0;
 }
 
 int virtio_blk_init(struct virtio_blk* vblk)
@@ -35,11 +118,38 @@ int virtio_blk_init(struct virtio_blk* vblk)
         return -EINVAL;
     }
 
+    /* Callers predating multi-queue leave it unset */
+    if (!vblk->num_queues) {
+        vblk->num_queues = 1;
+    }
+
+    /* Segment must be able to hold at least one sector */
+    if (vblk->size_max && vblk->size_max < VIRTIO_BLK_SECTOR_SIZE) {
+        return -EINVAL;
+    }
+
+    if (!vblk->seg_max) {
+        vblk->seg_max = VBLK_DEFAULT_SEG_MAX;
+    }
+
+    /* Every queue slot preallocates seg_max vectors, and no chain can be longer than a queue anyway */
+    if (vblk->seg_max > VIRTQ_MAX_SIZE) {
+        return -EINVAL;
+    }
+
     vblk->vdev.features = 0;
     vblk->vdev.supported_features = VBLK_DEFAULT_FEATURES;
 
     if (vblk->readonly) {
-        vblk->vdev.supported_features |= VIRTIO_BLK_F_RO;
+        vblk->vdev.supported_features |= (1ull << VIRTIO_BLK_F_RO);
+    }
+
+    if (vblk->size_max) {
+        vblk->vdev.supported_features |= (1ull << VIRTIO_BLK_F_SIZE_MAX);
+    }
+
+    if (vblk->physical_block_exp || vblk->alignment_offset || vblk->min_io_size || vblk->opt_io_size) {
+        vblk->vdev.supported_features |= (1ull << VIRTIO_BLK_F_TOPOLOGY);
     }
 
     /*
@@ -52,8 +162,43 @@ int virtio_blk_init(struct virtio_blk* vblk)
         vblk->vdev.supported_features |= (1ull << VIRTIO_BLK_F_FLUSH);
     }
 
-    vblk->vdev.config_size = sizeof(struct virtio_blk_config);
+    /* Driver picks the cache mode, it needs flush for the writeback one */
+    bool has_wce = (vblk->backend && vblk->backend->set_writeback);
+    if (has_wce) {
+        vblk->vdev.supported_features |= (1ull << VIRTIO_BLK_F_CONFIG_WCE) | (1ull << VIRTIO_BLK_F_FLUSH);
+    }
+
+    /* Discard and write zeroes are not for read-only devices */
+    if (vblk->readonly) {
+        vblk->max_discard_sectors = 0;
+        vblk->max_write_zeroes_sectors = 0;
+    }
+
+    if (vblk->max_discard_sectors) {
+        vblk->vdev.supported_features |= (1ull << VIRTIO_BLK_F_DISCARD);
+    }
+
+    if (vblk->max_write_zeroes_sectors) {
+        vblk->vdev.supported_features |= (1ull << VIRTIO_BLK_F_WRITE_ZEROES);
+    }
+
+    /* Keep config space at its pre-discard size for masters that don't know the new fields */
+    if (vblk->max_discard_sectors || vblk->max_write_zeroes_sectors) {
+        vblk->vdev.config_size = sizeof(struct virtio_blk_config);
+    } else {
+        vblk->vdev.config_size = offset_of(struct virtio_blk_config, max_discard_sectors);
+    }
+
     vblk->vdev.get_config = vblk_get_config;
+    vblk->vdev.set_config = (has_wce ? vblk_set_config : NULL);
+    vblk->vdev.start_queue = vblk_start_queue;
+    vblk->vdev.stop_queue = vblk_stop_queue;
+    vblk->vdev.drain_queue = vblk_drain_queue;
+    vblk->vdev.reap_queue = vblk_reap_queue;
+
+    /* Memory map updates have to stop the queues to call the hook, only install it if backend needs one */
+    vblk->vdev.set_memory_map = (vblk->backend && vblk->backend->set_memory_map ? vblk_set_memory_map : NULL);
+
     return 0;
 }
 
@@ -64,7 +209,17 @@ struct virtio_blk_io
 {
     struct virtqueue* vq;
     uint8_t* pstatus;
+    uint64_t status_gpa;
     uint16_t head;
+
+    /** Context is owned by an in-flight request */
+    bool busy;
+
+    /** Posted completion status and link in the queue's completion stack */
+    enum blk_io_status status;
+    struct virtio_blk_io* next_completed;
+
+    /* Followed by maxvecs bio vectors and then by guest physical addresses of their buffers for dirty logging */
     struct blk_io_request bio;
 };
 
@@ -72,14 +227,179 @@ struct virtio_blk_io
 
 static inline size_t vblk_io_size(uint32_t maxvecs)
 {
-    return sizeof(struct virtio_blk_io) + sizeof(struct virtio_iovec) * maxvecs;
+    return sizeof(struct virtio_blk_io) + (sizeof(struct virtio_iovec) + sizeof(uint64_t)) * maxvecs;
 }
 
-static void complete_blk_request(struct virtio_blk* vblk, struct virtio_blk_io* vblk_io, enum blk_io_status res)
+/**
+ * Per-virtqueue pool of preallocated io contexts.
+ *
+ * Driver cannot reuse a chain head until we put it to used ring, so every in-flight
+ * request is uniquely identified by its head and we simply use it as a slot index.
+ */
+struct virtio_blk_io_pool
+{
+    /** Number of slots, equals to queue size */
+    uint16_t nslots;
+
+    /** Capacity of each slot's bio scatter-gather list */
+    uint32_t maxvecs;
+
+    /** Size of a single slot in bytes */
+    size_t slot_size;
+
+    /** Requests submitted to the asynchronous backend and not yet returned to the driver */
+    uint32_t inflight;
+
+    /**
+     * Queue is inside backend submit or poll and reaps completions right after,
+     * so completions posted meanwhile don't need a wakeup.
+     */
+    bool is_processing;
+
+    /**
+     * Lock-free stack of completions posted by the backend from any thread.
+     * Only the queue's thread pops, and it always takes the whole stack.
+     */
+    struct virtio_blk_io* completed;
+
+    /** Eventfd to wake up the queue's thread when completions are posted */
+    int wakefd;
+
+    uint8_t slots[/* nslots * slot_size */];
+};
+
+static void reap_completions(struct virtio_blk_io_pool* pool);
+
+/*
+ * Completion posted by another thread before we clear the flag is seen by the reap that follows,
+ * one posted after sees it cleared and wakes us up.
+ */
+static void set_processing(struct virtio_blk_io_pool* pool, bool is_processing)
+{
+    __atomic_store_n(&pool->is_processing, is_processing, __ATOMIC_SEQ_CST);
+}
+
+static int vblk_start_queue(struct virtio_dev* vdev, struct virtqueue* vq, int wakefd)
+{
+    struct virtio_blk* vblk = container_of(vdev, struct virtio_blk, vdev);
+
+    /* Chains can't be longer than the queue, indirect ones included, so small queues need fewer vectors */
+    uint32_t maxvecs = VHOST_MIN(vq->qsize, vblk->seg_max);
+    size_t slot_size = vblk_io_size(maxvecs);
+
+    struct virtio_blk_io_pool* pool = vhost_calloc(1, sizeof(*pool) + slot_size * vq->qsize);
+    pool->nslots = vq->qsize;
+    pool->maxvecs = maxvecs;
+    pool->slot_size = slot_size;
+    pool->wakefd = wakefd;
+
+    vq->priv = pool;
+    return 0;
+}
+
+static void vblk_reap_queue(struct virtio_dev* vdev, struct virtqueue* vq)
+{
+    struct virtio_blk* vblk = container_of(vdev, struct virtio_blk, vdev);
+    struct virtio_blk_io_pool* pool = vq->priv;
+    if (!pool) {
+        return;
+    }
+
+    set_processing(pool, true);
+    if (vblk->backend->poll) {
+        vblk->backend->poll(vblk, vq);
+    }
+    set_processing(pool, false);
+
+    reap_completions(pool);
+}
+
+static void vblk_drain_queue(struct virtio_dev* vdev, struct virtqueue* vq)
+{
+    struct virtio_blk_io_pool* pool = vq->priv;
+    if (!pool) {
+        return;
+    }
+
+    /*
+     * Backend still references io contexts of in-flight requests, wait for them.
+     * We run on the control thread with the queue's loop locked, so the queue's thread can't drain
+     * them for us and backend poll is driven from here, see virtio_blk_backend_ops.
+     */
+    while (pool->inflight) {
+        vblk_reap_queue(vdev, vq);
+        if (pool->inflight) {
+            sched_yield();
+        }
+    }
+}
+
+static void vblk_stop_queue(struct virtio_dev* vdev, struct virtqueue* vq)
+{
+    vblk_drain_queue(vdev, vq);
+
+    vhost_free(vq->priv);
+    vq->priv = NULL;
+}
+
+/* Get a free io context for the chain, returns NULL if chain cannot be handled */
+static struct virtio_blk_io* get_blk_io(const struct virtqueue_buffer_iter* iter)
+{
+    struct virtio_blk_io_pool* pool = iter->vq->priv;
+    if (!pool || iter->head >= pool->nslots) {
+        return NULL;
+    }
+
+    struct virtio_blk_io* vblk_io = (struct virtio_blk_io*) (pool->slots + pool->slot_size * iter->head);
+
+    /* Driver resubmitted a head that we didn't complete yet */
+    if (vblk_io->busy) {
+        return NULL;
+    }
+
+    vblk_io->vq = iter->vq;
+    return vblk_io;
+}
+
+static inline uint32_t get_blk_io_maxvecs(const struct virtio_blk_io* vblk_io)
+{
+    return ((struct virtio_blk_io_pool*) vblk_io->vq->priv)->maxvecs;
+}
+
+static inline uint64_t* get_blk_io_gpas(struct virtio_blk_io* vblk_io)
+{
+    return (uint64_t*) (vblk_io->bio.vecs + get_blk_io_maxvecs(vblk_io));
+}
+
+/* Tell the migrating master what we've written to guest memory for the request */
+static void log_blk_io_writes(struct virtio_blk_io* vblk_io)
+{
+    if (vblk_io->bio.type == BLK_IO_READ || vblk_io->bio.type == BLK_IO_GET_ID) {
+        const uint64_t* gpas = get_blk_io_gpas(vblk_io);
+        for (uint32_t i = 0; i < vblk_io->bio.nvecs; ++i) {
+            virtqueue_log_write(vblk_io->vq, gpas[i], vblk_io->bio.vecs[i].len);
+        }
+    }
+
+    virtqueue_log_write(vblk_io->vq, vblk_io->status_gpa, sizeof(*vblk_io->pstatus));
+}
+
+/* Write request status and release the io context, caller puts the chain to the used ring */
+static void finish_blk_io(struct virtio_blk_io* vblk_io, enum blk_io_status res)
 {
     *vblk_io->pstatus = res;
+
+    if (vblk_io->vq->log) {
+        log_blk_io_writes(vblk_io);
+    }
+
+    vblk_io->busy = false;
+}
+
+static void complete_blk_request(struct virtio_blk* vblk, struct virtio_blk_io* vblk_io, enum blk_io_status res)
+{
+    finish_blk_io(vblk_io, res);
     virtqueue_enqueue_used(vblk_io->vq, vblk_io->head, 0);
-    free(vblk_io);
 }
 
 static bool is_good_status_buf(const struct virtqueue_buffer* buf)
@@ -87,6 +407,17 @@ static bool is_good_status_buf(const struct virtqueue_buffer* buf)
     return buf->len == sizeof(u8) && !buf->ro;
 }
 
+/* Bind parsed request to its descriptor chain, from now on it has to be completed */
+static void start_blk_io(struct virtio_blk_io* vblk_io,
+                         const struct virtqueue_buffer_iter* iter,
+                         const struct virtqueue_buffer* status_buf)
+{
+    vblk_io->pstatus = status_buf->ptr;
+    vblk_io->status_gpa = status_buf->gpa;
+    vblk_io->head = iter->head;
+    vblk_io->busy = true;
+}
+
 static struct virtio_blk_io* blk_rw(struct virtio_blk* vblk,
                                     const struct virtio_blk_req* hdr,
                                     struct virtqueue_buffer_iter* iter)
@@ -94,7 +425,7 @@ static struct virtio_blk_io* blk_rw(struct virtio_blk* vblk,
     bool is_read = (hdr->type == VIRTIO_BLK_T_IN);
     uint64_t sector = hdr->sector;
     uint32_t total_sectors = 0;
-    uint8_t* pstatus = NULL;
+    struct virtqueue_buffer status_buf = { NULL };
 
     if (sector >= vblk->total_sectors) {
         return NULL;
@@ -104,76 +435,74 @@ static struct virtio_blk_io* blk_rw(struct virtio_blk* vblk,
         return NULL;
     }
 
+    struct virtio_blk_io* vblk_io = get_blk_io(iter);
+    if (!vblk_io) {
+        return NULL;
+    }
+
     /*
      * Walk descriptor chain expecting a series of data buffers (at least 1)
      * terminated by 1-byte writable status buffer.
      */
 
     uint32_t nvecs = 0;
-    uint32_t maxvecs = 16;
-    struct virtio_blk_io* vblk_io = realloc(NULL, vblk_io_size(maxvecs));
-    if (!vblk_io) {
-        return NULL;
-    }
+    uint32_t maxvecs = get_blk_io_maxvecs(vblk_io);
+    uint64_t* gpas = get_blk_io_gpas(vblk_io);
 
     struct virtqueue_buffer buf;
     while (virtqueue_next_buffer(iter, &buf)) {
         if (!virtqueue_has_next_buffer(iter)) {
             /* The last one is a status descriptor */
             if (!is_good_status_buf(&buf)) {
-                goto error_out;
+                return NULL;
             }
 
-            pstatus = buf.ptr;
+            status_buf = buf;
             break;
         }
 
         if (!buf.len || (buf.len & (VIRTIO_BLK_SECTOR_SIZE - 1))) {
-            goto error_out;
+            return NULL;
+        }
+
+        if (vblk->size_max && buf.len > vblk->size_max) {
+            return NULL;
         }
 
         if (is_read && buf.ro) {
-            goto error_out;
+            return NULL;
         }
 
         total_sectors += buf.len >> VIRTIO_BLK_SECTOR_SHIFT;
         if (sector + total_sectors > vblk->total_sectors) {
-            goto error_out;
+            return NULL;
+        }
+
+        /* Request has more segments than we can handle */
+        if (nvecs == maxvecs) {
+            return NULL;
         }
 
         vblk_io->bio.vecs[nvecs].ptr = buf.ptr;
         vblk_io->bio.vecs[nvecs].len = buf.len;
+        gpas[nvecs] = buf.gpa;
         nvecs++;
-
-        if (nvecs == maxvecs) {
-            maxvecs += 16;
-            vblk_io = realloc(vblk_io, vblk_io_size(maxvecs));
-            if (!vblk_io) {
-                goto error_out;
-            }
-        }
     }
 
     /**
      * If we're missing data buffers or status buffer or both - just fail the request
      */
-    if (!total_sectors || !pstatus) {
+    if (!total_sectors || !status_buf.ptr) {
         return NULL;
     }
 
-    vblk_io->vq = iter->vq;
-    vblk_io->pstatus = pstatus;
-    vblk_io->head = iter->head; /* TODO: be less intrusive here */
+    start_blk_io(vblk_io, iter, &status_buf);
     vblk_io->bio.type = (is_read ? BLK_IO_READ : BLK_IO_WRITE);
     vblk_io->bio.sector = sector;
     vblk_io->bio.total_sectors = total_sectors;
     vblk_io->bio.nvecs = nvecs;
 
     return vblk_io;
-
-error_out:
-    free(vblk_io);
-    return NULL;
 }
 
 static struct virtio_blk_io* blk_get_id(struct virtio_blk* vblk,
@@ -190,18 +519,145 @@ static struct virtio_blk_io* blk_get_id(struct virtio_blk* vblk,
         return NULL;
     }
 
-    /* TODO: we would like to avoid allocs on io handling path if possible */
-    struct virtio_blk_io* vblk_io = malloc(vblk_io_size(1));
+    struct virtio_blk_io* vblk_io = get_blk_io(iter);
     if (!vblk_io) {
         return NULL;
     }
 
-    vblk_io->vq = iter->vq;
-    vblk_io->pstatus = bufs[1].ptr;
-    vblk_io->head = iter->head; /* TODO: be less intrusive here */
+    start_blk_io(vblk_io, iter, &bufs[1]);
     vblk_io->bio.type = BLK_IO_GET_ID;
     vblk_io->bio.nvecs = 1;
     vblk_io->bio.vecs[0] = (struct virtio_iovec) { bufs[0].ptr, bufs[0].len };
+    get_blk_io_gpas(vblk_io)[0] = bufs[0].gpa;
+
+    return vblk_io;
+}
+
+static struct virtio_blk_io* blk_flush(struct virtio_blk* vblk,
+                                       const struct virtio_blk_req* hdr,
+                                       struct virtqueue_buffer_iter* iter)
+{
+    /* Flush has no data, header is followed by status buffer only. Sector is ignored. */
+    struct virtqueue_buffer buf;
+    if (!virtqueue_next_buffer(iter, &buf) || virtqueue_has_next_buffer(iter)) {
+        return NULL;
+    }
+
+    if (!is_good_status_buf(&buf)) {
+        return NULL;
+    }
+
+    struct virtio_blk_io* vblk_io = get_blk_io(iter);
+    if (!vblk_io) {
+        return NULL;
+    }
+
+    start_blk_io(vblk_io, iter, &buf);
+    vblk_io->bio.type = BLK_IO_FLUSH;
+    vblk_io->bio.sector = 0;
+    vblk_io->bio.total_sectors = 0;
+    vblk_io->bio.nvecs = 0;
+
+    return vblk_io;
+}
+
+static struct virtio_blk_io* blk_discard_write_zeroes(struct virtio_blk* vblk,
+                                                      const struct virtio_blk_req* hdr,
+                                                      struct virtqueue_buffer_iter* iter)
+{
+    bool is_discard = (hdr->type == VIRTIO_BLK_T_DISCARD);
+    uint32_t max_sectors = (is_discard ? vblk->max_discard_sectors : vblk->max_write_zeroes_sectors);
+    uint32_t max_segs = vblk_max_range_segs(vblk, is_discard ? vblk->max_discard_segs : vblk->max_write_zeroes_segs);
+    uint32_t total_sectors = 0;
+    uint32_t nranges = 0;
+    struct virtqueue_buffer status_buf = { NULL };
+
+    /* Feature was not offered */
+    if (!max_sectors) {
+        return NULL;
+    }
+
+    struct virtio_blk_io* vblk_io = get_blk_io(iter);
+    if (!vblk_io) {
+        return NULL;
+    }
+
+    /* Ranges are copied out of guest memory, so they take the place of data vectors */
+    struct blk_io_range* ranges = (struct blk_io_range*) vblk_io->bio.vecs;
+    max_segs = VHOST_MIN(max_segs, get_blk_io_maxvecs(vblk_io));
+
+    /*
+     * Walk descriptor chain expecting a series of buffers with range segments (at least 1)
+     * terminated by 1-byte writable status buffer.
+     */
+
+    struct virtqueue_buffer buf;
+    while (virtqueue_next_buffer(iter, &buf)) {
+        if (!virtqueue_has_next_buffer(iter)) {
+            if (!is_good_status_buf(&buf)) {
+                return NULL;
+            }
+
+            status_buf = buf;
+            break;
+        }
+
+        if (!buf.len || (buf.len % sizeof(struct virtio_blk_discard_write_zeroes))) {
+            return NULL;
+        }
+
+        /* Range segments are device-readable */
+        if (!buf.ro) {
+            return NULL;
+        }
+
+        for (size_t offset = 0; offset < buf.len; offset += sizeof(struct virtio_blk_discard_write_zeroes)) {
+            if (nranges == max_segs) {
+                return NULL;
+            }
+
+            /* Copy segment to avoid TACTOU problems */
+            struct virtio_blk_discard_write_zeroes seg;
+            memcpy(&seg, (uint8_t*)buf.ptr + offset, sizeof(seg));
+
+            if (!seg.num_sectors || seg.num_sectors > max_sectors) {
+                return NULL;
+            }
+
+            if (seg.sector >= vblk->total_sectors || seg.num_sectors > vblk->total_sectors - seg.sector) {
+                return NULL;
+            }
+
+            /* Unmap is the only defined flag and only for write zeroes */
+            if (seg.flags & ~(is_discard ? 0 : VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP)) {
+                return NULL;
+            }
+
+            if (seg.num_sectors > UINT32_MAX - total_sectors) {
+                return NULL;
+            }
+
+            ranges[nranges++] = (struct blk_io_range) {
+                .sector = seg.sector,
+                .num_sectors = seg.num_sectors,
+                .unmap = (seg.flags & VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP) && vblk->write_zeroes_may_unmap,
+            };
+
+            total_sectors += seg.num_sectors;
+        }
+    }
+
+    if (!nranges || !status_buf.ptr) {
+        return NULL;
+    }
+
+    start_blk_io(vblk_io, iter, &status_buf);
+    vblk_io->bio.type = (is_discard ? BLK_IO_DISCARD : BLK_IO_WRITE_ZEROES);
+    vblk_io->bio.sector = ranges[0].sector;
+    vblk_io->bio.total_sectors = total_sectors;
+    vblk_io->bio.nranges = nranges;
+    vblk_io->bio.ranges = ranges;
+    vblk_io->bio.nvecs = 0;
 
     return vblk_io;
 }
@@ -233,7 +689,12 @@ static struct virtio_blk_io* handle_blk_request(struct virtio_blk* vblk, struct
         vblk_io = blk_get_id(vblk, &hdr, iter);
         break;
     case VIRTIO_BLK_T_FLUSH:
-        /* TODO */
+        vblk_io = blk_flush(vblk, &hdr, iter);
+        break;
+    case VIRTIO_BLK_T_DISCARD:
+    case VIRTIO_BLK_T_WRITE_ZEROES:
+        vblk_io = blk_discard_write_zeroes(vblk, &hdr, iter);
+        break;
     default:
         goto drop_request;
     };
@@ -278,6 +739,34 @@ int virtio_blk_dequeue_request(struct virtio_blk* vblk, struct virtqueue* vq, st
     return 0;
 }
 
+int virtio_blk_dequeue_requests(struct virtio_blk* vblk, struct virtqueue* vq, struct blk_io_request** bios, size_t max)
+{
+    if (!vblk || !vq || !bios || !max) {
+        return -EINVAL;
+    }
+
+    if (virtqueue_is_broken(vq)) {
+        return -ENXIO;
+    }
+
+    struct virtqueue_buffer_iter iters[VBLK_MAX_DEQUEUE_BATCH];
+    size_t nchains = virtqueue_dequeue_avail_batch(vq, iters, VHOST_MIN(max, VBLK_MAX_DEQUEUE_BATCH));
+    if (nchains == 0) {
+        return -ENOENT;
+    }
+
+    /* Malformed requests are dropped, so we can return less bios than chains */
+    int nbios = 0;
+    for (size_t i = 0; i < nchains; ++i) {
+        struct virtio_blk_io* vblk_io = handle_blk_request(vblk, &iters[i]);
+        if (vblk_io) {
+            bios[nbios++] = &vblk_io->bio;
+        }
+    }
+
+    return nbios;
+}
+
 void virtio_blk_complete_request(struct virtio_blk* vblk, struct blk_io_request* bio, enum blk_io_status res)
 {
     if (!vblk || !bio) {
@@ -286,3 +775,134 @@ void virtio_blk_complete_request(struct virtio_blk* vblk, struct blk_io_request*
 
     complete_blk_request(vblk, VBLK_IO_FROM_BIO(bio), res);
 }
+
+void virtio_blk_complete_requests(struct virtio_blk* vblk,
+                                  struct blk_io_request** bios,
+                                  const enum blk_io_status* res,
+                                  size_t nbios)
+{
+    if (!vblk || !bios || !res) {
+        return;
+    }
+
+    for (size_t i = 0; i < nbios; ++i) {
+        struct virtio_blk_io* vblk_io = VBLK_IO_FROM_BIO(bios[i]);
+        finish_blk_io(vblk_io, res[i]);
+        virtqueue_stage_used(vblk_io->vq, vblk_io->head, 0);
+    }
+
+    /* Requests can come from different queues, publishing an already published one does nothing */
+    for (size_t i = 0; i < nbios; ++i) {
+        struct virtio_blk_io* vblk_io = VBLK_IO_FROM_BIO(bios[i]);
+        virtqueue_publish_used(vblk_io->vq);
+    }
+}
+
+/* Return completions posted by the backend to the driver, called on the queue's thread */
+static void reap_completions(struct virtio_blk_io_pool* pool)
+{
+    struct virtio_blk_io* top = __atomic_exchange_n(&pool->completed, NULL, __ATOMIC_ACQUIRE);
+    if (!top) {
+        return;
+    }
+
+    /* Stack holds completions newest first, return them to the driver in posting order */
+    struct virtio_blk_io* vblk_io = NULL;
+    while (top) {
+        struct virtio_blk_io* next = top->next_completed;
+        top->next_completed = vblk_io;
+        vblk_io = top;
+        top = next;
+    }
+
+    struct virtqueue* vq = vblk_io->vq;
+    for (; vblk_io; vblk_io = vblk_io->next_completed) {
+        finish_blk_io(vblk_io, vblk_io->status);
+        virtqueue_stage_used(vblk_io->vq, vblk_io->head, 0);
+        pool->inflight--;
+    }
+
+    virtqueue_publish_used(vq);
+}
+
+int virtio_blk_process_queue(struct virtio_blk* vblk, struct virtqueue* vq)
+{
+    if (!vblk || !vq) {
+        return -EINVAL;
+    }
+
+    if (!vblk->backend || !vq->priv) {
+        return -ENXIO;
+    }
+
+    struct virtio_blk_io_pool* pool = vq->priv;
+    reap_completions(pool);
+
+    /* Completions backend posts from submit or poll are reaped below */
+    set_processing(pool, true);
+
+    struct blk_io_request* bios[VBLK_MAX_DEQUEUE_BATCH];
+    while (true) {
+        int nbios = virtio_blk_dequeue_requests(vblk, vq, bios, VBLK_MAX_DEQUEUE_BATCH);
+        if (nbios == -ENOENT) {
+            break;
+        }
+
+        if (nbios < 0) {
+            set_processing(pool, false);
+            return nbios;
+        }
+
+        bool has_failed = false;
+        for (int i = 0; i < nbios; ++i) {
+            struct virtio_blk_io* vblk_io = VBLK_IO_FROM_BIO(bios[i]);
+
+            pool->inflight++;
+            if (vblk->backend->submit(vblk, vq, bios[i]) != 0) {
+                pool->inflight--;
+                finish_blk_io(vblk_io, BLK_IOERROR);
+                virtqueue_stage_used(vq, vblk_io->head, 0);
+                has_failed = true;
+            }
+        }
+
+        if (has_failed) {
+            virtqueue_publish_used(vq);
+        }
+    }
+
+    /* Let backend push out submissions and pick up whatever it has completed */
+    if (vblk->backend->poll) {
+        vblk->backend->poll(vblk, vq);
+    }
+
+    set_processing(pool, false);
+    reap_completions(pool);
+    return 0;
+}
+
+void virtio_blk_post_completion(struct virtio_blk* vblk, struct blk_io_request* bio, enum blk_io_status res)
+{
+    if (!vblk || !bio) {
+        return;
+    }
+
+    struct virtio_blk_io* vblk_io = VBLK_IO_FROM_BIO(bio);
+    struct virtio_blk_io_pool* pool = vblk_io->vq->priv;
+
+    vblk_io->status = res;
+
+    struct virtio_blk_io* top = __atomic_load_n(&pool->completed, __ATOMIC_RELAXED);
+    do {
+        vblk_io->next_completed = top;
+    } while (!__atomic_compare_exchange_n(&pool->completed, &top, vblk_io, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    /*
+     * Queue's thread takes the whole stack, so it only needs a wakeup for the first completion,
+     * and none at all if it is going to reap right after the backend call we are posting from.
+     */
+    if (!top && pool->wakefd >= 0 && !__atomic_load_n(&pool->is_processing, __ATOMIC_SEQ_CST)) {
+        eventfd_write(pool->wakefd, 1);
+    }
+}
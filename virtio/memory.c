@@ -5,6 +5,9 @@
 
 #include "virtio/memory.h"
 
+/* Source of memory map generations, unique across all maps so that a cache can never match a different map */
+static uint64_t g_memory_map_generation;
+
 static bool region_contains_gpa(const struct virtio_memory_region* mr, uint64_t gpa)
 {
     return gpa >= mr->gpa && (mr->gpa + mr->len - 1) >= gpa;
@@ -56,37 +59,62 @@ int virtio_add_guest_region(struct virtio_memory_map* mem, uint64_t gpa, uint64_
 
     /* Make space for new region and insert */
     memmove(&mem->regions[pos + 1], &mem->regions[pos], (mem->num_regions - pos) * sizeof(mr));
+    memmove(&mem->gpa_start[pos + 1], &mem->gpa_start[pos], (mem->num_regions - pos) * sizeof(gpa));
     mem->regions[pos] = mr;
+    mem->gpa_start[pos] = gpa;
     mem->num_regions++;
+    mem->generation = __atomic_add_fetch(&g_memory_map_generation, 1, __ATOMIC_RELAXED);
 
     return 0;
 }
 
-/** Lookup a region that has this gpa and return its index. Otherwise return num_regions. */
-static size_t find_region(const struct virtio_memory_map* mem, uint64_t gpa)
+static size_t find_region(const struct virtio_memory_map* mem, uint64_t gpa);
+
+int virtio_remove_guest_region(struct virtio_memory_map* mem, uint64_t gpa, uint64_t len, struct virtio_memory_region* mr)
 {
-    /* TODO: Since regions are sorted, this can be done by a binary search */
-    for (uint32_t i = 0; i < mem->num_regions; ++i) {
-        if (region_contains_gpa(&mem->regions[i], gpa)) {
-            return i;
-        }
+    assert(mem);
+
+    uint32_t pos = find_region(mem, gpa);
+    if (pos == mem->num_regions || mem->regions[pos].gpa != gpa || mem->regions[pos].len != len) {
+        return -ENOENT;
+    }
+
+    if (mr) {
+        *mr = mem->regions[pos];
     }
 
-    return mem->num_regions;
+    mem->num_regions--;
+    memmove(&mem->regions[pos], &mem->regions[pos + 1], (mem->num_regions - pos) * sizeof(*mem->regions));
+    memmove(&mem->gpa_start[pos], &mem->gpa_start[pos + 1], (mem->num_regions - pos) * sizeof(gpa));
+    mem->generation = __atomic_add_fetch(&g_memory_map_generation, 1, __ATOMIC_RELAXED);
+
+    return 0;
 }
 
-/** Find continously mapped gpa range or return NULL if mapping is invalid */
-void* virtio_find_gpa_range(const struct virtio_memory_map* mem, uint64_t gpa, uint32_t len, bool ro)
+/** Lookup a region that has this gpa and return its index. Otherwise return num_regions. */
+static size_t find_region(const struct virtio_memory_map* mem, uint64_t gpa)
 {
-    if (len == 0) {
-        return MAP_FAILED;
+    uint32_t n = mem->num_regions;
+    const uint64_t* base = mem->gpa_start;
+
+    if (n == 0 || gpa < base[0]) {
+        return mem->num_regions;
     }
 
-    uint32_t region_id = find_region(mem, gpa);
-    if (region_id == mem->num_regions) {
-        return MAP_FAILED;
+    /* Binary search for the last region starting at or below gpa, written so that the compiler can avoid branches */
+    while (n > 1) {
+        uint32_t half = n / 2;
+        base = (base[half] <= gpa ? base + half : base);
+        n -= half;
     }
 
+    size_t i = base - mem->gpa_start;
+    return region_contains_gpa(&mem->regions[i], gpa) ? i : mem->num_regions;
+}
+
+/** Map gpa range starting in region_id, return MAP_FAILED if mapping is invalid */
+static void* map_gpa_range(const struct virtio_memory_map* mem, uint32_t region_id, uint64_t gpa, uint32_t len, bool ro)
+{
     const struct virtio_memory_region* mr = &mem->regions[region_id];
     void* res = (void*) ((uintptr_t) mr->hva + gpa - mr->gpa);
 
@@ -116,3 +144,100 @@ void* virtio_find_gpa_range(const struct virtio_memory_map* mem, uint64_t gpa, u
 
     return len > 0 ? MAP_FAILED : res;
 }
+
+/** Find continously mapped gpa range or return NULL if mapping is invalid */
+void* virtio_find_gpa_range(const struct virtio_memory_map* mem, uint64_t gpa, uint32_t len, bool ro)
+{
+    if (len == 0) {
+        return MAP_FAILED;
+    }
+
+    uint32_t region_id = find_region(mem, gpa);
+    if (region_id == mem->num_regions) {
+        return MAP_FAILED;
+    }
+
+    return map_gpa_range(mem, region_id, gpa, len, ro);
+}
+
+void* virtio_find_gpa_range_cached(const struct virtio_memory_map* mem,
+                                   struct virtio_memory_cache* cache,
+                                   uint64_t gpa,
+                                   uint32_t len,
+                                   bool ro)
+{
+    if (len == 0) {
+        return MAP_FAILED;
+    }
+
+    /* Fast path: whole range fits into the region of the previous lookup */
+    if (cache->generation == mem->generation) {
+        const struct virtio_memory_region* mr = &mem->regions[cache->region_id];
+        if (gpa >= mr->gpa && gpa - mr->gpa < mr->len && len <= mr->len - (gpa - mr->gpa) && (ro || !mr->ro)) {
+            return (void*) ((uintptr_t) mr->hva + gpa - mr->gpa);
+        }
+    }
+
+    uint32_t region_id = find_region(mem, gpa);
+    if (region_id == mem->num_regions) {
+        return MAP_FAILED;
+    }
+
+    cache->generation = mem->generation;
+    cache->region_id = region_id;
+    return map_gpa_range(mem, region_id, gpa, len, ro);
+}
+
+uint64_t virtio_find_hva_gpa(const struct virtio_memory_map* mem, const void* hva, uint64_t* region_len)
+{
+    uintptr_t addr = (uintptr_t) hva;
+
+    /* Regions are sorted by gpa, not hva, so we have to look at all of them */
+    for (uint32_t i = 0; i < mem->num_regions; ++i) {
+        const struct virtio_memory_region* mr = &mem->regions[i];
+        if (addr >= (uintptr_t) mr->hva && addr - (uintptr_t) mr->hva < mr->len) {
+            *region_len = mr->len - (addr - (uintptr_t) mr->hva);
+            return mr->gpa + (addr - (uintptr_t) mr->hva);
+        }
+    }
+
+    return (uint64_t) MAP_FAILED;
+}
+
+void virtio_log_dirty_range(struct virtio_dirty_log* log, uint64_t gpa, uint64_t len)
+{
+    assert(log);
+
+    uint64_t first = gpa >> VIRTIO_LOG_PAGE_SHIFT;
+    if (len == 0 || first >= log->npages) {
+        return;
+    }
+
+    uint64_t last = (len - 1 > UINT64_MAX - gpa ? UINT64_MAX : gpa + len - 1) >> VIRTIO_LOG_PAGE_SHIFT;
+    if (last >= log->npages) {
+        last = log->npages - 1;
+    }
+
+    /*
+     * Master clears the bits it has seen and then copies the pages.
+     * Our writes have to be visible before we look at the bits, otherwise we can skip a bit
+     * master has just cleared while it copies the page contents we have not yet exposed.
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    for (uint64_t page = first; page <= last; ) {
+        uint64_t* word = &log->bitmap[page / 64];
+        uint32_t bit = page % 64;
+        uint64_t nbits = 64 - bit;
+        if (nbits > last - page + 1) {
+            nbits = last - page + 1;
+        }
+
+        uint64_t mask = (nbits == 64 ? ~0ull : ((1ull << nbits) - 1) << bit);
+        if ((__atomic_load_n(word, __ATOMIC_RELAXED) & mask) != mask) {
+            __atomic_fetch_or(word, mask, __ATOMIC_RELAXED);
+        }
+
+        page += nbits;
+    }
+}
@@ -10,6 +10,21 @@ static inline void virtio_mb()
     asm volatile ("mfence" ::: "memory");
 }
 
+/*
+ * x86 does not reorder loads with other loads and stores with other stores,
+ * so read and write barriers only need to stop the compiler.
+ */
+
+static inline void virtio_rmb()
+{
+    asm volatile ("" ::: "memory");
+}
+
+static inline void virtio_wmb()
+{
+    asm volatile ("" ::: "memory");
+}
+
 static inline uint16_t* get_used_event(struct virtqueue* vq)
 {
     return (void*) &vq->avail->ring[vq->qsize];
@@ -20,10 +35,31 @@ static inline uint16_t* get_avail_event(struct virtqueue* vq)
     return (void*) &vq->used->ring[vq->qsize];
 }
 
+static inline uint32_t used_ring_size(uint16_t qsize)
+{
+    return sizeof(struct virtq_used) + sizeof(struct virtq_used_elem) * qsize + 2 /* for avail_event */;
+}
+
+/** Log our updates to the rings, which all go to the used ring area or packed ring and its device event area */
+static void log_ring_writes(struct virtqueue* vq)
+{
+    if (!vq->log) {
+        return;
+    }
+
+    if (vq->is_packed) {
+        virtio_log_dirty_range(vq->log, vq->desc_gpa, sizeof(struct pvirtq_desc) * vq->qsize);
+        virtio_log_dirty_range(vq->log, vq->used_gpa, sizeof(struct pvirtq_event_suppress));
+    } else {
+        virtio_log_dirty_range(vq->log, vq->used_gpa, used_ring_size(vq->qsize));
+    }
+}
+
 /** Update avail event to latest seen avail idx value to always get driver notifications */
 static inline void update_avail_event(struct virtqueue* vq)
 {
-    if (!vq->has_event_idx) {
+    /* Avail event is left behind while device is polling the queue */
+    if (!vq->has_event_idx || vq->notify_disabled) {
         return;
     }
 
@@ -31,35 +67,22 @@ static inline void update_avail_event(struct virtqueue* vq)
 
     /* Make sure driver sees the update before checking avail idx */
     virtio_mb();
+    log_ring_writes(vq);
 }
 
-int virtqueue_start(struct virtqueue* vq,
-                    uint16_t qsize,
-                    uint64_t desc_gpa,
-                    uint64_t avail_gpa,
-                    uint64_t used_gpa,
-                    uint16_t avail_base,
-                    int callfd,
-                    bool has_event_idx,
-                    struct virtio_memory_map* mem)
+static int start_split(struct virtqueue* vq,
+                       uint16_t qsize,
+                       uint64_t desc_gpa,
+                       uint64_t avail_gpa,
+                       uint64_t used_gpa,
+                       uint16_t avail_base,
+                       struct virtio_memory_map* mem)
 {
-    if (!vq) {
-        return -EINVAL;
-    }
-
-    if (!mem) {
-        return -EINVAL;
-    }
-
     /*
      * 2.4 Virtqueues: "Queue size is always a power of 2"
      */
 
-    if (!qsize || qsize & (qsize - 1)) {
-        return -EINVAL;
-    }
-
-    if (qsize > VIRTQ_MAX_SIZE) {
+    if (qsize & (qsize - 1)) {
         return -EINVAL;
     }
 
@@ -75,8 +98,7 @@ int virtqueue_start(struct virtqueue* vq,
         return -EINVAL;
     }
 
-    uint32_t used_size = sizeof(struct virtq_used) + sizeof(struct virtq_used_elem) * qsize + 2 /* for avail_event */;
-    struct virtq_used* pused = virtio_find_gpa_range(mem, used_gpa, used_size, false);
+    struct virtq_used* pused = virtio_find_gpa_range(mem, used_gpa, used_ring_size(qsize), false);
     if (pused == MAP_FAILED || !VIRTQ_IS_ALIGNED_PTR(pused, VIRTQ_USED_ALIGNMENT)) {
         return -EINVAL;
     }
@@ -84,12 +106,7 @@ int virtqueue_start(struct virtqueue* vq,
     vq->desc = pdesc;
     vq->avail = pavail;
     vq->used = pused;
-    vq->qsize = qsize;
     vq->last_seen_avail = avail_base;
-    vq->is_broken = false;
-    vq->mem = mem;
-    vq->callfd = callfd;
-    vq->has_event_idx = has_event_idx;
 
     /* We are always interested in driver events */
     vq->used->flags = 0;
@@ -98,6 +115,289 @@ int virtqueue_start(struct virtqueue* vq,
     return 0;
 }
 
+static int start_packed(struct virtqueue* vq,
+                        uint16_t qsize,
+                        uint64_t desc_gpa,
+                        uint64_t driver_gpa,
+                        uint64_t device_gpa,
+                        uint16_t avail_base,
+                        struct virtio_memory_map* mem)
+{
+    /*
+     * 2.7.10.1 Structure Size and Alignment:
+     * Queue Size value does not have to be a power of 2.
+     */
+
+    uint16_t avail_idx = avail_base & ~(1u << 15);
+    if (avail_idx >= qsize) {
+        return -EINVAL;
+    }
+
+    uint32_t desc_size = sizeof(struct pvirtq_desc) * qsize;
+    struct pvirtq_desc* pdesc = virtio_find_gpa_range(mem, desc_gpa, desc_size, false);
+    if (pdesc == MAP_FAILED || !VIRTQ_IS_ALIGNED_PTR(pdesc, VIRTQ_PACKED_DESC_ALIGNMENT)) {
+        return -EINVAL;
+    }
+
+    uint32_t event_size = sizeof(struct pvirtq_event_suppress);
+    struct pvirtq_event_suppress* pdriver = virtio_find_gpa_range(mem, driver_gpa, event_size, false);
+    if (pdriver == MAP_FAILED || !VIRTQ_IS_ALIGNED_PTR(pdriver, VIRTQ_PACKED_EVENT_ALIGNMENT)) {
+        return -EINVAL;
+    }
+
+    struct pvirtq_event_suppress* pdevice = virtio_find_gpa_range(mem, device_gpa, event_size, false);
+    if (pdevice == MAP_FAILED || !VIRTQ_IS_ALIGNED_PTR(pdevice, VIRTQ_PACKED_EVENT_ALIGNMENT)) {
+        return -EINVAL;
+    }
+
+    vq->pdesc = pdesc;
+    vq->driver_event = pdriver;
+    vq->device_event = pdevice;
+
+    /* Nothing is in-flight when we start, so used position follows avail position */
+    vq->last_seen_avail = avail_idx;
+    vq->avail_wrap_counter = (avail_base >> 15) != 0;
+    vq->next_used = avail_idx;
+    vq->used_wrap_counter = vq->avail_wrap_counter;
+    vq->signalled_used_idx = avail_idx;
+    vq->chain_lens = vhost_calloc(qsize, sizeof(*vq->chain_lens));
+
+    /* We are always interested in driver events, so we never have to update this again */
+    vq->device_event->flags = RING_EVENT_FLAGS_ENABLE;
+
+    return 0;
+}
+
+int virtqueue_start(struct virtqueue* vq,
+                    uint16_t qsize,
+                    uint64_t desc_gpa,
+                    uint64_t avail_gpa,
+                    uint64_t used_gpa,
+                    uint16_t avail_base,
+                    int callfd,
+                    uint64_t features,
+                    struct virtio_memory_map* mem)
+{
+    if (!vq) {
+        return -EINVAL;
+    }
+
+    if (!mem) {
+        return -EINVAL;
+    }
+
+    if (!qsize || qsize > VIRTQ_MAX_SIZE) {
+        return -EINVAL;
+    }
+
+    vq->qsize = qsize;
+    vq->is_broken = false;
+    vq->mem = mem;
+    vq->mem_cache = VIRTIO_INIT_MEMORY_CACHE;
+    vq->log = NULL;
+    vq->desc_gpa = desc_gpa;
+    vq->used_gpa = used_gpa;
+    vq->callfd = callfd;
+    vq->has_event_idx = (features & (1ull << VIRTIO_F_EVENT_IDX)) != 0;
+    vq->is_packed = (features & (1ull << VIRTIO_F_RING_PACKED)) != 0;
+    vq->signalled_used_idx = 0;
+    vq->nstaged_used = 0;
+    vq->chain_lens = NULL;
+    vq->inflight = NULL;
+    vq->inflight_batch_head = 0;
+    vq->resubmit_list = NULL;
+    vq->resubmit_num = 0;
+    vq->resubmit_pos = 0;
+    vq->priv = NULL;
+    vq->notify_disabled = false;
+
+    if (vq->is_packed) {
+        return start_packed(vq, qsize, desc_gpa, avail_gpa, used_gpa, avail_base, mem);
+    } else {
+        return start_split(vq, qsize, desc_gpa, avail_gpa, used_gpa, avail_base, mem);
+    }
+}
+
+void virtqueue_set_memory_map(struct virtqueue* vq, struct virtio_memory_map* mem)
+{
+    VHOST_VERIFY(vq);
+    VHOST_VERIFY(mem);
+
+    vq->mem = mem;
+    vq->mem_cache = VIRTIO_INIT_MEMORY_CACHE;
+}
+
+void virtqueue_set_dirty_log(struct virtqueue* vq, struct virtio_dirty_log* log)
+{
+    VHOST_VERIFY(vq);
+
+    vq->log = log;
+
+    /* Master needs the rings in the log as a whole, not just what we write to them from now on */
+    log_ring_writes(vq);
+}
+
+void virtqueue_log_write(struct virtqueue* vq, uint64_t gpa, size_t len)
+{
+    VHOST_VERIFY(vq);
+
+    /* Buffer gpa comes from the descriptor we've mapped it from, so there is nothing to look up */
+    if (vq->log) {
+        virtio_log_dirty_range(vq->log, gpa, len);
+    }
+}
+
+bool virtq_inflight_has_chains(const struct virtq_inflight* inflight, uint16_t qsize)
+{
+    VHOST_VERIFY(inflight);
+
+    /* Region is shared with master, don't trust its size beyond what we have mapped */
+    if (inflight->version != VIRTQ_INFLIGHT_VERSION || inflight->desc_num != qsize) {
+        return false;
+    }
+
+    for (uint16_t i = 0; i < inflight->desc_num; ++i) {
+        if (inflight->desc[i].inflight) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void free_resubmit_list(struct virtqueue* vq)
+{
+    vhost_free(vq->resubmit_list);
+    vq->resubmit_list = NULL;
+    vq->resubmit_num = 0;
+    vq->resubmit_pos = 0;
+}
+
+struct inflight_chain
+{
+    uint64_t counter;
+    uint16_t head;
+};
+
+static int compare_inflight_chains(const void* a, const void* b)
+{
+    const struct inflight_chain* ca = a;
+    const struct inflight_chain* cb = b;
+    return (ca->counter > cb->counter) - (ca->counter < cb->counter);
+}
+
+int virtqueue_set_inflight(struct virtqueue* vq, struct virtq_inflight* inflight)
+{
+    VHOST_VERIFY(vq);
+
+    free_resubmit_list(vq);
+    vq->inflight = NULL;
+    vq->inflight_counter = 0;
+    vq->inflight_batch_head = 0;
+
+    if (!inflight) {
+        return 0;
+    }
+
+    if (vq->is_packed) {
+        return -ENOTSUP;
+    }
+
+    uint16_t used_idx = vq->used->idx;
+
+    /* Fresh region, nothing could have been left inflight */
+    if (inflight->version == 0) {
+        inflight->desc_num = vq->qsize;
+        inflight->used_idx = used_idx;
+        virtio_wmb();
+        inflight->version = VIRTQ_INFLIGHT_VERSION;
+        vq->inflight = inflight;
+        return 0;
+    }
+
+    if (inflight->version != VIRTQ_INFLIGHT_VERSION || inflight->desc_num != vq->qsize) {
+        return -EINVAL;
+    }
+
+    /*
+     * Previous instance went away after publishing its last used batch but before it cleared it.
+     * Driver already has those chains back, so they are not inflight anymore.
+     */
+    uint16_t npublished = used_idx - inflight->used_idx;
+    if (npublished > vq->qsize) {
+        return -EINVAL;
+    }
+
+    uint16_t id = inflight->last_batch_head;
+    for (uint16_t i = 0; i < npublished; ++i) {
+        if (id >= vq->qsize) {
+            return -EINVAL;
+        }
+
+        inflight->desc[id].inflight = 0;
+        id = inflight->desc[id].next;
+    }
+
+    virtio_wmb();
+    inflight->used_idx = used_idx;
+
+    /* Whatever is still marked inflight has to be handled again, in the order it was dequeued */
+    uint16_t ninflight = 0;
+    for (uint16_t i = 0; i < vq->qsize; ++i) {
+        ninflight += (inflight->desc[i].inflight != 0);
+    }
+
+    if (ninflight) {
+        struct inflight_chain* chains = vhost_calloc(ninflight, sizeof(*chains));
+        uint16_t n = 0;
+        for (uint16_t i = 0; i < vq->qsize; ++i) {
+            if (inflight->desc[i].inflight) {
+                chains[n++] = (struct inflight_chain){ inflight->desc[i].counter, i };
+            }
+        }
+
+        qsort(chains, ninflight, sizeof(*chains), compare_inflight_chains);
+
+        vq->resubmit_list = vhost_calloc(ninflight, sizeof(*vq->resubmit_list));
+        for (n = 0; n < ninflight; ++n) {
+            vq->resubmit_list[n] = chains[n].head;
+        }
+
+        vq->resubmit_num = ninflight;
+        vq->inflight_counter = chains[ninflight - 1].counter + 1;
+        vhost_free(chains);
+    }
+
+    /* Driver made available exactly what it got back plus what we still hold */
+    vq->last_seen_avail = used_idx + ninflight;
+    vq->inflight = inflight;
+    update_avail_event(vq);
+
+    return ninflight;
+}
+
+void virtqueue_stop(struct virtqueue* vq)
+{
+    VHOST_VERIFY(vq);
+
+    vhost_free(vq->chain_lens);
+    vq->chain_lens = NULL;
+
+    free_resubmit_list(vq);
+    vq->inflight = NULL;
+}
+
+uint16_t virtqueue_get_avail_base(const struct virtqueue* vq)
+{
+    VHOST_VERIFY(vq);
+
+    if (vq->is_packed) {
+        return vq->last_seen_avail | ((uint16_t)vq->avail_wrap_counter << 15);
+    }
+
+    return vq->last_seen_avail;
+}
+
 static inline void mark_broken(struct virtqueue* vq)
 {
     vq->is_broken = true;
@@ -112,7 +412,7 @@ bool virtqueue_is_broken(struct virtqueue* vq)
  * Not that on failure we return MAP_FAILED and not NULL */
 static void* map_buffer(struct virtqueue* vq, const struct virtq_desc* desc)
 {
-    return virtio_find_gpa_range(vq->mem, desc->addr, desc->len, (desc->flags & VIRTQ_DESC_F_WRITE) == 0);
+    return virtio_find_gpa_range_cached(vq->mem, &vq->mem_cache, desc->addr, desc->len, (desc->flags & VIRTQ_DESC_F_WRITE) == 0);
 }
 
 static inline uint16_t get_index(const struct virtqueue* vq, uint16_t idx)
@@ -160,20 +460,27 @@ static void start_desc_chain(struct virtqueue_buffer_iter* iter, struct virtqueu
     iter->tbl_size = vq->qsize;
     iter->is_indirect = false;
     iter->nseen = 0;
+    iter->chain_len = 0;
 }
 
-bool virtqueue_next_buffer(struct virtqueue_buffer_iter* iter, struct virtqueue_buffer* buf)
+static void start_packed_desc_chain(struct virtqueue_buffer_iter* iter,
+                                    struct virtqueue* vq,
+                                    uint16_t pos,
+                                    uint16_t id,
+                                    uint16_t chain_len)
 {
-    VHOST_VERIFY(iter);
-    VHOST_VERIFY(buf);
-
-    if (virtqueue_is_broken(iter->vq)) {
-        return false;
-    }
+    iter->vq = vq;
+    iter->head = id;
+    iter->cur = pos;
+    iter->pptbl = vq->pdesc;
+    iter->tbl_size = vq->qsize;
+    iter->is_indirect = false;
+    iter->nseen = 0;
+    iter->chain_len = chain_len;
+}
 
-    if (iter->cur == VIRTQ_INVALID_DESC_ID) {
-        return false;
-    }
+static bool next_buffer_split(struct virtqueue_buffer_iter* iter, struct virtqueue_buffer* buf)
+{
 
     struct virtq_desc* pcur = &iter->ptbl[iter->cur];
 
@@ -238,30 +545,118 @@ bool virtqueue_next_buffer(struct virtqueue_buffer_iter* iter, struct virtqueue_
         goto mark_broken;
     }
 
+    /* Buffer must match what we've mapped, so work on a copy driver can't change under us */
+    struct virtq_desc desc = *pcur;
+
     /*
      * Spec does not say anything about how we should treat 0-length descriptors.
      * We choose to break things immediately.
      */
-    if (pcur->len == 0) {
+    if (desc.len == 0) {
         goto mark_broken;
     }
 
-    void* hva = map_buffer(iter->vq, pcur);
+    void* hva = map_buffer(iter->vq, &desc);
     if (hva == MAP_FAILED) {
         goto mark_broken;
     }
 
     /* On x86 things cannot be write-only, so we have to ignore the exact virtio definition here */
-    buf->ro = ((pcur->flags & VIRTQ_DESC_F_WRITE) == 0);
+    buf->ro = ((desc.flags & VIRTQ_DESC_F_WRITE) == 0);
+    buf->ptr = hva;
+    buf->len = desc.len;
+    buf->gpa = desc.addr;
+
+    if (desc.flags & VIRTQ_DESC_F_NEXT) {
+        if (desc.next >= iter->tbl_size) {
+            goto mark_broken;
+        }
+
+        iter->cur = desc.next;
+    } else {
+        iter->cur = VIRTQ_INVALID_DESC_ID;
+    }
+
+    return true;
+
+mark_broken:
+    mark_broken(iter->vq);
+    iter->cur = VIRTQ_INVALID_DESC_ID;
+    return false;
+}
+
+static bool next_buffer_packed(struct virtqueue_buffer_iter* iter, struct virtqueue_buffer* buf)
+{
+    /* Work on a copy of the descriptor, driver can't change it under us this way */
+    struct pvirtq_desc desc = iter->pptbl[iter->cur];
+
+    if (desc.flags & VIRTQ_DESC_F_INDIRECT) {
+
+        /*
+         * 2.7.7.1 Driver Requirements: Indirect Descriptors:
+         * The driver MUST NOT set the VIRTQ_DESC_F_INDIRECT flag within an indirect descriptor
+         * (ie. only one table per descriptor).
+         * A driver MUST NOT set both VIRTQ_DESC_F_INDIRECT and VIRTQ_DESC_F_NEXT in flags.
+         */
+
+        if (iter->is_indirect || (desc.flags & VIRTQ_DESC_F_NEXT)) {
+            goto mark_broken;
+        }
+
+        if ((desc.len / sizeof(desc)) == 0) {
+            goto mark_broken;
+        }
+
+        void* hva = virtio_find_gpa_range_cached(iter->vq->mem, &iter->vq->mem_cache, desc.addr, desc.len, true);
+        if (hva == MAP_FAILED) {
+            goto mark_broken;
+        }
+
+        /* Indirect table descriptors are laid out sequentially, there are no next pointers */
+        iter->is_indirect = true;
+        iter->pptbl = hva;
+        iter->tbl_size = desc.len / sizeof(desc);
+        iter->cur = 0;
+        iter->nseen++;
+
+        desc = iter->pptbl[0];
+        if (desc.flags & VIRTQ_DESC_F_INDIRECT) {
+            goto mark_broken;
+        }
+    }
+
+    iter->nseen++;
+    if (iter->nseen > iter->vq->qsize) {
+        goto mark_broken;
+    }
+
+    if (desc.len == 0) {
+        goto mark_broken;
+    }
+
+    void* hva = virtio_find_gpa_range_cached(iter->vq->mem, &iter->vq->mem_cache, desc.addr, desc.len, (desc.flags & VIRTQ_DESC_F_WRITE) == 0);
+    if (hva == MAP_FAILED) {
+        goto mark_broken;
+    }
+
+    buf->ro = ((desc.flags & VIRTQ_DESC_F_WRITE) == 0);
     buf->ptr = hva;
-    buf->len = pcur->len;
+    buf->len = desc.len;
+    buf->gpa = desc.addr;
 
-    if (pcur->flags & VIRTQ_DESC_F_NEXT) {
-        if (pcur->next >= iter->tbl_size) {
+    if (iter->is_indirect) {
+        if (++iter->cur == iter->tbl_size) {
+            iter->cur = VIRTQ_INVALID_DESC_ID;
+        }
+    } else if (desc.flags & VIRTQ_DESC_F_NEXT) {
+        /* Driver has changed the chain after we've made it available */
+        if (iter->nseen >= iter->chain_len) {
             goto mark_broken;
         }
 
-        iter->cur = pcur->next;
+        if (++iter->cur == iter->tbl_size) {
+            iter->cur = 0;
+        }
     } else {
         iter->cur = VIRTQ_INVALID_DESC_ID;
     }
@@ -274,6 +669,26 @@ mark_broken:
     return false;
 }
 
+bool virtqueue_next_buffer(struct virtqueue_buffer_iter* iter, struct virtqueue_buffer* buf)
+{
+    VHOST_VERIFY(iter);
+    VHOST_VERIFY(buf);
+
+    if (virtqueue_is_broken(iter->vq)) {
+        return false;
+    }
+
+    if (iter->cur == VIRTQ_INVALID_DESC_ID) {
+        return false;
+    }
+
+    if (iter->vq->is_packed) {
+        return next_buffer_packed(iter, buf);
+    } else {
+        return next_buffer_split(iter, buf);
+    }
+}
+
 bool virtqueue_has_next_buffer(struct virtqueue_buffer_iter* iter)
 {
     if (!iter) {
@@ -288,22 +703,222 @@ void virtqueue_release_buffers(struct virtqueue_buffer_iter* iter, uint32_t nwri
     virtqueue_enqueue_used(iter->vq, iter->head, nwritten);
 }
 
-bool virtqueue_dequeue_avail(struct virtqueue* vq, struct virtqueue_buffer_iter* chain)
+static size_t dequeue_resubmit(struct virtqueue* vq, struct virtqueue_buffer_iter* chains, size_t max)
 {
-    if (virtqueue_is_broken(vq)) {
-        return false;
+    size_t i;
+    for (i = 0; i < max && vq->resubmit_pos < vq->resubmit_num; ++i) {
+        start_desc_chain(&chains[i], vq, vq->resubmit_list[vq->resubmit_pos++]);
+    }
+
+    if (vq->resubmit_pos == vq->resubmit_num) {
+        free_resubmit_list(vq);
+    }
+
+    return i;
+}
+
+static inline void mark_inflight(struct virtqueue* vq, uint16_t head)
+{
+    if (vq->inflight) {
+        vq->inflight->desc[head].counter = vq->inflight_counter++;
+        vq->inflight->desc[head].inflight = 1;
+    }
+}
+
+static size_t dequeue_avail_split(struct virtqueue* vq, struct virtqueue_buffer_iter* chains, size_t max)
+{
+    size_t nresubmit = 0;
+    if (vq->resubmit_list) {
+        nresubmit = dequeue_resubmit(vq, chains, max);
+        chains += nresubmit;
+        max -= nresubmit;
+    }
+
+    uint16_t navail = read_avail_idx(vq) - vq->last_seen_avail;
+    size_t count = VHOST_MIN(navail, max);
+    if (count == 0) {
+        return nresubmit;
     }
 
-    if (vq->last_seen_avail != read_avail_idx(vq)) {
+    /* Don't read avail ring entries before we see avail idx */
+    virtio_rmb();
+
+    size_t i;
+    for (i = 0; i < count; ++i) {
         uint16_t head = vq->avail->ring[get_index(vq, vq->last_seen_avail)];
-        start_desc_chain(chain, vq, head);
+        if (head >= vq->qsize) {
+            mark_broken(vq);
+            break;
+        }
 
+        start_desc_chain(&chains[i], vq, head);
+        mark_inflight(vq, head);
         vq->last_seen_avail++;
-        update_avail_event(vq);
+    }
+
+    /* Publish avail event once for the whole batch */
+    update_avail_event(vq);
+    return nresubmit + i;
+}
+
+/** Advance packed ring position by count entries, flipping the wrap counter when we wrap around */
+static inline uint16_t advance_packed_pos(const struct virtqueue* vq, uint16_t pos, uint16_t count, bool* wrap_counter)
+{
+    pos += count;
+    if (pos >= vq->qsize) {
+        pos -= vq->qsize;
+        *wrap_counter = !*wrap_counter;
+    }
+
+    return pos;
+}
+
+static inline bool is_desc_avail(uint16_t flags, bool wrap_counter)
+{
+    return wrap_counter == ((flags & VIRTQ_DESC_F_AVAIL) != 0) &&
+           wrap_counter != ((flags & VIRTQ_DESC_F_USED) != 0);
+}
+
+static bool dequeue_one_packed(struct virtqueue* vq, struct virtqueue_buffer_iter* chain)
+{
+    uint16_t pos = vq->last_seen_avail;
+    if (!is_desc_avail(vq->pdesc[pos].flags, vq->avail_wrap_counter)) {
+        return false;
+    }
+
+    /* Don't read the rest of the chain before we see head flags */
+    virtio_rmb();
+
+    /*
+     * Find where the chain ends to learn its buffer id, which is only valid in the last descriptor.
+     * Chain is located in the ring in order and can't be longer than the ring itself.
+     */
+
+    uint16_t chain_len = 1;
+    while (vq->pdesc[pos].flags & VIRTQ_DESC_F_NEXT) {
+        if (chain_len == vq->qsize) {
+            mark_broken(vq);
+            return false;
+        }
+
+        if (++pos == vq->qsize) {
+            pos = 0;
+        }
+
+        chain_len++;
+    }
+
+    uint16_t id = vq->pdesc[pos].id;
+    if (id >= vq->qsize) {
+        mark_broken(vq);
+        return false;
+    }
+
+    start_packed_desc_chain(chain, vq, vq->last_seen_avail, id, chain_len);
+
+    vq->chain_lens[id] = chain_len;
+    vq->last_seen_avail = advance_packed_pos(vq, vq->last_seen_avail, chain_len, &vq->avail_wrap_counter);
+    return true;
+}
+
+static size_t dequeue_avail_packed(struct virtqueue* vq, struct virtqueue_buffer_iter* chains, size_t max)
+{
+    size_t i;
+    for (i = 0; i < max; ++i) {
+        if (!dequeue_one_packed(vq, &chains[i])) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+size_t virtqueue_dequeue_avail_batch(struct virtqueue* vq, struct virtqueue_buffer_iter* chains, size_t max)
+{
+    if (virtqueue_is_broken(vq) || max == 0) {
+        return 0;
+    }
+
+    if (vq->is_packed) {
+        return dequeue_avail_packed(vq, chains, max);
+    } else {
+        return dequeue_avail_split(vq, chains, max);
+    }
+}
+
+bool virtqueue_dequeue_avail(struct virtqueue* vq, struct virtqueue_buffer_iter* chain)
+{
+    return virtqueue_dequeue_avail_batch(vq, chain, 1) != 0;
+}
+
+bool virtqueue_has_avail(struct virtqueue* vq)
+{
+    VHOST_VERIFY(vq);
+
+    if (virtqueue_is_broken(vq)) {
+        return false;
+    }
+
+    if (vq->resubmit_list) {
         return true;
     }
 
-    return false;
+    /* This is polled in a loop, make sure we always reread guest memory */
+    if (vq->is_packed) {
+        uint16_t flags = *(volatile le16*) &vq->pdesc[vq->last_seen_avail].flags;
+        return is_desc_avail(flags, vq->avail_wrap_counter);
+    } else {
+        return *(volatile le16*) &vq->avail->idx != vq->last_seen_avail;
+    }
+}
+
+void virtqueue_disable_notifications(struct virtqueue* vq)
+{
+    VHOST_VERIFY(vq);
+
+    if (vq->notify_disabled) {
+        return;
+    }
+
+    vq->notify_disabled = true;
+
+    if (vq->is_packed) {
+        vq->device_event->flags = RING_EVENT_FLAGS_DISABLE;
+    } else if (vq->has_event_idx) {
+        /*
+         * Driver ignores VIRTQ_USED_F_NO_NOTIFY with VIRTIO_F_EVENT_IDX.
+         * Put avail event behind the avail idx we've seen, so that driver will not
+         * cross it until avail idx wraps around. Dequeue leaves it there until we enable notifications.
+         */
+        *get_avail_event(vq) = vq->last_seen_avail - 1;
+    } else {
+        vq->used->flags = VIRTQ_USED_F_NO_NOTIFY;
+    }
+
+    log_ring_writes(vq);
+}
+
+bool virtqueue_enable_notifications(struct virtqueue* vq)
+{
+    VHOST_VERIFY(vq);
+
+    if (vq->notify_disabled) {
+        vq->notify_disabled = false;
+
+        if (vq->is_packed) {
+            vq->device_event->flags = RING_EVENT_FLAGS_ENABLE;
+        } else if (vq->has_event_idx) {
+            *get_avail_event(vq) = vq->last_seen_avail;
+        } else {
+            vq->used->flags = 0;
+        }
+
+        log_ring_writes(vq);
+    }
+
+    /* Driver could have made buffers available before it saw our update */
+    virtio_mb();
+    return virtqueue_has_avail(vq);
 }
 
 /* The following is used with USED_EVENT_IDX and AVAIL_EVENT_IDX */
@@ -332,21 +947,166 @@ static bool should_notify_used(struct virtqueue* vq, uint16_t used_idx)
     }
 }
 
-void virtqueue_enqueue_used(struct virtqueue* vq, uint16_t desc_id, uint32_t nwritten)
+/** Check if we should notify driver of used buffers in packed layout */
+static bool should_notify_used_packed(struct virtqueue* vq, uint16_t old_pos, uint16_t new_pos)
 {
-    uint16_t used_idx = read_used_idx(vq);
-    vq->used->ring[get_index(vq, used_idx)] = (struct virtq_used_elem) { desc_id, nwritten };
+    uint16_t flags = vq->driver_event->flags;
+    if (flags != RING_EVENT_FLAGS_DESC || !vq->has_event_idx) {
+        return flags != RING_EVENT_FLAGS_DISABLE;
+    }
+
+    /* Bring event offset and old position into the same wrap as new position */
+    uint16_t off_wrap = vq->driver_event->off_wrap;
+    uint16_t event_idx = off_wrap & ~(1u << 15);
+    if (new_pos <= old_pos) {
+        old_pos -= vq->qsize;
+    }
+
+    if (vq->used_wrap_counter != (off_wrap >> 15)) {
+        event_idx -= vq->qsize;
+    }
+
+    return vring_need_event(event_idx, new_pos, old_pos);
+}
+
+static void notify_driver(struct virtqueue* vq)
+{
+    if (vq->callfd != -1) {
+        eventfd_write(vq->callfd, 1);
+    }
+}
+
+static void stage_used_split(struct virtqueue* vq, uint16_t desc_id, uint32_t nwritten)
+{
+    if (vq->nstaged_used == 0) {
+        vq->staged_used_idx = read_used_idx(vq);
+    }
+
+    vq->used->ring[get_index(vq, vq->staged_used_idx)] = (struct virtq_used_elem) { desc_id, nwritten };
+    vq->staged_used_idx++;
+
+    /* Link staged elements so that a restarted device can tell which chains the batch has returned */
+    if (vq->inflight) {
+        vq->inflight->desc[desc_id].next = vq->inflight_batch_head;
+        vq->inflight_batch_head = desc_id;
+    }
+}
+
+/** Chains of the published batch are not inflight anymore */
+static void clear_inflight_batch(struct virtqueue* vq, uint16_t used_idx)
+{
+    uint16_t id = vq->inflight_batch_head;
+    for (uint16_t i = 0; i < vq->nstaged_used; ++i) {
+        vq->inflight->desc[id].inflight = 0;
+        id = vq->inflight->desc[id].next;
+    }
+
+    virtio_wmb();
+    vq->inflight->used_idx = used_idx;
+}
+
+static void publish_used_split(struct virtqueue* vq)
+{
+    uint16_t used_idx = vq->staged_used_idx;
+
+    /* If we go away before we clear the batch, restarted device will find it by used idx */
+    if (vq->inflight) {
+        vq->inflight->last_batch_head = vq->inflight_batch_head;
+        virtio_wmb();
+    }
 
-    used_idx++;
     write_used_idx(vq, used_idx);
 
+    if (vq->inflight) {
+        virtio_wmb();
+        clear_inflight_batch(vq, used_idx);
+    }
+
     /* Make sure we expose used_idx before checking notification mask/event idx */
     virtio_mb();
     if (should_notify_used(vq, used_idx)) {
-        if (vq->callfd != -1) {
-            eventfd_write(vq->callfd, 0);
-        }
-
+        notify_driver(vq);
         vq->signalled_used_idx = used_idx;
     }
 }
+
+static void stage_used_packed(struct virtqueue* vq, uint16_t desc_id, uint32_t nwritten)
+{
+    VHOST_VERIFY(desc_id < vq->qsize);
+
+    /*
+     * 2.7.8 Next Flag: Descriptor Chaining:
+     * Used element is written over the first descriptor of the chain position
+     * and the whole chain is skipped by both driver and device.
+     */
+
+    struct pvirtq_desc* pdesc = &vq->pdesc[vq->next_used];
+    pdesc->id = desc_id;
+    pdesc->len = nwritten;
+
+    uint16_t flags = vq->used_wrap_counter ? (VIRTQ_DESC_F_AVAIL | VIRTQ_DESC_F_USED) : 0;
+
+    /*
+     * Driver consumes used elements in ring order, so we hold back flags of the first staged element
+     * until publish time and the rest of the batch can be exposed right away.
+     */
+    if (vq->nstaged_used == 0) {
+        vq->staged_head = vq->next_used;
+        vq->staged_head_flags = flags;
+    } else {
+        /* Driver must see id and len before it sees used flags */
+        virtio_wmb();
+        pdesc->flags = flags;
+    }
+
+    vq->next_used = advance_packed_pos(vq, vq->next_used, vq->chain_lens[desc_id], &vq->used_wrap_counter);
+}
+
+static void publish_used_packed(struct virtqueue* vq)
+{
+    virtio_wmb();
+    vq->pdesc[vq->staged_head].flags = vq->staged_head_flags;
+
+    uint16_t old_pos = vq->signalled_used_idx;
+    vq->signalled_used_idx = vq->next_used;
+
+    /* Make sure we expose used descriptors before checking driver event suppression */
+    virtio_mb();
+    if (should_notify_used_packed(vq, old_pos, vq->next_used)) {
+        notify_driver(vq);
+    }
+}
+
+void virtqueue_stage_used(struct virtqueue* vq, uint16_t desc_id, uint32_t nwritten)
+{
+    if (vq->is_packed) {
+        stage_used_packed(vq, desc_id, nwritten);
+    } else {
+        stage_used_split(vq, desc_id, nwritten);
+    }
+
+    vq->nstaged_used++;
+}
+
+void virtqueue_publish_used(struct virtqueue* vq)
+{
+    if (vq->nstaged_used == 0) {
+        return;
+    }
+
+    if (vq->is_packed) {
+        publish_used_packed(vq);
+    } else {
+        publish_used_split(vq);
+    }
+
+    /* Whole batch of used ring updates is logged at once */
+    log_ring_writes(vq);
+    vq->nstaged_used = 0;
+}
+
+void virtqueue_enqueue_used(struct virtqueue* vq, uint16_t desc_id, uint32_t nwritten)
+{
+    virtqueue_stage_used(vq, desc_id, nwritten);
+    virtqueue_publish_used(vq);
+}
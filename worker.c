@@ -0,0 +1,129 @@
+/**
+ * Vring worker threads
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+
+#include "platform.h"
+#include "worker.h"
+
+struct vhost_worker
+{
+    pthread_t thread;
+
+    /** CPU the thread is pinned to or -1 */
+    int cpu;
+
+    /** Event loop we run */
+    struct event_loop* evloop;
+
+    /** Eventfd to wake the thread up when it has to stop */
+    int stopfd;
+    struct event_cb stop_cb;
+    bool should_stop;
+};
+
+static void handle_stop_event(struct event_cb* cb, int fd, uint32_t events)
+{
+    struct vhost_worker* worker = cb->ptr;
+    __atomic_store_n(&worker->should_stop, true, __ATOMIC_RELEASE);
+}
+
+static void* worker_thread(void* arg)
+{
+    struct vhost_worker* worker = arg;
+
+    while (!__atomic_load_n(&worker->should_stop, __ATOMIC_ACQUIRE)) {
+        int error = evloop_run(worker->evloop);
+        if (error) {
+            VHOST_LOG_ERROR2(error, "worker %p: event loop failed", worker);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+struct vhost_worker* vhost_worker_create(int cpu, enum evloop_backend backend)
+{
+    int error = 0;
+    struct vhost_worker* worker = vhost_zalloc(sizeof(*worker));
+    worker->cpu = cpu;
+    worker->should_stop = false;
+
+    worker->evloop = evloop_create(backend);
+    if (!worker->evloop) {
+        goto free_worker;
+    }
+
+    worker->stopfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (worker->stopfd < 0) {
+        goto free_evloop;
+    }
+
+    worker->stop_cb = (struct event_cb){ EPOLLIN | EVLOOP_F_EVENTFD, worker, handle_stop_event };
+    error = evloop_add_fd(worker->evloop, worker->stopfd, &worker->stop_cb);
+    if (error) {
+        goto close_stopfd;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+
+    if (cpu >= 0) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(cpu, &cpuset);
+
+        error = pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
+        if (error) {
+            pthread_attr_destroy(&attr);
+            goto del_stopfd;
+        }
+    }
+
+    error = pthread_create(&worker->thread, &attr, worker_thread, worker);
+    pthread_attr_destroy(&attr);
+    if (error) {
+        goto del_stopfd;
+    }
+
+    return worker;
+
+del_stopfd:
+    evloop_del_fd(worker->evloop, worker->stopfd);
+close_stopfd:
+    close(worker->stopfd);
+free_evloop:
+    evloop_free(worker->evloop);
+free_worker:
+    vhost_free(worker);
+    return NULL;
+}
+
+void vhost_worker_destroy(struct vhost_worker* worker)
+{
+    if (!worker) {
+        return;
+    }
+
+    eventfd_write(worker->stopfd, 1);
+    pthread_join(worker->thread, NULL);
+
+    evloop_del_fd(worker->evloop, worker->stopfd);
+    close(worker->stopfd);
+    evloop_free(worker->evloop);
+    vhost_free(worker);
+}
+
+struct event_loop* vhost_worker_evloop(struct vhost_worker* worker)
+{
+    VHOST_VERIFY(worker);
+    return worker->evloop;
+}